@@ -0,0 +1,112 @@
+#include "probeinator.h"
+
+//
+// LCD frame buffer
+//
+// Nothing but the render task sends to the LCD (queued for the I2C bus
+// task on the board, see hal_esp32.cpp).  Everyone else writes into
+// frame, a pass of the render task compares it with what the LCD is showing
+// and only sends the cells that changed.  Redrawing the temps every poll
+// was ~80 characters over the I2C bus the ADS1115 is on, most seconds only
+// a couple of digits actually change
+//
+
+static char frame[LCD_ROWS][LCD_COLS]; // what the LCD should show
+static char shown[LCD_ROWS][LCD_COLS]; // what it's showing
+static bool shownValid = false;        // false = redraw everything next pass
+
+// Guards frame, only ever held for a copy
+SemaphoreHandle_t static frameMutex = xSemaphoreCreateMutex();
+
+static void displayTask(void *params) {
+  while(1) {
+    displayFlush();
+    vTaskDelay(DISPLAY_RENDER_INTERVAL / portTICK_PERIOD_MS);
+  }
+}
+
+// Blank frame, call after halDisplayBegin (which clears the LCD)
+void initDisplay() {
+  memset(frame, ' ', sizeof(frame));
+  memset(shown, ' ', sizeof(shown));
+  shownValid = true;
+}
+
+void startDisplayTask() {
+  xTaskCreatePinnedToCore(displayTask, "display", 2048, NULL, 1, NULL, ACQUISITION_CORE);
+}
+
+// Write text into the frame at col/row, anything past the edge is dropped
+void displayPrint(int col, int row, const char *text) {
+  if(row < 0 || row >= LCD_ROWS || col < 0) {
+    return;
+  }
+  if(xSemaphoreTake(frameMutex, MUTEX_W_TIMEOUT / portTICK_PERIOD_MS) != pdTRUE) {
+    Serial.println("!!! Couldn't get frame mutex");
+    return;
+  }
+  for (int i = 0; text[i] != 0 && col + i < LCD_COLS; i++) {
+    frame[row][col + i] = text[i];
+  }
+  xSemaphoreGive(frameMutex);
+}
+
+// Replace a whole row, padded out with spaces
+void displayLine(int row, const char *text) {
+  char line[LCD_COLS + 1];
+  snprintf(line, sizeof(line), "%-*s", LCD_COLS, text);
+  displayPrint(0, row, line);
+}
+
+void displayClear() {
+  for (int row = 0; row < LCD_ROWS; row++) {
+    displayLine(row, "");
+  }
+}
+
+// Send every cell again on the next pass, e.g. if the LCD was reset
+void displayInvalidate() {
+  shownValid = false;
+}
+
+// Send the cells that differ from what's shown.  Changed cells one apart
+// go as one run, re-sending a cell costs the same as moving the cursor.
+// If a write gets dropped everything is sent again next pass.  Returns
+// the characters sent
+int displayFlush() {
+  char wanted[LCD_ROWS][LCD_COLS];
+  if(xSemaphoreTake(frameMutex, MUTEX_R_TIMEOUT / portTICK_PERIOD_MS) != pdTRUE) {
+    return 0;
+  }
+  memcpy(wanted, frame, sizeof(frame));
+  xSemaphoreGive(frameMutex);
+
+  if(shownValid && memcmp(wanted, shown, sizeof(shown)) == 0) {
+    return 0;
+  }
+  bool sentAll = true;
+  int sent = 0;
+  for (int row = 0; row < LCD_ROWS; row++) {
+    int col = 0;
+    while(col < LCD_COLS) {
+      if(shownValid && wanted[row][col] == shown[row][col]) {
+        col++;
+        continue;
+      }
+      int end = col + 1;
+      while(end < LCD_COLS && (!shownValid || wanted[row][end] != shown[row][end] ||
+          (end + 1 < LCD_COLS && wanted[row][end + 1] != shown[row][end + 1]))) {
+        end++;
+      }
+      char run[LCD_COLS + 1];
+      memcpy(run, &wanted[row][col], end - col);
+      run[end - col] = 0;
+      sentAll &= halDisplayPrint(col, row, run);
+      sent += end - col;
+      col = end;
+    }
+  }
+  memcpy(shown, wanted, sizeof(shown));
+  shownValid = sentAll;
+  return sent;
+}
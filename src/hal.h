@@ -0,0 +1,34 @@
+#include <Arduino.h>
+
+//
+// Hardware abstraction
+//
+// Everything the acquisition -> storage -> JSON pipeline needs from the
+// board goes through here.  hal_esp32.cpp is the real thing, the native
+// build (src/native) swaps in a simulated probe rig.  Mutexes and tasks
+// stay on the FreeRTOS API, the native build has a small version of it
+//
+
+// ADC: single shot conversions from the bank of probe ADCs, every chip
+// converts at the same time
+void halAdcBegin();
+void halAdcStart(const int *channels); // start a conversion on channels[chip] of each chip, -1 leaves a chip out
+bool halAdcWait(int chip);             // wait for a chip's conversion, false if it never finished
+int16_t halAdcValue(int chip);         // result of the chip's last conversion
+double halAdcVoltage(int code);        // volts for a code at the current gain
+
+// Display: the 20x4 character LCD.  Writes can be queued and finish later,
+// false means the write was dropped
+void halDisplayBegin();
+bool halDisplayClear();
+bool halDisplayPrint(int col, int row, const char *text);
+
+// Clock: UTC seconds, NTP on the board
+void halClockBegin();
+void halClockUpdate();
+unsigned long halEpochTime();
+
+// Key-value store: small blobs kept across reboots, grouped in namespaces
+bool halStoreGet(const String &space, const char *key, void *value, size_t len);
+bool halStorePut(const String &space, const char *key, const void *value, size_t len);
+bool halStoreClear(const String &space);
@@ -0,0 +1,306 @@
+#include <ADS1X15.h>
+#include <LiquidCrystal_I2C.h>
+#include <NTPClient.h>
+#include <WiFiUdp.h>
+#include <Preferences.h>
+#include "probeinator.h"
+
+//
+// The real board: ADS_CHIPS ADS1115s on I2C from ADS_BASE_ADDRESS up, each
+// with ALERT/RDY wired to its own pin in ADS_READY_PINS, a 20x4 I2C LCD,
+// NTP for the clock and NVS preferences
+//
+
+static ADS1115 ads[ADS_MAX_CHIPS] = {
+  ADS1115(ADS_BASE_ADDRESS), ADS1115(ADS_BASE_ADDRESS + 1), ADS1115(ADS_BASE_ADDRESS + 2), ADS1115(ADS_BASE_ADDRESS + 3)
+};
+static const int adsReadyPins[ADS_MAX_CHIPS] = ADS_READY_PINS;
+static LiquidCrystal_I2C lcd(0x27, LCD_COLS, LCD_ROWS);
+static WiFiUDP ntpUDP;
+static NTPClient timeClient(ntpUDP);
+static Preferences preferences;
+
+//
+// I2C bus
+//
+// One task owns Wire and both devices on it, everyone else hands it
+// transactions through a queue per device.  A waiting conversion always
+// goes before LCD writes, and LCD writes are sent a character at a time
+// with waiting conversions served in between, so a conversion never waits
+// on the bus for more than one LCD byte.  A conversion transaction starts
+// one conversion on each ADS1115 and holds the bus from start to the last
+// result, the chips convert side by side.  Device setup (halAdcBegin, halDisplayBegin) is done
+// directly, it happens in setup before anything queues work
+//
+
+struct adcTransaction {
+  uint32_t seq;
+  int8_t channels[ADS_CHIPS]; // per chip, -1 = chip sits this one out
+  TaskHandle_t caller;        // notified when the results are in
+};
+
+struct displayTransaction {
+  bool clear;
+  uint8_t col;
+  uint8_t row;
+  char text[LCD_COLS + 1];
+};
+
+static QueueHandle_t adcQueue = NULL;
+static QueueHandle_t displayQueue = NULL;
+static SemaphoreHandle_t busWork = NULL; // one count per queued transaction
+static TaskHandle_t busTask = NULL;
+
+// Last conversions, written by the bus task before it notifies the caller
+static uint32_t adcSeq = 0;             // seq of the conversion asked for
+static volatile uint32_t adcDone = 0;   // seq of the last one finished
+static volatile bool adcOk[ADS_CHIPS];
+static volatile int16_t adcResult[ADS_CHIPS];
+
+// ALERT/RDY pulses when a conversion is done, set the chip's bit in the
+// bus task's notification value
+void IRAM_ATTR adsReadyISR(void *chip) {
+  BaseType_t woken = pdFALSE;
+  if(busTask != NULL) {
+    xTaskNotifyFromISR(busTask, 1 << (intptr_t)chip, eSetBits, &woken);
+  }
+  if(woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Start every chip's conversion, then sleep until their RDY interrupts
+// instead of delaying.  If an edge got missed ask the chip before giving
+// up on it
+static void runConversion(const adcTransaction *adc) {
+  unsigned long started = micros();
+  uint32_t waiting = 0;
+  uint32_t ready = 0;
+  xTaskNotifyWait(0, UINT32_MAX, NULL, 0); // drop any stale wakeups
+  for (int chip = 0; chip < ADS_CHIPS; chip++) {
+    if(adc->channels[chip] >= 0) {
+      ads[chip].requestADC(adc->channels[chip]);
+      waiting |= 1 << chip;
+    }
+  }
+  TickType_t deadline = xTaskGetTickCount() + ADS_READY_TIMEOUT / portTICK_PERIOD_MS;
+  while((ready & waiting) != waiting) {
+    TickType_t now = xTaskGetTickCount();
+    uint32_t bits = 0;
+    if((int32_t)(deadline - now) <= 0 || xTaskNotifyWait(0, UINT32_MAX, &bits, deadline - now) != pdTRUE) {
+      break;
+    }
+    ready |= bits;
+  }
+  for (int chip = 0; chip < ADS_CHIPS; chip++) {
+    if(waiting & (1 << chip)) {
+      bool ok = (ready & (1 << chip)) != 0 || !ads[chip].isBusy();
+      adcOk[chip] = ok;
+      if(ok) {
+        adcResult[chip] = ads[chip].getValue();
+      }
+    }
+  }
+  adcDone = adc->seq;
+  metricBusTime(METRIC_DEVICE_ADC, micros() - started);
+  xTaskNotifyGive(adc->caller);
+}
+
+// Run any conversions that are waiting, returns the us they took
+static unsigned long serveConversions() {
+  unsigned long started = micros();
+  adcTransaction adc;
+  while(xQueueReceive(adcQueue, &adc, 0) == pdTRUE) {
+    metricBusQueue(METRIC_DEVICE_ADC, uxQueueMessagesWaiting(adcQueue) + 1);
+    runConversion(&adc);
+  }
+  return micros() - started;
+}
+
+static void runDisplay(const displayTransaction *display) {
+  unsigned long started = micros();
+  unsigned long conversions = 0;
+  if(display->clear) {
+    lcd.clear();
+  } else {
+    lcd.setCursor(display->col, display->row);
+    for (int i = 0; display->text[i] != 0; i++) {
+      conversions += serveConversions();
+      lcd.write(display->text[i]);
+    }
+  }
+  metricBusTime(METRIC_DEVICE_LCD, micros() - started - conversions);
+}
+
+static void i2cBusTask(void *params) {
+  displayTransaction display;
+  while(1) {
+    xSemaphoreTake(busWork, portMAX_DELAY);
+    // conversions served in the middle of an LCD write leave spare counts
+    // behind, those passes just find nothing to do
+    serveConversions();
+    if(xQueueReceive(displayQueue, &display, 0) == pdTRUE) {
+      metricBusQueue(METRIC_DEVICE_LCD, uxQueueMessagesWaiting(displayQueue) + 1);
+      runDisplay(&display);
+    }
+  }
+}
+
+static void startBusTask() {
+  if(busTask != NULL) {
+    return;
+  }
+  adcQueue = xQueueCreate(I2C_ADC_QUEUE, sizeof(adcTransaction));
+  displayQueue = xQueueCreate(I2C_DISPLAY_QUEUE, sizeof(displayTransaction));
+  busWork = xSemaphoreCreateCounting(I2C_ADC_QUEUE + I2C_DISPLAY_QUEUE, 0);
+  xTaskCreatePinnedToCore(i2cBusTask, "i2cBus", 3072, NULL, configMAX_PRIORITIES - 1, &busTask, ACQUISITION_CORE);
+}
+
+//
+// ADC
+//
+
+// Set the ADS1115s up for single shot conversions that signal on ALERT/RDY
+void halAdcBegin() {
+  for (int chip = 0; chip < ADS_CHIPS; chip++) {
+    if(!ads[chip].begin()) {
+      Serial.println("!!! No ADS1115 for chip " + String(chip));
+    }
+    ads[chip].setMode(1); // single shot, every conversion is requested
+    ads[chip].setDataRate(ADS_DATA_RATE);
+    // these thresholds turn the ALERT pin into a conversion ready pin
+    ads[chip].setComparatorThresholdHigh(0x8000);
+    ads[chip].setComparatorThresholdLow(0x0000);
+    ads[chip].setComparatorQueConvert(0);
+
+    pinMode(adsReadyPins[chip], INPUT_PULLUP);
+    attachInterruptArg(digitalPinToInterrupt(adsReadyPins[chip]), adsReadyISR, (void *)(intptr_t)chip, FALLING);
+  }
+  startBusTask();
+}
+
+// Queue a conversion on every chip, one caller at a time (scanProbes
+// holds thermistorReadMutex)
+void halAdcStart(const int *channels) {
+  adcTransaction adc = {++adcSeq, {}, xTaskGetCurrentTaskHandle()};
+  for (int chip = 0; chip < ADS_CHIPS; chip++) {
+    adc.channels[chip] = channels[chip];
+  }
+  ulTaskNotifyTake(pdTRUE, 0); // drop a wakeup from a conversion we gave up on
+  if(xQueueSend(adcQueue, &adc, I2C_ADC_TIMEOUT / portTICK_PERIOD_MS) != pdTRUE) {
+    metricBusDropped(METRIC_DEVICE_ADC);
+    return;
+  }
+  xSemaphoreGive(busWork);
+}
+
+// Wait for the bus task to finish the conversions from halAdcStart.  A
+// late result from an earlier conversion doesn't count.  Once they're in
+// waiting on the other chips returns straight away
+bool halAdcWait(int chip) {
+  TickType_t deadline = xTaskGetTickCount() + I2C_ADC_TIMEOUT / portTICK_PERIOD_MS;
+  while(adcDone != adcSeq) {
+    TickType_t now = xTaskGetTickCount();
+    if((int32_t)(deadline - now) <= 0 || ulTaskNotifyTake(pdTRUE, deadline - now) == 0) {
+      return adcDone == adcSeq && adcOk[chip];
+    }
+  }
+  return adcOk[chip];
+}
+
+int16_t halAdcValue(int chip) {
+  return adcResult[chip];
+}
+
+// Every chip runs at the same gain
+double halAdcVoltage(int code) {
+  return ads[0].toVoltage(code);
+}
+
+//
+// Display, writes are queued for the bus task
+//
+
+void halDisplayBegin() {
+  lcd.init();
+  lcd.clear();
+  lcd.backlight();
+  startBusTask();
+}
+
+static bool queueDisplay(const displayTransaction *display) {
+  if(xQueueSend(displayQueue, display, MUTEX_W_TIMEOUT / portTICK_PERIOD_MS) != pdTRUE) {
+    metricBusDropped(METRIC_DEVICE_LCD);
+    return false;
+  }
+  xSemaphoreGive(busWork);
+  return true;
+}
+
+bool halDisplayClear() {
+  displayTransaction display = {true};
+  return queueDisplay(&display);
+}
+
+bool halDisplayPrint(int col, int row, const char *text) {
+  displayTransaction display = {false, (uint8_t)col, (uint8_t)row};
+  snprintf(display.text, sizeof(display.text), "%s", text);
+  return queueDisplay(&display);
+}
+
+//
+// Clock
+//
+
+// Start NTP and force the first update if needed
+void halClockBegin() {
+  timeClient.begin();
+  while(!timeClient.update()) {
+    timeClient.forceUpdate();
+  }
+}
+
+void halClockUpdate() {
+  timeClient.update();
+}
+
+unsigned long halEpochTime() {
+  return timeClient.getEpochTime();
+}
+
+//
+// Key-value store
+//
+
+bool halStoreGet(const String &space, const char *key, void *value, size_t len) {
+  bool found = false;
+  if(preferences.begin(space.c_str(), true)) {
+    if(preferences.isKey(key)) {
+      found = preferences.getBytes(key, value, len) > 0;
+    }
+    preferences.end();
+  } else {
+    Serial.println("!!! Couldn't open prefs " + space);
+  }
+  return found;
+}
+
+bool halStorePut(const String &space, const char *key, const void *value, size_t len) {
+  bool saved = false;
+  if(preferences.begin(space.c_str(), false)) {
+    saved = preferences.putBytes(key, value, len) == len;
+    preferences.end();
+  } else {
+    Serial.println("!!! Couldn't open write prefs " + space);
+  }
+  return saved;
+}
+
+bool halStoreClear(const String &space) {
+  bool cleared = false;
+  if(preferences.begin(space.c_str(), false)) {
+    cleared = preferences.clear();
+    preferences.end();
+  }
+  return cleared;
+}
@@ -0,0 +1,497 @@
+#include "probeinator.h"
+
+//
+// Compressed history archive
+//
+// Closed buckets from the coarse history tier end up here.  Each record is
+// a bucket number plus min/max/avg for every probe, packed Gorilla style:
+//
+//   bucket: delta-of-delta against the previous record
+//     '0'                    same spacing as last time (almost always)
+//     '10'   + 7 bits        dod in [-63, 64]
+//     '110'  + 9 bits        dod in [-255, 256]
+//     '1110' + 12 bits       dod in [-2047, 2048]
+//     '1111' + 32 bits       anything else
+//
+//   values: each stream (one probe's min, max or avg) only stores a value
+//   when it strays from the line through the last two it stored
+//     '0'                    on the line, within the deadband
+//     '1' + the value XORed with the last one stored:
+//       '0'                  same value
+//       '10' + bits          fits in the previous leading/trailing window
+//       '11' + 4 bits leading zeros + 4 bits (length - 1) + bits
+//
+// So each stream is its own series of points at whatever spacing the temp
+// needs, flat or steady stretches get one every ARCHIVE_MAX_HOLD buckets
+// and a lid opening gets one a bucket.  The deadband (ARCHIVE_DEADBAND) is
+// the most a value read back can be off.  It only matters to the encoder,
+// the decoder follows the same lines whatever it was.
+//
+// The first record of a block is stored raw so any block can be decoded
+// on its own.  Blocks are evicted oldest first once they're all in use.
+//
+// Nothing in here locks.  archiveAppend (from storeData) is the only writer
+// and replies decode blocks while it runs.  A record only counts once its
+// bits are all in, and archiveEpoch is odd while blocks are being reused
+// or cleared, archiveGet drops anything it decoded while it moved.
+
+struct archiveBlock {
+  std::atomic<unsigned long> firstBucket;
+  std::atomic<uint16_t> records;
+  std::atomic<uint16_t> bits;
+  std::atomic<uint8_t> data[ARCHIVE_BLOCK_SIZE];
+};
+
+// Encoder state for the block being written
+struct archiveWriter {
+  unsigned long bucket;
+  long delta;
+  archivePredictor predictors[ARCHIVE_STREAMS];
+  uint8_t leading[ARCHIVE_STREAMS];
+  uint8_t meaningful[ARCHIVE_STREAMS];
+};
+
+static archiveBlock archiveBlocks[ARCHIVE_BLOCKS];
+static std::atomic<unsigned long> archiveHead(0);  // seq of the block being written
+static std::atomic<unsigned long> archiveTail(0);  // seq of the oldest block still held
+static std::atomic<bool> archiveUsed(false);
+static std::atomic<unsigned long> archiveEpoch(0); // odd while blocks are being reused
+static archiveWriter writer;
+static std::atomic<int> archiveDeadband(ARCHIVE_DEADBAND); // tenths, applyPrefs sets it while storeData runs
+static unsigned long valuesStored = 0; // since the last clear, for printArchiveStats
+static unsigned long valuesPredicted = 0;
+
+static archiveBlock *getBlock(unsigned long seq) {
+  return &archiveBlocks[seq % ARCHIVE_BLOCKS];
+}
+
+//
+// Bit level reading and writing, most significant bit first
+//
+
+static void putBits(archiveBlock *block, uint32_t value, int count) {
+  uint16_t bits = block->bits.load(std::memory_order_relaxed);
+  for (int i = count - 1; i >= 0; i--) {
+    std::atomic<uint8_t> *byte = &block->data[bits / 8];
+    uint8_t mask = 0x80 >> (bits % 8);
+    uint8_t old = byte->load(std::memory_order_relaxed);
+    byte->store((value >> i) & 1 ? old | mask : old & ~mask, std::memory_order_relaxed);
+    bits++;
+  }
+  block->bits.store(bits, std::memory_order_relaxed);
+}
+
+// Reads past the end of the block come back as 0, a block reused while it
+// was being decoded can send a reader anywhere
+static uint32_t getBits(const archiveBlock *block, uint16_t *bitPos, int count) {
+  uint32_t value = 0;
+  for (int i = 0; i < count; i++) {
+    uint8_t byte = *bitPos / 8 < ARCHIVE_BLOCK_SIZE ? block->data[*bitPos / 8].load(std::memory_order_relaxed) : 0;
+    value = (value << 1) | ((byte >> (7 - *bitPos % 8)) & 1);
+    (*bitPos)++;
+  }
+  return value;
+}
+
+static int leadingZeros16(uint16_t value) {
+  int count = 0;
+  for (uint16_t mask = 0x8000; mask && !(value & mask); mask >>= 1) {
+    count++;
+  }
+  return count;
+}
+
+static int trailingZeros16(uint16_t value) {
+  int count = 0;
+  for (uint16_t mask = 1; mask && !(value & mask); mask <<= 1) {
+    count++;
+  }
+  return count;
+}
+
+//
+// Prediction, the same for the encoder and decoder
+//
+
+// Start a stream over from value, with no slope yet
+static void resetPredictor(archivePredictor *predictor, int16_t value, unsigned long bucket) {
+  predictor->anchor = value;
+  predictor->prevAnchor = value;
+  predictor->span = 0;
+  predictor->anchorBucket = bucket;
+}
+
+// A value was stored for bucket
+static void movePredictor(archivePredictor *predictor, int16_t value, unsigned long bucket) {
+  predictor->prevAnchor = predictor->anchor;
+  predictor->span = bucket - predictor->anchorBucket;
+  predictor->anchor = value;
+  predictor->anchorBucket = bucket;
+}
+
+// The value a stream reads back as for bucket when nothing was stored.
+// Holds the last value stored if there's no line to follow
+static int16_t predict(const archivePredictor *predictor, unsigned long bucket) {
+  if(predictor->anchor == BUCKET_NAN || predictor->prevAnchor == BUCKET_NAN || predictor->span == 0) {
+    return predictor->anchor;
+  }
+  long slope = (long)predictor->anchor - predictor->prevAnchor;
+  long value = predictor->anchor + slope * (long)(bucket - predictor->anchorBucket) / predictor->span;
+  return constrain(value, BUCKET_NAN + 1, INT16_MAX);
+}
+
+//
+// Encoding
+//
+
+static void putDeltaOfDelta(archiveBlock *block, long dod) {
+  if(dod == 0) {
+    putBits(block, 0, 1);
+  } else if(dod >= -63 && dod <= 64) {
+    putBits(block, 0b10, 2);
+    putBits(block, dod + 63, 7);
+  } else if(dod >= -255 && dod <= 256) {
+    putBits(block, 0b110, 3);
+    putBits(block, dod + 255, 9);
+  } else if(dod >= -2047 && dod <= 2048) {
+    putBits(block, 0b1110, 4);
+    putBits(block, dod + 2047, 12);
+  } else {
+    putBits(block, 0b1111, 4);
+    putBits(block, (uint32_t)dod, 32);
+  }
+}
+
+static void putValue(archiveBlock *block, int stream, int16_t value) {
+  uint16_t xored = (uint16_t)value ^ (uint16_t)writer.predictors[stream].anchor;
+
+  if(xored == 0) {
+    putBits(block, 0, 1);
+    return;
+  }
+
+  int leading = leadingZeros16(xored);
+  int trailing = trailingZeros16(xored);
+  int prevTrailing = 16 - writer.leading[stream] - writer.meaningful[stream];
+
+  // reuse the last window if the meaningful bits fit inside it
+  if(writer.meaningful[stream] > 0 && leading >= writer.leading[stream] && trailing >= prevTrailing) {
+    putBits(block, 0b10, 2);
+    putBits(block, xored >> prevTrailing, writer.meaningful[stream]);
+    return;
+  }
+
+  int meaningful = 16 - leading - trailing;
+  putBits(block, 0b11, 2);
+  putBits(block, leading, 4);
+  putBits(block, meaningful - 1, 4);
+  putBits(block, xored >> trailing, meaningful);
+  writer.leading[stream] = leading;
+  writer.meaningful[stream] = meaningful;
+}
+
+// Store value if the stream's line doesn't already give it closely enough
+static void putStream(archiveBlock *block, int stream, unsigned long bucket, int16_t value) {
+  archivePredictor *predictor = &writer.predictors[stream];
+  int16_t predicted = predict(predictor, bucket);
+  bool close = value == BUCKET_NAN || predicted == BUCKET_NAN ? value == predicted :
+    abs((long)value - predicted) <= archiveDeadband.load(std::memory_order_relaxed);
+  if(close && bucket - predictor->anchorBucket < ARCHIVE_MAX_HOLD) {
+    putBits(block, 0, 1);
+    valuesPredicted++;
+    return;
+  }
+  putBits(block, 1, 1);
+  putValue(block, stream, value);
+  movePredictor(predictor, value, bucket);
+  valuesStored++;
+}
+
+// Stream index for a probe's min/max/avg
+static int streamIndex(int probe, int stat) {
+  return probe * 3 + stat;
+}
+
+static int16_t statValue(const historyBucket *bucket, int stat) {
+  switch(stat) {
+    case STAT_MIN:
+      return bucket->min;
+    case STAT_MAX:
+      return bucket->max;
+    default:
+      return bucket->avg;
+  }
+}
+
+// Readers drop what they decode between these, see archiveGet
+static void beginReuse() {
+  archiveEpoch.store(archiveEpoch.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+static void endReuse() {
+  archiveEpoch.store(archiveEpoch.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Start a new block, evicting the oldest one if they're all in use
+static archiveBlock *startBlock(unsigned long bucket) {
+  unsigned long head = archiveHead.load(std::memory_order_relaxed);
+  unsigned long tail = archiveTail.load(std::memory_order_relaxed);
+  bool used = archiveUsed.load(std::memory_order_relaxed);
+  beginReuse();
+  if(used) {
+    head++;
+  }
+  if(head - tail >= ARCHIVE_BLOCKS) {
+    archiveTail.store(tail + 1, std::memory_order_relaxed);
+  }
+
+  archiveBlock *block = getBlock(head);
+  block->firstBucket.store(bucket, std::memory_order_relaxed);
+  block->records.store(0, std::memory_order_relaxed);
+  block->bits.store(0, std::memory_order_relaxed);
+  archiveHead.store(head, std::memory_order_relaxed);
+  archiveUsed.store(true, std::memory_order_relaxed);
+  endReuse();
+  return block;
+}
+
+// Empty the archive
+void archiveClear() {
+  beginReuse();
+  archiveHead.store(0, std::memory_order_relaxed);
+  archiveTail.store(0, std::memory_order_relaxed);
+  archiveUsed.store(false, std::memory_order_relaxed);
+  endReuse();
+  valuesStored = 0;
+  valuesPredicted = 0;
+}
+
+// Tenths of a degree archived values can be off by from here on, 0 keeps
+// every value exactly.  Archived buckets don't need re-encoding
+void archiveSetDeadband(int tenths) {
+  archiveDeadband.store(constrain(tenths, 0, ARCHIVE_MAX_DEADBAND), std::memory_order_relaxed);
+}
+
+int archiveGetDeadband() {
+  return archiveDeadband.load(std::memory_order_relaxed);
+}
+
+// Append the closed buckets (one per probe) for bucket number bucket.
+// Buckets have to be appended in order
+void archiveAppend(unsigned long bucket, const historyBucket *buckets) {
+  // a big jump forward (clock reset) would leave a huge hole, start over
+  if(archiveUsed.load(std::memory_order_relaxed) && bucket - writer.bucket > ARCHIVE_MAX_GAP) {
+    archiveClear();
+  }
+
+  archiveBlock *block = getBlock(archiveHead.load(std::memory_order_relaxed));
+  bool raw = !archiveUsed.load(std::memory_order_relaxed) ||
+    block->bits.load(std::memory_order_relaxed) + ARCHIVE_MAX_RECORD_BITS > ARCHIVE_BLOCK_SIZE * 8;
+  if(raw) {
+    block = startBlock(bucket);
+  }
+
+  if(raw) {
+    putBits(block, bucket, 32);
+    writer.delta = 1;
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      for (int stat = 0; stat < 3; stat++) {
+        int stream = streamIndex(probe, stat);
+        int16_t value = statValue(&buckets[probe], stat);
+        resetPredictor(&writer.predictors[stream], value, bucket);
+        writer.leading[stream] = 0;
+        writer.meaningful[stream] = 0;
+        putBits(block, (uint16_t)value, 16);
+        valuesStored++;
+      }
+    }
+  } else {
+    long delta = bucket - writer.bucket;
+    putDeltaOfDelta(block, delta - writer.delta);
+    writer.delta = delta;
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      for (int stat = 0; stat < 3; stat++) {
+        putStream(block, streamIndex(probe, stat), bucket, statValue(&buckets[probe], stat));
+      }
+    }
+  }
+  writer.bucket = bucket;
+  // publishes the record, readers never go past records
+  block->records.store(block->records.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+//
+// Decoding
+//
+
+static long getDeltaOfDelta(const archiveBlock *block, uint16_t *bitPos) {
+  if(getBits(block, bitPos, 1) == 0) {
+    return 0;
+  }
+  if(getBits(block, bitPos, 1) == 0) {
+    return (long)getBits(block, bitPos, 7) - 63;
+  }
+  if(getBits(block, bitPos, 1) == 0) {
+    return (long)getBits(block, bitPos, 9) - 255;
+  }
+  if(getBits(block, bitPos, 1) == 0) {
+    return (long)getBits(block, bitPos, 12) - 2047;
+  }
+  return (int32_t)getBits(block, bitPos, 32);
+}
+
+static void getValue(const archiveBlock *block, struct archiveReader *reader, int stream) {
+  archivePredictor *predictor = &reader->predictors[stream];
+  if(getBits(block, &reader->bitPos, 1) == 0) {
+    reader->values[stream] = predict(predictor, reader->bucket);
+    return;
+  }
+  uint16_t xored = 0;
+  if(getBits(block, &reader->bitPos, 1) == 1) {
+    if(getBits(block, &reader->bitPos, 1) == 1) {
+      reader->leading[stream] = getBits(block, &reader->bitPos, 4);
+      reader->meaningful[stream] = getBits(block, &reader->bitPos, 4) + 1;
+    }
+    int trailing = max(16 - reader->leading[stream] - reader->meaningful[stream], 0); // only < 0 for a reused block
+    xored = getBits(block, &reader->bitPos, reader->meaningful[stream]) << trailing;
+  }
+  reader->values[stream] = (uint16_t)predictor->anchor ^ xored;
+  movePredictor(predictor, reader->values[stream], reader->bucket);
+}
+
+// Decode the next record into reader, false when there are no more
+static bool readRecord(struct archiveReader *reader) {
+  if(!archiveUsed.load(std::memory_order_acquire)) {
+    return false;
+  }
+
+  archiveBlock *block = getBlock(reader->block);
+  if(reader->record >= block->records.load(std::memory_order_acquire)) {
+    // a block that's just been started has no records until its first is in
+    if(reader->block >= archiveHead.load(std::memory_order_acquire) ||
+        getBlock(reader->block + 1)->records.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+    reader->block++;
+    reader->record = 0;
+    reader->bitPos = 0;
+    block = getBlock(reader->block);
+  }
+
+  if(reader->record == 0) {
+    reader->bucket = getBits(block, &reader->bitPos, 32);
+    reader->delta = 1;
+    for (int stream = 0; stream < ARCHIVE_STREAMS; stream++) {
+      reader->values[stream] = getBits(block, &reader->bitPos, 16);
+      resetPredictor(&reader->predictors[stream], reader->values[stream], reader->bucket);
+      reader->leading[stream] = 0;
+      reader->meaningful[stream] = 0;
+    }
+  } else {
+    reader->delta += getDeltaOfDelta(block, &reader->bitPos);
+    reader->bucket += reader->delta;
+    for (int stream = 0; stream < ARCHIVE_STREAMS; stream++) {
+      getValue(block, reader, stream);
+    }
+  }
+  reader->record++;
+  reader->loaded = true;
+  return true;
+}
+
+// Point reader at the first record at or after bucket
+static void archiveSeek(struct archiveReader *reader, unsigned long bucket) {
+  unsigned long tail = archiveTail.load(std::memory_order_acquire);
+  unsigned long head = archiveHead.load(std::memory_order_acquire);
+  reader->block = tail;
+  for (unsigned long seq = tail + 1; seq <= head; seq++) {
+    if(getBlock(seq)->firstBucket.load(std::memory_order_relaxed) > bucket) {
+      break;
+    }
+    reader->block = seq;
+  }
+  reader->record = 0;
+  reader->bitPos = 0;
+  reader->loaded = false;
+
+  while(readRecord(reader) && reader->bucket < bucket) {}
+}
+
+// Oldest bucket in the archive, only valid if !archiveEmpty()
+unsigned long archiveFirstBucket() {
+  return getBlock(archiveTail.load(std::memory_order_acquire))->firstBucket.load(std::memory_order_relaxed);
+}
+
+bool archiveEmpty() {
+  return !archiveUsed.load(std::memory_order_acquire);
+}
+
+// Look up the archived bucket for a probe.  Buckets should be asked for in
+// increasing order, going backwards (or a block being started or evicted
+// since the last call) costs a seek.  Returns false if there's no record
+// for bucket, or blocks were reused while it was being decoded
+bool archiveGet(struct archiveReader *reader, unsigned long bucket, int probe, historyBucket *out) {
+  unsigned long epoch = archiveEpoch.load(std::memory_order_acquire);
+  if((epoch & 1) || !archiveUsed.load(std::memory_order_acquire)) {
+    return false;
+  }
+  if(!reader->loaded || reader->epoch != epoch || bucket < reader->bucket) {
+    archiveSeek(reader, bucket);
+    reader->epoch = epoch;
+  }
+  while(reader->loaded && reader->bucket < bucket && readRecord(reader)) {}
+
+  SNAPSHOT_CHECKPOINT(SNAPSHOT_CHECK_ARCHIVE);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if(archiveEpoch.load(std::memory_order_relaxed) != epoch) {
+    reader->loaded = false;
+    metricSnapshotRetry(METRIC_SNAPSHOT_HISTORY);
+    return false;
+  }
+  if(!reader->loaded || reader->bucket != bucket) {
+    return false;
+  }
+  out->avg = reader->values[streamIndex(probe, STAT_AVG)];
+  out->min = reader->values[streamIndex(probe, STAT_MIN)];
+  out->max = reader->values[streamIndex(probe, STAT_MAX)];
+  // each line strays on its own, keep min <= avg <= max
+  if(out->avg != BUCKET_NAN) {
+    out->min = out->min == BUCKET_NAN ? out->avg : min(out->min, out->avg);
+    out->max = max(out->max, out->avg);
+  }
+  return true;
+}
+
+// Buckets held and the bytes they take
+void archiveUsage(unsigned long *records, unsigned long *bytes) {
+  *records = 0;
+  *bytes = 0;
+  if(!archiveUsed.load(std::memory_order_acquire)) {
+    return;
+  }
+  unsigned long head = archiveHead.load(std::memory_order_acquire);
+  for (unsigned long seq = archiveTail.load(std::memory_order_acquire); seq <= head; seq++) {
+    *records += getBlock(seq)->records.load(std::memory_order_acquire);
+    *bytes += (getBlock(seq)->bits.load(std::memory_order_relaxed) + 7) / 8;
+  }
+}
+
+// Print how well the archive is packing, for dumpHistory
+void printArchiveStats() {
+  unsigned long records;
+  unsigned long bytes;
+  archiveUsage(&records, &bytes);
+  unsigned long head = archiveHead.load(std::memory_order_acquire);
+  unsigned long tail = archiveTail.load(std::memory_order_acquire);
+  bool used = archiveUsed.load(std::memory_order_acquire);
+  Serial.println("Archive: " + String(records) + " buckets in " + String(bytes) + " bytes, " +
+    String(head - tail + (used ? 1 : 0)) + "/" + String(ARCHIVE_BLOCKS) + " blocks");
+  if(records > 0) {
+    Serial.println("Archive bytes per bucket: " + String((float)bytes / records) + ", about " +
+      String(ARCHIVE_BLOCKS * ARCHIVE_BLOCK_SIZE * records / bytes) + " buckets when full");
+  }
+  if(valuesStored + valuesPredicted > 0) {
+    Serial.println("Archive deadband " + String(archiveGetDeadband() / 10.0) + "F, " +
+      String(100.0 * valuesPredicted / (valuesStored + valuesPredicted)) + "% of values left to the line");
+  }
+}
@@ -0,0 +1,278 @@
+#include "probeinator.h"
+
+//
+// Flash history log
+//
+// Closed buckets from the logged tiers are appended to a log on SPIFFS so
+// the graph survives a reset.  Records are gathered into a page in RAM and
+// only whole pages are written, by a low priority task so a slow flash
+// write never holds up acquisition.  The log is split into segment files
+// /hlog<seq>, once LOG_SEGMENTS are in use the oldest is deleted.
+//
+// Every boot starts a new segment so nothing is ever appended after a page
+// that was cut short by a power loss.  Readers skip records that fail
+// their check and stop reading a segment at a short one.
+
+// Pages only hold whole records, with 4 probes a record is 32 bytes and a
+// page is exactly LOG_PAGE_SIZE
+#define LOG_PAGE_RECORDS (LOG_PAGE_SIZE / sizeof(historyLogRecord))
+
+static_assert(LOG_PAGE_RECORDS > 0, "history log pages should hold at least one record");
+
+struct logPage {
+  historyLogRecord records[LOG_PAGE_RECORDS];
+};
+
+static logPage currentPage;            // records not handed to the log task yet
+static unsigned int pageRecords = 0;
+// Only the log task moves these, replies read them while it does.  logHead
+// only moves once the segment has a page in it and logTail moves before
+// the segment goes
+static std::atomic<unsigned long> logHead(0); // seq of the segment being written
+static std::atomic<unsigned long> logTail(0); // seq of the oldest segment kept
+static std::atomic<int> headPages(0);         // pages written to the head segment
+static unsigned long droppedPages = 0; // pages lost because the log task fell behind
+static bool logReady = false;
+static QueueHandle_t logQueue = NULL;
+
+// Guards currentPage, only ever held for a copy
+SemaphoreHandle_t static logMutex = xSemaphoreCreateMutex();
+
+static String segmentPath(unsigned long seq) {
+  return "/hlog" + String(seq);
+}
+
+static uint16_t fletcher16(const uint8_t *data, size_t len) {
+  uint16_t a = 0;
+  uint16_t b = 0;
+  for (size_t i = 0; i < len; i++) {
+    a = (a + data[i]) % 255;
+    b = (b + a) % 255;
+  }
+  return (b << 8) | a;
+}
+
+static uint16_t recordCheck(const historyLogRecord *record) {
+  return fletcher16((const uint8_t *)record, offsetof(historyLogRecord, check));
+}
+
+// Time the bucket in a record ends, records are logged in this order
+static unsigned long recordEnd(const historyLogRecord *record) {
+  return (record->bucket + 1) * record->resolution;
+}
+
+static File openSegment(unsigned long seq) {
+  String path = segmentPath(seq);
+  if(!SPIFFS.exists(path)) {
+    return File();
+  }
+  return SPIFFS.open(path, FILE_READ);
+}
+
+// Read the next good record, skipping any that fail their check.  False at
+// the end of the file, including a record cut short by a power loss
+static bool readRecord(File &file, historyLogRecord *record) {
+  while(file.read((uint8_t *)record, sizeof(*record)) == sizeof(*record)) {
+    if(record->check == recordCheck(record)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// Writing
+//
+
+// Append a full page to the head segment, starting a new segment (and
+// dropping the oldest) when the head one is full
+static void writePage(const logPage *page) {
+  unsigned long head = logHead.load(std::memory_order_relaxed);
+  if(headPages.load(std::memory_order_relaxed) >= LOG_SEGMENT_PAGES) {
+    head++;
+  }
+  for (unsigned long tail = logTail.load(std::memory_order_relaxed); head - tail >= LOG_SEGMENTS; tail++) {
+    logTail.store(tail + 1, std::memory_order_release);
+    SPIFFS.remove(segmentPath(tail));
+  }
+
+  File file = SPIFFS.open(segmentPath(head), FILE_APPEND);
+  if(!file) {
+    Serial.println("!!! Couldn't open history log segment " + String(head));
+    return;
+  }
+  if(file.write((const uint8_t *)page, sizeof(*page)) != sizeof(*page)) {
+    Serial.println("!!! Short write to history log segment " + String(head));
+  }
+  file.close();
+  if(head != logHead.load(std::memory_order_relaxed)) {
+    headPages.store(0, std::memory_order_relaxed);
+    logHead.store(head, std::memory_order_release);
+  }
+  headPages.store(headPages.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Writes pages as they fill up, kept off the acquisition task
+static void historyLogTask(void *params) {
+  logPage page;
+  while(1) {
+    if(xQueueReceive(logQueue, &page, portMAX_DELAY) == pdTRUE) {
+      writePage(&page);
+    }
+  }
+}
+
+// Find the segments left over from before a reboot and start the log task.
+// Call once SPIFFS is mounted
+void initHistoryLog() {
+  bool found = false;
+  unsigned long head = 0;
+  unsigned long tail = 0;
+  File root = SPIFFS.open("/");
+  File file = root.openNextFile();
+  while(file) {
+    String name = file.name();
+    name = name.substring(name.lastIndexOf('/') + 1);
+    if(name.startsWith("hlog")) {
+      unsigned long seq = name.substring(4).toInt();
+      if(!found || seq < tail) {
+        tail = seq;
+      }
+      if(!found || seq > head) {
+        head = seq;
+      }
+      found = true;
+    }
+    file = root.openNextFile();
+  }
+
+  // never append to a segment that may have been cut short
+  if(found) {
+    head++;
+  }
+  logHead.store(head, std::memory_order_relaxed);
+  logTail.store(tail, std::memory_order_relaxed);
+  headPages.store(0, std::memory_order_relaxed);
+
+  logQueue = xQueueCreate(LOG_QUEUE_PAGES, sizeof(logPage));
+  xTaskCreate(historyLogTask, "historyLog", 3072, NULL, 1, NULL);
+  logReady = true;
+}
+
+// Log the closed bucket for one tier.  Only copies into the page in RAM,
+// a full page is handed to the log task without waiting
+void historyLogAppend(unsigned long bucket, int resolution, const historyBucket *buckets) {
+  if(!logReady) {
+    return;
+  }
+  if(xSemaphoreTake(logMutex, MUTEX_W_TIMEOUT / portTICK_PERIOD_MS) != pdTRUE) {
+    Serial.println("!!! Couldn't get history log mutex, bucket not logged");
+    return;
+  }
+
+  historyLogRecord *record = &currentPage.records[pageRecords];
+  record->bucket = bucket;
+  record->resolution = resolution;
+  memcpy(record->buckets, buckets, sizeof(record->buckets));
+  record->check = recordCheck(record);
+  pageRecords++;
+
+  if(pageRecords == LOG_PAGE_RECORDS) {
+    if(xQueueSend(logQueue, &currentPage, 0) != pdTRUE) {
+      droppedPages++;
+    }
+    pageRecords = 0;
+  }
+  xSemaphoreGive(logMutex);
+}
+
+//
+// Reading
+//
+
+// Point reader at the segment holding the first record that ends at or
+// after endTime.  Segments are checked by their first record so this
+// doesn't read the whole log
+void historyLogRewind(struct historyLogReader *reader, unsigned long endTime) {
+  historyLogRecord first;
+  unsigned long head = logHead.load(std::memory_order_acquire);
+  unsigned long tail = logTail.load(std::memory_order_acquire);
+
+  reader->segment = tail;
+  for (unsigned long seq = tail + 1; seq <= head; seq++) {
+    File file = openSegment(seq);
+    if(!file || !readRecord(file, &first) || recordEnd(&first) >= endTime) {
+      break;
+    }
+    reader->segment = seq;
+  }
+
+  reader->file = openSegment(reader->segment);
+  reader->pageRecord = -1;
+  reader->started = true;
+  reader->loaded = false;
+  reader->done = false;
+}
+
+// Read the next record into reader->record, false at the end of the log.
+// After the last segment the records that haven't been written yet are read
+// from RAM.  A page on its way to flash can be missed, it shows up next time
+bool historyLogNext(struct historyLogReader *reader) {
+  reader->loaded = false;
+  if(reader->done) {
+    return false;
+  }
+
+  while(reader->pageRecord < 0) {
+    if(reader->file && readRecord(reader->file, &reader->record)) {
+      reader->loaded = true;
+      return true;
+    }
+    // end of the segment
+    reader->file.close();
+    if(reader->segment >= logHead.load(std::memory_order_acquire)) {
+      reader->pageRecord = 0;
+      break;
+    }
+    // the segment we were on may have been deleted under us
+    reader->segment = max(reader->segment + 1, logTail.load(std::memory_order_acquire));
+    reader->file = openSegment(reader->segment);
+  }
+
+  if(xSemaphoreTake(logMutex, MUTEX_R_TIMEOUT / portTICK_PERIOD_MS) == pdTRUE) {
+    if((unsigned int)reader->pageRecord < pageRecords) {
+      reader->record = currentPage.records[reader->pageRecord++];
+      reader->loaded = true;
+    }
+    xSemaphoreGive(logMutex);
+  }
+  reader->done = !reader->loaded;
+  return reader->loaded;
+}
+
+// Look up the logged bucket for a probe.  Like archiveGet buckets should be
+// asked for in increasing order, going backwards costs a rewind.  Returns
+// false if there's no record for bucket
+bool historyLogGet(struct historyLogReader *reader, int resolution, unsigned long bucket, int probe, historyBucket *out) {
+  if(!reader->started || bucket < reader->target) {
+    historyLogRewind(reader, (bucket + 1) * resolution);
+    historyLogNext(reader);
+  }
+  reader->target = bucket;
+
+  while(reader->loaded && (reader->record.resolution != resolution || reader->record.bucket < bucket)) {
+    historyLogNext(reader);
+  }
+  if(!reader->loaded || reader->record.bucket != bucket) {
+    return false;
+  }
+  *out = reader->record.buckets[probe];
+  return true;
+}
+
+// Print where the log is at, for dumpHistory
+void printHistoryLogStats() {
+  Serial.println("History log: segments " + String(logTail.load(std::memory_order_relaxed)) + "-" +
+    String(logHead.load(std::memory_order_relaxed)) + ", " + String(headPages.load(std::memory_order_relaxed)) + "/" + String(LOG_SEGMENT_PAGES) + " pages in the head segment, " +
+    String(pageRecords) + " records in RAM, " + String(droppedPages) + " pages dropped");
+}
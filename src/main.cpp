@@ -1,64 +1,33 @@
 // Defaults are in here
-#include "probeinator.h"
+#include "webHandlers.h"
 
-// Web & UI
-#include <LiquidCrystal_I2C.h>
+#include "secrets.h" // needs to provide WIFI_NAME / WIFI_PW you need to create this
 
-LiquidCrystal_I2C lcd(0x27,20,4);  
+static const char* ssid = WIFI_NAME; // SSID
+static const char* password = WIFI_PW; // Password
 
 
 //
-// This is the main loop for data acquisition
+// Data acquisition, see the acquisition pipeline in probeinator.cpp
 //
-void getDataTask(void* params){
-  pinDetails* pin_config = (pinDetails*) params;
-  
+static TaskHandle_t processingTaskHandle = NULL;
+
+// Scan the probes as often as nextScanInterval says, on a schedule
+// however long processing takes
+void samplerTask(void* params){
+  TickType_t lastWake = xTaskGetTickCount();
   while(1) {
-    double Vref = INPUT_VOLTAGE;
-    struct temperatureUpdate updateStruct;
-    String lcdLine;
-
-    // Set the update time
-    updateStruct.updateTime = timeClient.getEpochTime();
-
-    // loop through the probes and ...  
-    for (int probe = 0; probe < NUM_PROBES; probe++) {
-      // ... get the voltage from the sensor on the thermistor's divider and ...
-      double thermistorVoltage = getThermistorVoltage(pinConfig.adsChannels[probe]);
-      // ... figure out the resistance of the thermistor then ...
-      double resistance = getResistance(BALANCE_RESISTOR, Vref, thermistorVoltage);
-      // ... and we finally figure out the temperature for that particular resistance
-      double temp_k = getTempK(BETA, ROOM_TEMP, RESISTOR_ROOM_TEMP,resistance);
-
-      
-
-      float temp_f = kToF(temp_k);
-      String temperature_display;
-
-      // If resistance is low, assume there's no probe and set the connected state
-      // Set some values and the string to display on the lcd
-      if(resistance < 10000) {
-        temp_f = nanf("");
-        temperature_display = "--  "; // spaces here are to ensure we overwrite the F when the prev val was 111F
-        updateStruct.connected[probe] = false;
-      }
-      else{
-        temperature_display = String(temp_f) + String("F");
-        updateStruct.connected[probe] = true;
-      }
-      
-      // set the temp in the update struct and update the LCD
-      updateStruct.temperatures[probe] = temp_f;
-      lcd.setCursor(0,probe);
-      lcdLine = getProbeName(probe) + ": " + String(temperature_display);
-      lcd.print(lcdLine);
-      lcd.print(lcdLineClear(lcdLine.length())); // clear the rest of the line
-      //printData(pinConfig.adsChannels[probe], thermistorVoltage, temp_k, resistance);
-    }
-    // push the current temperature into the storage FIFO
-    storeData(updateStruct);
-    saveLastTemps(updateStruct);
-    vTaskDelay(MAIN_LOOP_INTERVAL / portTICK_PERIOD_MS);
+    sampleProbes();
+    xTaskNotifyGive(processingTaskHandle);
+    vTaskDelayUntil(&lastWake, nextScanInterval() / portTICK_PERIOD_MS);
+  }
+}
+
+// Store and publish whatever the sampler has queued
+void processingTask(void* params){
+  while(1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    processReadings();
   }
 }
 
@@ -83,19 +52,17 @@ void setup()
   
 
   // init the lcd
-  lcd.init();
-  lcd.clear();         
-  lcd.backlight(); 
+  halDisplayBegin();
+  initDisplay();
 
   // Start services
 
-  ADS.begin();
+  halAdcBegin();
+  initTempTables();
+  initProbeFilters();
 
  // Start NTP and force the first update if needed
-  timeClient.begin();
-  while(!timeClient.update()) {
-    timeClient.forceUpdate();
-  }
+  halClockBegin();
   
 
   
@@ -105,7 +72,12 @@ void setup()
     return;
   }
 
+  // pick the history back up from flash
+  initHistoryLog();
+  restoreHistory();
+
   // Start the web server
+  initStaticAssets();
   initWebRoutes();
 
   // print the start config
@@ -113,16 +85,12 @@ void setup()
   
 
   // Show the splash screen
-  lcd.setCursor(0,0);
-  lcd.print("    Probeinator");
-  lcd.setCursor(0,1);
-  lcd.print("IP: ");
-  lcd.print(WiFi.localIP().toString());
-  lcd.setCursor(0,2);
-  lcd.print(getTimeString(myTZ.toLocal(timeClient.getEpochTime())));
+  displayLine(0, "    Probeinator");
+  displayLine(1, ("IP: " + WiFi.localIP().toString()).c_str());
+  displayLine(2, getTimeString(myTZ.toLocal(halEpochTime())).c_str());
+  displayFlush();
   vTaskDelay(SPLASH_SCREEN_DELAY / portTICK_RATE_MS);
-  lcd.clear();
-  vTaskDelay(100 / portTICK_RATE_MS); // pause briefly for the lcd.clear
+  displayClear();
 
 
   //
@@ -130,15 +98,29 @@ void setup()
   //
   
 
-  // Start the collection task
-  TaskHandle_t xHandle = NULL;
-  xTaskCreate(
-    getDataTask,
-    "getData",
+  // Only the render task talks to the LCD from here on
+  startDisplayTask();
+
+  // Start the collection tasks.  Both stay on ACQUISITION_CORE with the I2C
+  // bus task, WiFi and the web server (CONFIG_ASYNC_TCP_RUNNING_CORE) are on
+  // the other one.  Processing is lower priority so it never holds up a scan
+  xTaskCreatePinnedToCore(
+    processingTask,
+    "processing",
+    4096,
+    NULL,
+    5,
+    &processingTaskHandle,
+    ACQUISITION_CORE
+  );
+  xTaskCreatePinnedToCore(
+    samplerTask,
+    "sampler",
     2048,
-    (void *) &pinConfig,
-    24,
-    &xHandle
+    NULL,
+    23,
+    NULL,
+    ACQUISITION_CORE
   );
 
   Serial.println("... probeinator loaded");
@@ -147,7 +129,7 @@ void setup()
 
 void loop() 
 {  
-  timeClient.update();
+  halClockUpdate();
   vTaskDelay(MAIN_LOOP_INTERVAL / portTICK_PERIOD_MS);
 }
 
@@ -0,0 +1,280 @@
+#include <atomic>
+#include "probeinator.h"
+
+//
+// Metrics
+//
+// Timings go into fixed histogram buckets and counts are atomics, so
+// recording one is a couple of relaxed adds and never takes a lock.
+// getMetricsText renders everything in the Prometheus text format for
+// /metrics.  Reads aren't a consistent snapshot, a count can be one ahead
+// of its sum, which is fine for scraping.  Everything is 32 bits, 64 bit
+// atomics take a lock on the ESP32
+//
+
+// Upper bounds of the histogram buckets in us, anything past the last one
+// lands in +Inf
+static const unsigned long metricBounds[METRIC_BUCKETS] = {
+  50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+
+// A total of us that would run past 32 bits in a bit over an hour.  Each
+// time it wraps the add that did it counts the wrap, the two are put back
+// together at scrape time
+struct metricSum {
+  std::atomic<uint32_t> micros;
+  std::atomic<uint32_t> wraps;
+};
+
+struct metricHistogram {
+  std::atomic<uint32_t> counts[METRIC_BUCKETS + 1]; // per bucket, not cumulative
+  metricSum sum;
+};
+
+static metricHistogram acquireTime;
+static metricHistogram readingLatency;
+static metricHistogram scanJitter;
+static metricSum scanIntervalSum;
+static std::atomic<uint32_t> scanIntervalCount;
+static std::atomic<uint32_t> ringMaxDepth;
+static std::atomic<uint32_t> ringDropped;
+static metricHistogram adcTime[NUM_PROBES];
+static metricHistogram serializeTime[METRIC_REPLIES];
+static metricHistogram mutexWait[METRIC_MUTEXES];
+static std::atomic<uint32_t> mutexTimeouts[METRIC_MUTEXES];
+static std::atomic<uint32_t> snapshotRetries[METRIC_SNAPSHOTS];
+static metricHistogram busTime[METRIC_DEVICES];
+static std::atomic<uint32_t> busQueueDepth[METRIC_DEVICES];    // depth the last transaction saw
+static std::atomic<uint32_t> busQueueMaxDepth[METRIC_DEVICES];
+static std::atomic<uint32_t> busDropped[METRIC_DEVICES];
+
+static const char *replyNames[METRIC_REPLIES] = {"lastTemps", "historyChunk", "historyEvent", "metrics"};
+static const char *mutexNames[METRIC_MUTEXES] = {"thermistorRead"};
+static const char *snapshotNames[METRIC_SNAPSHOTS] = {"lastTemps", "history"};
+static const char *deviceNames[METRIC_DEVICES] = {"adc", "lcd"};
+
+// Tasks whose stack high-water marks are reported, looked up by name
+static const char *metricTasks[] = {"sampler", "processing", "i2cBus", "display", "historyLog", "events", "loopTask",
+  "async_tcp"};
+
+static void addSum(metricSum *sum, unsigned long elapsed) {
+  uint32_t old = sum->micros.fetch_add(elapsed, std::memory_order_relaxed);
+  if(old > UINT32_MAX - (uint32_t)elapsed) {
+    sum->wraps.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// In seconds.  A scrape that races a wrap can come out 4295 s short, the
+// next one is right again
+static double readSum(metricSum *sum) {
+  uint32_t wraps = sum->wraps.load(std::memory_order_relaxed);
+  return (wraps * 4294967296.0 + sum->micros.load(std::memory_order_relaxed)) / 1e6;
+}
+
+static void observe(metricHistogram *histogram, unsigned long elapsed) {
+  int bucket = 0;
+  while(bucket < METRIC_BUCKETS && elapsed > metricBounds[bucket]) {
+    bucket++;
+  }
+  histogram->counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  addSum(&histogram->sum, elapsed);
+}
+
+// One scan of the probes took elapsed us
+void metricAcquireTime(unsigned long elapsed) {
+  observe(&acquireTime, elapsed);
+}
+
+// The sampler started a scan elapsed us after the one before, when it
+// meant to wait scheduled ms.  How far off it was either way is the jitter
+void metricScanInterval(unsigned long elapsed, unsigned long scheduled) {
+  long late = (long)elapsed - (long)scheduled * 1000L;
+  observe(&scanJitter, late < 0 ? -late : late);
+  addSum(&scanIntervalSum, elapsed);
+  scanIntervalCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A reading showed up in /getLastTemps elapsed us after its scan finished
+void metricReadingLatency(unsigned long elapsed) {
+  observe(&readingLatency, elapsed);
+}
+
+// The sampler left depth readings in the ring
+void metricRingDepth(int depth) {
+  if((uint32_t)depth > ringMaxDepth.load(std::memory_order_relaxed)) {
+    ringMaxDepth.store(depth, std::memory_order_relaxed); // only the sampler writes it
+  }
+}
+
+// The ring was full and a reading was thrown away
+void metricRingDropped() {
+  ringDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A conversion on a probe's channel took elapsed us, start to result
+void metricAdcTime(int probe, unsigned long elapsed) {
+  observe(&adcTime[probe], elapsed);
+}
+
+// Building (part of) a reply took elapsed us
+void metricSerializeTime(int reply, unsigned long elapsed) {
+  observe(&serializeTime[reply], elapsed);
+}
+
+// A transaction held the I2C bus for elapsed us
+void metricBusTime(int device, unsigned long elapsed) {
+  observe(&busTime[device], elapsed);
+}
+
+// A transaction was taken off a bus queue that held depth including it
+void metricBusQueue(int device, int depth) {
+  busQueueDepth[device].store(depth, std::memory_order_relaxed);
+  if((uint32_t)depth > busQueueMaxDepth[device].load(std::memory_order_relaxed)) {
+    busQueueMaxDepth[device].store(depth, std::memory_order_relaxed); // only the bus task writes it
+  }
+}
+
+// A transaction couldn't be queued for the bus
+void metricBusDropped(int device) {
+  busDropped[device].fetch_add(1, std::memory_order_relaxed);
+}
+
+// xSemaphoreTake that records how long it waited and whether it gave up
+bool takeMutex(SemaphoreHandle_t mutex, int timeoutMs, int which) {
+  unsigned long started = micros();
+  bool taken = xSemaphoreTake(mutex, timeoutMs / portTICK_PERIOD_MS) == pdTRUE;
+  observe(&mutexWait[which], micros() - started);
+  if(!taken) {
+    mutexTimeouts[which].fetch_add(1, std::memory_order_relaxed);
+  }
+  return taken;
+}
+
+// A lock free read ran into the writer and had to start over (or drop
+// a history row)
+void metricSnapshotRetry(int which) {
+  snapshotRetries[which].fetch_add(1, std::memory_order_relaxed);
+}
+
+//
+// Prometheus text
+//
+
+static void metricHeader(String &out, const char *name, const char *type, const char *help) {
+  out += "# HELP " + String(name) + " " + help + "\n";
+  out += "# TYPE " + String(name) + " " + type + "\n";
+}
+
+// One series of a histogram, labels is either empty or `name="value",`
+static void renderHistogram(String &out, const char *name, const String &labels, metricHistogram *histogram) {
+  char line[128];
+  uint32_t total = 0;
+  for (int bucket = 0; bucket <= METRIC_BUCKETS; bucket++) {
+    total += histogram->counts[bucket].load(std::memory_order_relaxed);
+    if(bucket < METRIC_BUCKETS) {
+      snprintf(line, sizeof(line), "%s_bucket{%sle=\"%g\"} %u\n", name, labels.c_str(), metricBounds[bucket] / 1e6, total);
+    } else {
+      snprintf(line, sizeof(line), "%s_bucket{%sle=\"+Inf\"} %u\n", name, labels.c_str(), total);
+    }
+    out += line;
+  }
+  String plainLabels = labels.length() > 0 ? "{" + labels.substring(0, labels.length() - 1) + "}" : "";
+  snprintf(line, sizeof(line), "%s_sum%s %.6f\n", name, plainLabels.c_str(), readSum(&histogram->sum));
+  out += line;
+  snprintf(line, sizeof(line), "%s_count%s %u\n", name, plainLabels.c_str(), total);
+  out += line;
+}
+
+static void renderGauge(String &out, const char *name, const String &labels, double value) {
+  out += String(name) + labels + " " + String(value, 0) + "\n";
+}
+
+// Everything but the Wi-Fi gauges, those are added by the /metrics route
+String getMetricsText() {
+  String out;
+  out.reserve(8192);
+
+  metricHeader(out, "probeinator_acquire_seconds", "histogram", "Time taken by one scan of the probes");
+  renderHistogram(out, "probeinator_acquire_seconds", "", &acquireTime);
+
+  char line[128];
+  metricHeader(out, "probeinator_scan_interval_seconds", "summary", "Time from the start of one scan of the probes to the start of the next");
+  snprintf(line, sizeof(line), "probeinator_scan_interval_seconds_sum %.6f\nprobeinator_scan_interval_seconds_count %u\n",
+    readSum(&scanIntervalSum), scanIntervalCount.load(std::memory_order_relaxed));
+  out += line;
+  metricHeader(out, "probeinator_scan_jitter_seconds", "histogram", "How far each scan interval was from the one the sampler scheduled");
+  renderHistogram(out, "probeinator_scan_jitter_seconds", "", &scanJitter);
+
+  metricHeader(out, "probeinator_reading_latency_seconds", "histogram", "Time from the end of a scan to its temps being in /getLastTemps");
+  renderHistogram(out, "probeinator_reading_latency_seconds", "", &readingLatency);
+
+  metricHeader(out, "probeinator_reading_ring_max_depth", "gauge", "Most readings waiting for processing since boot");
+  renderGauge(out, "probeinator_reading_ring_max_depth", "", ringMaxDepth.load(std::memory_order_relaxed));
+  metricHeader(out, "probeinator_reading_ring_dropped_total", "counter", "Readings dropped because processing fell behind");
+  renderGauge(out, "probeinator_reading_ring_dropped_total", "", ringDropped.load(std::memory_order_relaxed));
+
+  metricHeader(out, "probeinator_adc_read_seconds", "histogram", "ADS1115 conversion time, start to result, per probe");
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    renderHistogram(out, "probeinator_adc_read_seconds", "chip=\"" + String(probeChip(probe)) + "\",channel=\"" +
+      String(probeChannel(probe)) + "\",", &adcTime[probe]);
+  }
+
+  metricHeader(out, "probeinator_serialize_seconds", "histogram", "Time spent building replies");
+  for (int reply = 0; reply < METRIC_REPLIES; reply++) {
+    renderHistogram(out, "probeinator_serialize_seconds", "reply=\"" + String(replyNames[reply]) + "\",", &serializeTime[reply]);
+  }
+
+  metricHeader(out, "probeinator_mutex_wait_seconds", "histogram", "Time spent waiting to take a mutex");
+  for (int mutex = 0; mutex < METRIC_MUTEXES; mutex++) {
+    renderHistogram(out, "probeinator_mutex_wait_seconds", "mutex=\"" + String(mutexNames[mutex]) + "\",", &mutexWait[mutex]);
+  }
+
+  metricHeader(out, "probeinator_mutex_timeouts_total", "counter", "Mutex takes that gave up");
+  for (int mutex = 0; mutex < METRIC_MUTEXES; mutex++) {
+    renderGauge(out, "probeinator_mutex_timeouts_total", "{mutex=\"" + String(mutexNames[mutex]) + "\"}",
+      mutexTimeouts[mutex].load(std::memory_order_relaxed));
+  }
+
+  metricHeader(out, "probeinator_snapshot_retries_total", "counter", "Lock free reads that ran into the writer and started over");
+  for (int snapshot = 0; snapshot < METRIC_SNAPSHOTS; snapshot++) {
+    renderGauge(out, "probeinator_snapshot_retries_total", "{snapshot=\"" + String(snapshotNames[snapshot]) + "\"}",
+      snapshotRetries[snapshot].load(std::memory_order_relaxed));
+  }
+
+  metricHeader(out, "probeinator_i2c_busy_seconds", "histogram", "Time a transaction held the I2C bus");
+  for (int device = 0; device < METRIC_DEVICES; device++) {
+    renderHistogram(out, "probeinator_i2c_busy_seconds", "device=\"" + String(deviceNames[device]) + "\",", &busTime[device]);
+  }
+
+  metricHeader(out, "probeinator_i2c_queue_depth", "gauge", "Transactions queued for the I2C bus, as the last one saw it");
+  for (int device = 0; device < METRIC_DEVICES; device++) {
+    renderGauge(out, "probeinator_i2c_queue_depth", "{device=\"" + String(deviceNames[device]) + "\"}",
+      busQueueDepth[device].load(std::memory_order_relaxed));
+  }
+  metricHeader(out, "probeinator_i2c_queue_max_depth", "gauge", "Most transactions queued for the I2C bus since boot");
+  for (int device = 0; device < METRIC_DEVICES; device++) {
+    renderGauge(out, "probeinator_i2c_queue_max_depth", "{device=\"" + String(deviceNames[device]) + "\"}",
+      busQueueMaxDepth[device].load(std::memory_order_relaxed));
+  }
+  metricHeader(out, "probeinator_i2c_dropped_total", "counter", "Transactions that couldn't be queued for the I2C bus");
+  for (int device = 0; device < METRIC_DEVICES; device++) {
+    renderGauge(out, "probeinator_i2c_dropped_total", "{device=\"" + String(deviceNames[device]) + "\"}",
+      busDropped[device].load(std::memory_order_relaxed));
+  }
+
+  metricHeader(out, "probeinator_heap_free_bytes", "gauge", "Free heap");
+  renderGauge(out, "probeinator_heap_free_bytes", "", ESP.getFreeHeap());
+  metricHeader(out, "probeinator_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+  renderGauge(out, "probeinator_heap_min_free_bytes", "", ESP.getMinFreeHeap());
+  metricHeader(out, "probeinator_heap_largest_free_block_bytes", "gauge", "Largest block that can be allocated");
+  renderGauge(out, "probeinator_heap_largest_free_block_bytes", "", ESP.getMaxAllocHeap());
+
+  metricHeader(out, "probeinator_task_stack_min_free_bytes", "gauge", "Least stack a task has had free");
+  for (const char *name : metricTasks) {
+    TaskHandle_t task = xTaskGetHandle(name);
+    if(task != NULL) {
+      renderGauge(out, "probeinator_task_stack_min_free_bytes", "{task=\"" + String(name) + "\"}", uxTaskGetStackHighWaterMark(task));
+    }
+  }
+  return out;
+}
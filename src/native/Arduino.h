@@ -0,0 +1,141 @@
+#pragma once
+
+//
+// Just enough of the Arduino core for the native build to run the
+// acquisition -> storage -> JSON pipeline on the host
+//
+
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+using std::max;
+using std::min;
+using std::isnan;
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define HEX 16
+#define DEC 10
+
+typedef uint8_t byte;
+
+class String {
+ public:
+  String() {}
+  String(const char *value) : text(value ? value : "") {}
+  String(const std::string &value) : text(value) {}
+  String(char value) : text(1, value) {}
+  String(bool value) : text(value ? "1" : "0") {}
+  String(int value, unsigned char base = DEC) : text(format(base == HEX ? "%x" : "%d", value)) {}
+  String(unsigned int value, unsigned char base = DEC) : text(format(base == HEX ? "%x" : "%u", value)) {}
+  String(long value, unsigned char base = DEC) : text(format(base == HEX ? "%lx" : "%ld", value)) {}
+  String(unsigned long value, unsigned char base = DEC) : text(format(base == HEX ? "%lx" : "%lu", value)) {}
+  String(float value, unsigned char decimals = 2) : text(format("%.*f", decimals, value)) {}
+  String(double value, unsigned char decimals = 2) : text(format("%.*f", decimals, value)) {}
+
+  unsigned int length() const { return text.size(); }
+  const char *c_str() const { return text.c_str(); }
+  bool reserve(unsigned int size) { text.reserve(size); return true; }
+  bool concat(const char *value, unsigned int len) { text.append(value, len); return true; }
+  String &operator+=(const String &value) { text += value.text; return *this; }
+  String &operator+=(const char *value) { text += value; return *this; }
+  String &operator+=(char value) { text += value; return *this; }
+  bool operator==(const String &value) const { return text == value.text; }
+  bool operator==(const char *value) const { return text == value; }
+  bool operator!=(const String &value) const { return text != value.text; }
+  bool operator!=(const char *value) const { return text != value; }
+  char operator[](unsigned int index) const { return text[index]; }
+
+  long toInt() const { return atol(text.c_str()); }
+  float toFloat() const { return atof(text.c_str()); }
+  void toCharArray(char *buffer, unsigned int size) const {
+    if(size == 0) {
+      return;
+    }
+    strncpy(buffer, text.c_str(), size - 1);
+    buffer[size - 1] = 0;
+  }
+  bool startsWith(const String &prefix) const { return text.compare(0, prefix.text.size(), prefix.text) == 0; }
+  int indexOf(char value) const { return toIndex(text.find(value)); }
+  int lastIndexOf(char value) const { return toIndex(text.rfind(value)); }
+  String substring(unsigned int from) const { return from < text.size() ? text.substr(from) : ""; }
+  String substring(unsigned int from, unsigned int to) const { return from < text.size() ? text.substr(from, to - from) : ""; }
+
+  friend String operator+(const String &a, const String &b) { return String(a.text + b.text); }
+  friend String operator+(const String &a, const char *b) { return String(a.text + b); }
+  friend String operator+(const char *a, const String &b) { return String(a + b.text); }
+
+ private:
+  std::string text;
+
+  static int toIndex(size_t pos) { return pos == std::string::npos ? -1 : (int)pos; }
+  static std::string format(const char *fmt, ...) {
+    char buffer[64];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return buffer;
+  }
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t value) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      write(buffer[i]);
+    }
+    return size;
+  }
+  size_t print(const String &value) { return write((const uint8_t *)value.c_str(), value.length()); }
+  size_t print(const char *value) { return write((const uint8_t *)value, strlen(value)); }
+  size_t print(int value) { return print(String(value)); }
+  size_t print(double value, int decimals = 2) { return print(String(value, decimals)); }
+  size_t println() { return print("\n"); }
+  size_t println(const String &value) { return print(value) + println(); }
+  size_t println(const char *value) { return print(value) + println(); }
+  size_t printf(const char *fmt, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return write((const uint8_t *)buffer, min((size_t)max(len, 0), sizeof(buffer) - 1));
+  }
+};
+
+// Serial goes to stdout
+class HardwareSerial : public Print {
+ public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t value) { return fputc(value, stdout) != EOF; }
+  size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap() { return 0; }
+  uint32_t getMinFreeHeap() { return 0; }
+  uint32_t getMaxAllocHeap() { return 0; }
+};
+extern EspClass ESP;
+
+uint32_t esp_random();
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
@@ -0,0 +1,2 @@
+#pragma once
+// Nothing needed on the host, ESPAsyncWebServer.h has the server
@@ -0,0 +1,158 @@
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+//
+// The part of ESPAsyncWebServer webHandlers.cpp uses, served from a plain
+// socket on the host (webServer.cpp).  Like async_tcp on the board one
+// thread answers every request in turn, so a slow reply holds up the rest.
+// There's no /events stream, browsers fall back to polling
+//
+
+enum WebRequestMethod {
+  HTTP_GET = 1,
+  HTTP_POST = 2
+};
+typedef int WebRequestMethodComposite;
+
+class AsyncWebParameter {
+ public:
+  AsyncWebParameter(const String &name, const String &value, bool form) : paramName(name), paramValue(value), form(form) {}
+  const String &name() const { return paramName; }
+  const String &value() const { return paramValue; }
+  bool isPost() const { return form; }
+
+ private:
+  String paramName;
+  String paramValue;
+  bool form;
+};
+
+class AsyncWebHeader {
+ public:
+  AsyncWebHeader(const String &name, const String &value) : headerName(name), headerValue(value) {}
+  const String &name() const { return headerName; }
+  const String &value() const { return headerValue; }
+
+ private:
+  String headerName;
+  String headerValue;
+};
+
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)> AwsResponseFiller;
+
+// The status line and headers, then the body from fill until it returns 0
+class AsyncWebServerResponse {
+ public:
+  AsyncWebServerResponse(int code, const String &contentType) : code(code), contentType(contentType) {}
+  virtual ~AsyncWebServerResponse() {}
+  void addHeader(const String &name, const String &value) { headers.emplace_back(name, value); }
+
+  int code;
+  String contentType;
+  std::vector<AsyncWebHeader> headers;
+  long length = -1; // -1 = chunked
+  AwsResponseFiller fill;
+};
+
+class AsyncWebServerRequest {
+ public:
+  WebRequestMethodComposite method() const { return requestMethod; }
+  const String &url() const { return path; }
+
+  // Query string params only unless post is set, like the library
+  bool hasParam(const String &name, bool post = false) const { return findParam(name, post) != NULL; }
+  AsyncWebParameter *getParam(const String &name, bool post = false) const { return findParam(name, post); }
+  AsyncWebParameter *getParam(size_t index) const { return index < allParams.size() ? (AsyncWebParameter *)&allParams[index] : NULL; }
+  size_t params() const { return allParams.size(); }
+
+  bool hasHeader(const String &name) const { return getHeader(name) != NULL; }
+  AsyncWebHeader *getHeader(const String &name) const;
+
+  AsyncWebServerResponse *beginResponse(int code, const String &contentType = String(), const String &content = String());
+  AsyncWebServerResponse *beginResponse(fs::FS &fs, const String &path, const String &contentType);
+  AsyncWebServerResponse *beginChunkedResponse(const String &contentType, AwsResponseFiller filler);
+  void send(AsyncWebServerResponse *response);
+  void send(int code, const String &contentType = String(), const String &content = String()) {
+    send(beginResponse(code, contentType, content));
+  }
+
+  // filled in by the server
+  WebRequestMethodComposite requestMethod = HTTP_GET;
+  String path;
+  std::vector<AsyncWebParameter> allParams;
+  std::vector<AsyncWebHeader> headers;
+  AsyncWebServerResponse *response = NULL;
+
+ private:
+  AsyncWebParameter *findParam(const String &name, bool post) const;
+};
+
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+
+class AsyncWebHandler {
+ public:
+  virtual ~AsyncWebHandler() {}
+};
+
+class AsyncEventSourceClient {
+ public:
+  void send(const char *message, const char *event = NULL, uint32_t id = 0, uint32_t reconnect = 0) {}
+};
+
+typedef std::function<void(AsyncEventSourceClient *client)> ArEventHandlerFunction;
+
+// No real clients here, count() is however many the soak and the bench
+// make up.  The board's send formats the message once and queues it for
+// every client, this one just counts the messages of each event
+class AsyncEventSource : public AsyncWebHandler {
+ public:
+  AsyncEventSource(const String &url) {}
+  void onConnect(ArEventHandlerFunction handler) {}
+  size_t count() const { return clients; }
+  void send(const char *message, const char *event = NULL, uint32_t id = 0, uint32_t reconnect = 0) {
+    if(event != NULL && strcmp(event, "lastTemps") == 0) {
+      lastTempsMessages++;
+    } else if(event != NULL && strcmp(event, "history") == 0) {
+      historyMessages++;
+    }
+  }
+
+  static std::atomic<size_t> clients;
+  static std::atomic<unsigned long> lastTempsMessages;
+  static std::atomic<unsigned long> historyMessages;
+};
+
+class AsyncWebServer {
+ public:
+  AsyncWebServer(uint16_t port) : port(port) {}
+  void begin();
+  void on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction handler) {
+    std::lock_guard<std::mutex> guard(routesLock);
+    routes.push_back({uri, method, handler});
+  }
+  void addHandler(AsyncWebHandler *handler) {}
+
+  // Handler for a request, empty if no route matches
+  ArRequestHandlerFunction findHandler(AsyncWebServerRequest *request);
+
+  // Port begin listens on instead of the one in the constructor, so the
+  // host doesn't need root for port 80.  0 = the constructor's
+  static uint16_t hostPort;
+
+ private:
+  struct route {
+    String uri;
+    WebRequestMethodComposite method;
+    ArRequestHandlerFunction handler;
+  };
+
+  uint16_t port;
+  std::mutex routesLock; // routes are added after begin
+  std::vector<route> routes;
+};
@@ -0,0 +1,53 @@
+#pragma once
+#include <Arduino.h>
+#include <memory>
+#include <vector>
+
+//
+// Arduino FS on top of a host directory for the native build
+//
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+struct FileImpl;
+
+class File {
+ public:
+  File() {}
+  explicit File(std::shared_ptr<FileImpl> impl) : impl(impl) {}
+
+  operator bool() const;
+  size_t read(uint8_t *buffer, size_t size);
+  size_t write(const uint8_t *buffer, size_t size);
+  size_t size();
+  void close() { impl.reset(); }
+  const char *name() const;
+  File openNextFile();
+
+ private:
+  std::shared_ptr<FileImpl> impl;
+};
+
+class FS {
+ public:
+  explicit FS(const std::string &root) : root(root) {}
+
+  File open(const String &path, const char *mode = FILE_READ) { return open(path.c_str(), mode); }
+  File open(const char *path, const char *mode = FILE_READ);
+  bool exists(const String &path) { return exists(path.c_str()); }
+  bool exists(const char *path);
+  bool remove(const String &path) { return remove(path.c_str()); }
+  bool remove(const char *path);
+
+ protected:
+  std::string root;
+};
+
+}
+
+using fs::File;
+using fs::FS;
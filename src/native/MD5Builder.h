@@ -0,0 +1,32 @@
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+
+// Only used for ETags, so the host hashes with 64 bit FNV-1a instead of
+// MD5.  Stable for the same bytes, which is all an ETag needs
+class MD5Builder {
+ public:
+  void begin() { hash = 0xcbf29ce484222325ULL; }
+  void add(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+  }
+  void addStream(fs::File &file, size_t maxLen) {
+    uint8_t buffer[256];
+    size_t count;
+    while(maxLen > 0 && (count = file.read(buffer, min(sizeof(buffer), maxLen))) > 0) {
+      add(buffer, count);
+      maxLen -= count;
+    }
+  }
+  void calculate() {}
+  String toString() const {
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long)hash);
+    return text;
+  }
+
+ private:
+  uint64_t hash = 0;
+};
@@ -0,0 +1,11 @@
+#pragma once
+#include <FS.h>
+
+// SPIFFS is a directory, $PROBEINATOR_FS or a fresh temp directory per run
+class SPIFFSFS : public fs::FS {
+ public:
+  SPIFFSFS() : FS("") {}
+  bool begin(bool formatOnFail = false);
+};
+
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,11 @@
+#pragma once
+#include <Arduino.h>
+
+int year(time_t t);
+int month(time_t t);
+int day(time_t t);
+int weekday(time_t t); // 1 = Sunday
+int hour(time_t t);
+int minute(time_t t);
+int second(time_t t);
+const char *monthShortStr(uint8_t month);
@@ -0,0 +1,35 @@
+#pragma once
+#include <TimeLib.h>
+
+//
+// The Timezone library's rules and conversions for the native build
+//
+
+enum week_t { Last, First, Second, Third, Fourth };
+enum dow_t { Sun = 1, Mon, Tue, Wed, Thu, Fri, Sat };
+enum month_t { Jan = 1, Feb, Mar, Apr, May, Jun, Jul, Aug, Sep, Oct, Nov, Dec };
+
+struct TimeChangeRule {
+  char abbrev[6];
+  uint8_t week;   // week_t
+  uint8_t dow;    // dow_t
+  uint8_t month;  // month_t
+  uint8_t hour;
+  int offset;     // minutes from UTC
+};
+
+class Timezone {
+ public:
+  Timezone(TimeChangeRule dstStart, TimeChangeRule stdStart) : dst(dstStart), std(stdStart) {}
+
+  time_t toLocal(time_t utc);
+  time_t toUTC(time_t local);
+  bool utcIsDST(time_t utc);
+  bool locIsDST(time_t local);
+
+ private:
+  TimeChangeRule dst;
+  TimeChangeRule std;
+
+  static time_t toTime_t(TimeChangeRule rule, int year);
+};
@@ -0,0 +1,347 @@
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <Timezone.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+//
+// Host side of the native shims: Serial, time, FreeRTOS, the FS and TimeLib
+//
+
+HardwareSerial Serial;
+EspClass ESP;
+SPIFFSFS SPIFFS;
+
+static const auto startTime = std::chrono::steady_clock::now();
+
+uint32_t esp_random() {
+  static std::random_device source;
+  return source();
+}
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+//
+// FreeRTOS
+//
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stackDepth, void *params, UBaseType_t priority, TaskHandle_t *handle) {
+  std::thread(task, params).detach();
+  if(handle != NULL) {
+    *handle = NULL;
+  }
+  return pdPASS;
+}
+
+// No cores to pin to here
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackDepth, void *params, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+  return xTaskCreate(task, name, stackDepth, params, priority, handle);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  delay(ticks);
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  return 0;
+}
+
+// Threads have no names or handles here
+TaskHandle_t xTaskGetHandle(const char *name) {
+  return NULL;
+}
+
+// A plain std::mutex polled with try_lock for timed takes.  ThreadSanitizer
+// doesn't see locks taken with timed_mutex::try_lock_for, it reports their
+// unlocks and misses the ordering they give
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return new std::mutex();
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks) {
+  std::mutex *lock = (std::mutex *)mutex;
+  if(ticks == portMAX_DELAY) {
+    lock->lock();
+    return pdTRUE;
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ticks);
+  while(!lock->try_lock()) {
+    if(std::chrono::steady_clock::now() >= deadline) {
+      return pdFALSE;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex) {
+  ((std::mutex *)mutex)->unlock();
+  return pdTRUE;
+}
+
+// Storage for every item is allocated up front like FreeRTOS does, so
+// sending and receiving never touch the heap
+struct nativeQueue {
+  std::mutex lock;
+  std::condition_variable changed;
+  std::vector<uint8_t> storage; // length * itemSize
+  UBaseType_t length;
+  UBaseType_t itemSize;
+  UBaseType_t head = 0;         // slot of the oldest item
+  UBaseType_t count = 0;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  nativeQueue *queue = new nativeQueue();
+  queue->length = length;
+  queue->itemSize = itemSize;
+  queue->storage.resize(length * itemSize);
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t ticks) {
+  nativeQueue *queue = (nativeQueue *)handle;
+  std::unique_lock<std::mutex> guard(queue->lock);
+  auto hasRoom = [queue] { return queue->count < queue->length; };
+  if(ticks == portMAX_DELAY) {
+    queue->changed.wait(guard, hasRoom);
+  } else if(!queue->changed.wait_for(guard, std::chrono::milliseconds(ticks), hasRoom)) {
+    return pdFALSE;
+  }
+  UBaseType_t slot = (queue->head + queue->count) % queue->length;
+  memcpy(&queue->storage[slot * queue->itemSize], item, queue->itemSize);
+  queue->count++;
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t ticks) {
+  nativeQueue *queue = (nativeQueue *)handle;
+  std::unique_lock<std::mutex> guard(queue->lock);
+  auto hasItem = [queue] { return queue->count > 0; };
+  if(ticks == portMAX_DELAY) {
+    queue->changed.wait(guard, hasItem);
+  } else if(!queue->changed.wait_for(guard, std::chrono::milliseconds(ticks), hasItem)) {
+    return pdFALSE;
+  }
+  memcpy(item, &queue->storage[queue->head * queue->itemSize], queue->itemSize);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle) {
+  nativeQueue *queue = (nativeQueue *)handle;
+  std::lock_guard<std::mutex> guard(queue->lock);
+  return queue->count;
+}
+
+//
+// FS
+//
+
+namespace fs {
+
+struct FileImpl {
+  FILE *file = NULL;
+  std::string name;
+  std::vector<std::string> entries; // directory listing when this is a directory
+  size_t nextEntry = 0;
+  std::string root;
+
+  ~FileImpl() {
+    if(file != NULL) {
+      fclose(file);
+    }
+  }
+};
+
+File::operator bool() const {
+  return impl && (impl->file != NULL || !impl->root.empty());
+}
+
+size_t File::read(uint8_t *buffer, size_t size) {
+  return impl && impl->file ? fread(buffer, 1, size, impl->file) : 0;
+}
+
+size_t File::write(const uint8_t *buffer, size_t size) {
+  return impl && impl->file ? fwrite(buffer, 1, size, impl->file) : 0;
+}
+
+size_t File::size() {
+  struct stat info;
+  if(!impl || !impl->file || fstat(fileno(impl->file), &info) != 0) {
+    return 0;
+  }
+  return info.st_size;
+}
+
+const char *File::name() const {
+  return impl ? impl->name.c_str() : "";
+}
+
+File File::openNextFile() {
+  if(!impl || impl->nextEntry >= impl->entries.size()) {
+    return File();
+  }
+  std::shared_ptr<FileImpl> next = std::make_shared<FileImpl>();
+  next->name = impl->entries[impl->nextEntry++];
+  next->file = fopen((impl->root + "/" + next->name).c_str(), "rb");
+  return File(next);
+}
+
+File FS::open(const char *path, const char *mode) {
+  std::shared_ptr<FileImpl> impl = std::make_shared<FileImpl>();
+  impl->name = path;
+
+  if(strcmp(path, "/") == 0) {
+    DIR *dir = opendir(root.c_str());
+    if(dir == NULL) {
+      return File();
+    }
+    while(struct dirent *entry = readdir(dir)) {
+      if(entry->d_name[0] != '.') {
+        impl->entries.push_back(entry->d_name);
+      }
+    }
+    closedir(dir);
+    impl->root = root;
+    return File(impl);
+  }
+
+  const char *hostMode = mode[0] == 'a' ? "ab" : mode[0] == 'w' ? "wb" : "rb";
+  impl->file = fopen((root + path).c_str(), hostMode);
+  return impl->file != NULL ? File(impl) : File();
+}
+
+bool FS::exists(const char *path) {
+  struct stat info;
+  return stat((root + path).c_str(), &info) == 0;
+}
+
+bool FS::remove(const char *path) {
+  return ::remove((root + path).c_str()) == 0;
+}
+
+}
+
+bool SPIFFSFS::begin(bool formatOnFail) {
+  const char *dir = getenv("PROBEINATOR_FS");
+  if(dir != NULL) {
+    root = dir;
+    mkdir(dir, 0755);
+  } else {
+    char temp[] = "/tmp/probeinator.XXXXXX";
+    if(mkdtemp(temp) == NULL) {
+      return false;
+    }
+    root = temp;
+  }
+  struct stat info;
+  return stat(root.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+//
+// TimeLib
+//
+
+static struct tm toTm(time_t t) {
+  struct tm parts;
+  gmtime_r(&t, &parts);
+  return parts;
+}
+
+int year(time_t t) { return toTm(t).tm_year + 1900; }
+int month(time_t t) { return toTm(t).tm_mon + 1; }
+int day(time_t t) { return toTm(t).tm_mday; }
+int weekday(time_t t) { return toTm(t).tm_wday + 1; }
+int hour(time_t t) { return toTm(t).tm_hour; }
+int minute(time_t t) { return toTm(t).tm_min; }
+int second(time_t t) { return toTm(t).tm_sec; }
+
+const char *monthShortStr(uint8_t month) {
+  static const char *names[] = {"Err", "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  return names[month <= 12 ? month : 0];
+}
+
+//
+// Timezone, same rules as the library
+//
+
+// Local time a rule kicks in for a year
+time_t Timezone::toTime_t(TimeChangeRule rule, int year) {
+  int m = rule.month;
+  int w = rule.week;
+  // last week of a month is worked out from the first of the next one
+  if(w == Last) {
+    if(++m > 12) {
+      m = 1;
+      year++;
+    }
+    w = First;
+  }
+
+  struct tm parts = {};
+  parts.tm_year = year - 1900;
+  parts.tm_mon = m - 1;
+  parts.tm_mday = 1;
+  parts.tm_hour = rule.hour;
+  time_t t = timegm(&parts);
+  t += ((rule.dow - weekday(t) + 7) % 7 + (w - 1) * 7) * 86400L;
+  if(rule.week == Last) {
+    t -= 7 * 86400L;
+  }
+  return t;
+}
+
+bool Timezone::utcIsDST(time_t utc) {
+  if(dst.offset == std.offset) {
+    return false;
+  }
+  int y = year(utc);
+  time_t dstStart = toTime_t(dst, y) - std.offset * 60;
+  time_t stdStart = toTime_t(std, y) - dst.offset * 60;
+  if(stdStart > dstStart) {
+    return utc >= dstStart && utc < stdStart;
+  }
+  return !(utc >= stdStart && utc < dstStart); // southern hemisphere
+}
+
+bool Timezone::locIsDST(time_t local) {
+  if(dst.offset == std.offset) {
+    return false;
+  }
+  int y = year(local);
+  time_t dstStart = toTime_t(dst, y);
+  time_t stdStart = toTime_t(std, y);
+  if(stdStart > dstStart) {
+    return local >= dstStart && local < stdStart;
+  }
+  return !(local >= stdStart && local < dstStart);
+}
+
+time_t Timezone::toLocal(time_t utc) {
+  return utc + (utcIsDST(utc) ? dst.offset : std.offset) * 60;
+}
+
+time_t Timezone::toUTC(time_t local) {
+  return local - (locIsDST(local) ? dst.offset : std.offset) * 60;
+}
@@ -0,0 +1,980 @@
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <vector>
+#include <ESPAsyncWebServer.h>
+#include "../probeinator.h"
+#include "simRig.h"
+
+//
+// Microbenchmarks for the code that runs thousands of times per cook.
+// One JSON object per line on stdout:
+//
+//   {"bench": "storeData", "probes": 4, "ring": 120, "ops": 65536,
+//    "ns_per_op": 212.4, "allocs_per_op": 0.00, "bytes_per_op": 0.0,
+//    "lcd_bus_bytes_per_op": 0.0}
+//
+// lcd_bus_bytes_per_op is the I2C traffic the simulated LCD saw
+//
+// NUM_PROBES and HISTORY_RING_SIZE are build time, tools/bench.py rebuilds
+// for each combination and keeps the results for comparing builds
+//
+// The soak (runSoak) runs days of cook with the requests the UI makes and
+// checks the acquisition loop stops allocating once it's warmed up and
+// nothing is left behind on the heap from one day to the next
+//
+
+#define BENCH_MIN_NS 50000000L // time each benchmark for at least this long
+#define BENCH_PREFILL_HOURS 14 // history to build up before timing the history replies
+#define BENCH_CHUNK_SIZE 1436  // what AsyncWebServer asks fillHistory for at a time
+#define LTTB_POINTS 300        // rows per probe for the downsampled reply, a phone screen's worth
+#define LTTB_MAX_ERROR 10      // percent of the temp range the downsampled line can stray
+#define TABLE_CHECK_LOW 32     // F, the range the temp tables have to be good over
+#define TABLE_CHECK_HIGH 600
+#define TABLE_MAX_ERROR 0.05   // F the tables can be off from the formula in that range
+#define ADC_SCAN_MAX_MS 100    // a full refresh of every probe has to fit in this
+#define ARCHIVE_CHECK_DEADBANDS {0, 2, 5} // tenths of a degree, what the archive check compares
+#define DST_CHECK_BEFORE 10800 // seconds of history before the DST change the check crosses
+#define DST_CHECK_AFTER 300    // and after it, short enough the fine ring still holds both sides
+#define EVENT_CHECK_CLIENTS 4  // /events clients the fan out check goes up to
+#define EVENT_CHECK_SECONDS 600 // seconds of cook for each client count, a couple of graph buckets
+#define SINCE_CHECK_SECONDS 7200 // seconds of cook the since= check polls through
+#define SINCE_CHECK_POLL 30    // seconds between since= polls, what the UI does without /events
+#define SINCE_CHECK_AWAY 900   // seconds a client stops polling for, longer than the fine ring holds
+#define SINCE_CHECK_LOST 3     // buckets the device is behind a client after the made up reboot
+#define SOAK_WARMUP 3600       // seconds of cook before the acquisition loop has to stop allocating
+#define SOAK_POLL_INTERVAL 5   // seconds between /getLastTemps, what the UI does without /events
+#define SOAK_GRAPH_INTERVAL 30 // seconds between graph updates
+#define SOAK_SCRAPE_INTERVAL 15 // seconds between /metrics scrapes
+#define SOAK_RELOAD_INTERVAL 3600 // seconds between page loads, a whole /getTemps
+#define SOAK_EVENT_CLIENTS 2   // made up /events clients, so every tick publishes
+
+// Heap use, only counted while a benchmark is being timed and only in the
+// thread timing it, the history log task writing pages doesn't count
+static thread_local bool countAllocs = false;
+static unsigned long allocCount = 0;
+static unsigned long allocBytes = 0;
+static size_t allocLargest = 0; // biggest single block, what has to be free in one piece
+
+// Blocks allocated and not freed yet, and the biggest single allocation,
+// from every thread
+static std::atomic<long> liveBlocks(0);
+static std::atomic<size_t> largestAlloc(0);
+
+void *operator new(size_t size) {
+  if(countAllocs) {
+    allocCount++;
+    allocBytes += size;
+    allocLargest = max(allocLargest, size);
+  }
+  void *ptr = malloc(size ? size : 1);
+  if(ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  liveBlocks.fetch_add(1, std::memory_order_relaxed);
+  size_t largest = largestAlloc.load(std::memory_order_relaxed);
+  while(size > largest && !largestAlloc.compare_exchange_weak(largest, size, std::memory_order_relaxed)) {
+  }
+  return ptr;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+static void freeBlock(void *ptr) {
+  if(ptr != NULL) {
+    liveBlocks.fetch_sub(1, std::memory_order_relaxed);
+    free(ptr);
+  }
+}
+
+void operator delete(void *ptr) noexcept {
+  freeBlock(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  freeBlock(ptr);
+}
+
+void operator delete(void *ptr, size_t size) noexcept {
+  freeBlock(ptr);
+}
+
+void operator delete[](void *ptr, size_t size) noexcept {
+  freeBlock(ptr);
+}
+
+// Results go here so the compiler can't throw the work away
+static volatile double sinkDouble;
+static volatile size_t sinkSize;
+
+static unsigned long benchOp = 0; // op number, varies the inputs
+static unsigned long benchTime = 0;
+static struct temperatureUpdate benchUpdate;
+
+static void runOps(void (*op)(), unsigned long ops) {
+  for (unsigned long i = 0; i < ops; i++) {
+    op();
+    benchOp++;
+  }
+}
+
+// Run op enough times to get past BENCH_MIN_NS and print the result.
+// Returns the ns per op, allocLargest is left as the biggest block an op
+// asked for
+static double bench(const char *name, void (*op)()) {
+  unsigned long ops = 1;
+  long elapsed = 0;
+  unsigned long busBytes = 0;
+  for (;;) {
+    busBytes = simDisplayBusBytes();
+    allocCount = 0;
+    allocBytes = 0;
+    allocLargest = 0;
+    countAllocs = true;
+    auto started = std::chrono::steady_clock::now();
+    runOps(op, ops);
+    elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+    countAllocs = false;
+    busBytes = simDisplayBusBytes() - busBytes;
+    if(elapsed >= BENCH_MIN_NS) {
+      break;
+    }
+    ops *= 2;
+  }
+  printf("{\"bench\": \"%s\", \"probes\": %d, \"ring\": %d, \"ops\": %lu, \"ns_per_op\": %.1f, "
+    "\"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f, \"largest_alloc\": %zu, \"lcd_bus_bytes_per_op\": %.1f}\n",
+    name, NUM_PROBES, HISTORY_RING_SIZE, ops, (double)elapsed / ops,
+    (double)allocCount / ops, (double)allocBytes / ops, allocLargest, (double)busBytes / ops);
+  fflush(stdout);
+  return (double)elapsed / ops;
+}
+
+// A reading for every probe, a second after the last one
+static void nextUpdate() {
+  benchTime++;
+  benchUpdate.updateTime = benchTime;
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    benchUpdate.temperatures[probe] = 150 + probe + (benchTime % 600) / 10.0;
+    benchUpdate.connected[probe] = true;
+  }
+}
+
+// Stream a whole history reply the way the web server does, into out if
+// it's given
+static void streamReply(struct historyCursor *cursor, String *out = NULL) {
+  uint8_t buffer[BENCH_CHUNK_SIZE];
+  size_t count;
+  size_t total = 0;
+  while((count = fillHistory(cursor, buffer, sizeof(buffer))) > 0) {
+    total += count;
+    if(out != NULL) {
+      out->concat((char *)buffer, count);
+    }
+  }
+  sinkSize = total;
+}
+
+static void fillReply(int tier, bool binary, String *out = NULL) {
+  struct historyCursor cursor;
+  cursor.tier = tier;
+  cursor.binary = binary;
+  streamReply(&cursor, out);
+}
+
+// /getTemps?from=&to= over the whole prefill, points=0 for every bucket
+static unsigned long rangeFrom = 0;
+static void fillRange(int points, String *out = NULL) {
+  struct historyCursor cursor;
+  setHistoryRange(&cursor, rangeFrom, 0);
+  cursor.points = points;
+  streamReply(&cursor, out);
+}
+
+// The first probe's rows out of a JSON history reply, nulls are skipped
+static std::vector<std::pair<double, double>> replyRows(const String &reply) {
+  std::vector<std::pair<double, double>> rows;
+  const char *pos = strstr(reply.c_str(), "\"data\": [");
+  const char *end = pos != NULL ? strstr(pos, "]]") : NULL;
+  while(pos != NULL && end != NULL && (pos = strchr(pos + 1, '[')) != NULL && pos < end) {
+    unsigned long time;
+    double temp;
+    if(sscanf(pos, "[%lu,%lf]", &time, &temp) == 2) {
+      rows.push_back({(double)time, temp});
+    }
+  }
+  return rows;
+}
+
+// Every ADS code, -32768 to 32767, through each probe's table against the
+// beta formula (getResistance, getTempK) the default calibration is.  One
+// line per probe with the worst error between TABLE_CHECK_LOW and
+// TABLE_CHECK_HIGH and over every code the table has a temp for, and the
+// codes in that range the table calls no probe.  Returns false if a probe
+// is off by more than TABLE_MAX_ERROR or misses a code in the range
+static bool checkTempTables() {
+  bool ok = true;
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    double worst = 0;
+    int worstCode = 0;
+    double worstAll = 0;
+    unsigned long checked = 0;
+    unsigned long missing = 0;
+    for (long code = INT16_MIN; code <= INT16_MAX; code++) {
+      double voltage = halAdcVoltage(code);
+      double resistance = getResistance(BALANCE_RESISTOR, INPUT_VOLTAGE, voltage);
+      bool probeThere = code >= 0 && voltage < INPUT_VOLTAGE && resistance >= MIN_PROBE_RESISTANCE;
+      double exact = probeThere ? kToF(getTempK(BETA, ROOM_TEMP, RESISTOR_ROOM_TEMP, resistance)) : NAN;
+      float table = codeToTempF(probe, code);
+      bool inRange = exact >= TABLE_CHECK_LOW && exact <= TABLE_CHECK_HIGH;
+      if(isnan(table)) {
+        missing += inRange;
+        continue;
+      }
+      if(isnan(exact)) {
+        continue;
+      }
+      double error = fabs(table - exact);
+      worstAll = max(worstAll, error);
+      if(inRange) {
+        checked++;
+        if(error > worst) {
+          worst = error;
+          worstCode = code;
+        }
+      }
+    }
+    printf("temp table: probe %d, worst error %.4fF at code %d over %d-%dF (%lu codes), %.4fF over every code, "
+      "%lu codes missing\n", probe, worst, worstCode, TABLE_CHECK_LOW, TABLE_CHECK_HIGH, checked, worstAll, missing);
+    ok = ok && worst <= TABLE_MAX_ERROR && missing == 0 && checked > 0;
+  }
+  return ok;
+}
+
+// One scan (scanProbes) against the simulated ADC's trace.  The mux has to
+// go round every channel READING_COUNT times in order with every chip
+// that has a probe on the channel converting at once, and on the ADC
+// clock the whole refresh has to take less than ADC_SCAN_MAX_MS.  Returns
+// false if the order is off or it's too slow
+static bool checkAdcScan() {
+  std::vector<simAdcConversion> expected;
+  for (int reading = 0; reading < READING_COUNT; reading++) {
+    for (int channel = 0; channel < ADS_CHANNELS && channel < NUM_PROBES; channel++) {
+      for (int chip = 0; chip < ADS_CHIPS; chip++) {
+        if(chip * ADS_CHANNELS + channel < NUM_PROBES) {
+          expected.push_back({0, chip, channel});
+        }
+      }
+    }
+  }
+
+  std::vector<simAdcConversion> trace;
+  double codes[NUM_PROBES];
+  simAdcTrace(&trace);
+  unsigned long started = simAdcMicros();
+  scanProbes(codes);
+  double ms = (simAdcMicros() - started) / 1000.0;
+  simAdcTrace(NULL);
+
+  unsigned long wrong = 0;
+  for (size_t i = 0; i < max(trace.size(), expected.size()); i++) {
+    if(i >= trace.size() || i >= expected.size() || trace[i].chip != expected[i].chip ||
+        trace[i].channel != expected[i].channel) {
+      if(wrong++ < 5) {
+        printf("!!! Conversion %zu was %d:%d, expected %d:%d\n", i, i < trace.size() ? trace[i].chip : -1,
+          i < trace.size() ? trace[i].channel : -1, i < expected.size() ? expected[i].chip : -1,
+          i < expected.size() ? expected[i].channel : -1);
+      }
+    }
+  }
+  unsigned long noReading = 0;
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    noReading += isnan(codes[probe]);
+  }
+  printf("adc scan: %zu conversions on %d chips, %lu out of order, %lu probes without a reading, full refresh %.1fms "
+    "(limit %dms)\n", trace.size(), ADS_CHIPS, wrong, noReading, ms, ADC_SCAN_MAX_MS);
+  return wrong == 0 && noReading == 0 && ms < ADC_SCAN_MAX_MS;
+}
+
+// How far the downsampled reply strays from the full one over a whole
+// simulated cook: the worst gap between a real bucket and the line
+// through the downsampled rows, as a percentage of the temp range, and
+// whether the hottest and coldest buckets survived.  Returns false if
+// it's past LTTB_MAX_ERROR or lost either
+static unsigned long cookStarted = 0; // UTC the cook it plays started at
+static bool checkDownsampleFidelity(int points) {
+  String full;
+  String sampled;
+  // the storage benchmarks ran the history clock on ahead of the rig's
+  if(benchTime >= halEpochTime()) {
+    simAdvance(benchTime - halEpochTime() + 1);
+  }
+  simRestartScript();
+  cookStarted = halEpochTime();
+  rangeFrom = myTZ.toLocal(cookStarted);
+  for (unsigned long second = 0; second < simScriptMinutes() * 60; second++) {
+    acquireTemps();
+    simAdvance(1);
+  }
+  fillRange(0, &full);
+  fillRange(points, &sampled);
+  std::vector<std::pair<double, double>> fullRows = replyRows(full);
+  std::vector<std::pair<double, double>> sampledRows = replyRows(sampled);
+  if(fullRows.size() < 2 || sampledRows.size() < 2) {
+    printf("lttb fidelity: no history to compare\n");
+    return false;
+  }
+
+  double low = fullRows[0].second;
+  double high = low;
+  double worst = 0;
+  size_t next = 1;
+  for (const auto &row : fullRows) {
+    low = min(low, row.second);
+    high = max(high, row.second);
+    while(next < sampledRows.size() - 1 && sampledRows[next].first < row.first) {
+      next++;
+    }
+    const auto &a = sampledRows[next - 1];
+    const auto &b = sampledRows[next];
+    double line = b.first == a.first ? a.second : a.second + (b.second - a.second) * (row.first - a.first) / (b.first - a.first);
+    worst = max(worst, fabs(line - row.second));
+  }
+  bool keptLow = false;
+  bool keptHigh = false;
+  for (const auto &row : sampledRows) {
+    keptLow |= row.second == low;
+    keptHigh |= row.second == high;
+  }
+  double error = high > low ? worst / (high - low) * 100 : 0;
+  printf("lttb fidelity: %zu -> %zu rows, worst error %.2fF (%.1f%% of the range), min %s, max %s\n",
+    fullRows.size(), sampledRows.size(), worst, error, keptLow ? "kept" : "lost", keptHigh ? "kept" : "lost");
+  return error <= LTTB_MAX_ERROR && keptLow && keptHigh;
+}
+
+// The coarse buckets the prefill archived, which the archive benchmarks
+// encode and decode over and over
+static std::vector<historyLogRecord> archived;
+static unsigned long archiveBucket = 0; // next bucket archiveAppend gets
+static struct archiveReader archiveBenchReader;
+
+// Copy the live archive out, bucket by bucket from the oldest
+static void readArchive(std::vector<historyLogRecord> *records) {
+  struct archiveReader reader;
+  records->clear();
+  if(archiveEmpty()) {
+    return;
+  }
+  for (unsigned long bucket = archiveFirstBucket();; bucket++) {
+    historyLogRecord record;
+    record.bucket = bucket;
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      if(!archiveGet(&reader, bucket, probe, &record.buckets[probe])) {
+        return;
+      }
+    }
+    records->push_back(record);
+  }
+}
+
+// Encode the archived buckets again one per op, then decode every probe
+// of one per op oldest to newest.  A line after the two benchmarks has
+// the packing and the buckets a second each way.  The live archive is
+// put back afterwards
+static void benchArchive() {
+  readArchive(&archived);
+  if(archived.empty()) {
+    printf("!!! Nothing archived to benchmark\n");
+    return;
+  }
+  archiveClear();
+  archiveBucket = archived.front().bucket;
+  double encodeNs = bench("archiveAppend", [] {
+    archiveAppend(archiveBucket, archived[benchOp % archived.size()].buckets);
+    archiveBucket++;
+  });
+  unsigned long records;
+  unsigned long bytes;
+  archiveUsage(&records, &bytes);
+  double decodeNs = bench("archiveGet", [] {
+    unsigned long first = archiveFirstBucket();
+    unsigned long bucket = first + benchOp % (archiveBucket - first);
+    historyBucket read;
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      sinkSize = archiveGet(&archiveBenchReader, bucket, probe, &read);
+    }
+  });
+  printf("archive bench: deadband %.1fF, %lu buckets in %lu bytes (%.2f per bucket), encodes %.0f and decodes %.0f "
+    "buckets a second\n", archiveGetDeadband() / 10.0, records, bytes, records > 0 ? (double)bytes / records : 0,
+    1e9 / encodeNs, 1e9 / decodeNs);
+  fflush(stdout);
+
+  archiveClear();
+  for (const historyLogRecord &record : archived) {
+    archiveAppend(record.bucket, record.buckets);
+  }
+}
+
+// Archive the cook checkDownsampleFidelity played again, from the exact
+// coarse buckets in the flash log, at a few deadbands.  One line each with
+// how long a full archive would cover at that packing and how far the
+// values read back stray from the logged ones.  Returns false if one is
+// off by more than its deadband.  The archive is left as the deadband
+// in use encodes it
+static void archiveRecords(const std::vector<historyLogRecord> &records) {
+  archiveClear();
+  for (const historyLogRecord &record : records) {
+    archiveAppend(record.bucket, record.buckets);
+  }
+}
+
+static bool checkArchiveDeadband() {
+  String coarse;
+  fillReply(HISTORY_TIERS - 1, false, &coarse);
+  unsigned long interval = 0;
+  sscanf(coarse.c_str(), "{\"seq\": %*u, \"since\": %*u, \"size\": %*u, \"interval\": %lu", &interval);
+
+  std::vector<historyLogRecord> logged;
+  struct historyLogReader log;
+  historyLogRewind(&log, cookStarted);
+  while(historyLogNext(&log)) {
+    if(log.record.resolution == interval && log.record.bucket * interval >= cookStarted) {
+      logged.push_back(log.record);
+    }
+  }
+  if(logged.empty()) {
+    printf("archive check: no logged buckets to compare\n");
+    return false;
+  }
+
+  bool ok = true;
+  int inUse = archiveGetDeadband();
+  for (int deadband : ARCHIVE_CHECK_DEADBANDS) {
+    archiveSetDeadband(deadband);
+    archiveRecords(logged);
+    unsigned long records;
+    unsigned long bytes;
+    archiveUsage(&records, &bytes);
+
+    struct archiveReader reader;
+    int worst = 0;
+    double squares = 0;
+    unsigned long values = 0;
+    unsigned long missing = 0;
+    for (const historyLogRecord &record : logged) {
+      for (int probe = 0; probe < NUM_PROBES; probe++) {
+        historyBucket read;
+        if(!archiveGet(&reader, record.bucket, probe, &read)) {
+          missing++;
+          continue;
+        }
+        const historyBucket &exact = record.buckets[probe];
+        for (auto pair : {std::make_pair(read.min, exact.min), std::make_pair(read.max, exact.max),
+            std::make_pair(read.avg, exact.avg)}) {
+          if(pair.first == BUCKET_NAN || pair.second == BUCKET_NAN) {
+            missing += pair.first != pair.second;
+            continue;
+          }
+          int error = abs(pair.first - pair.second);
+          worst = max(worst, error);
+          squares += (double)error * error;
+          values++;
+        }
+      }
+    }
+    double days = bytes > 0 ? (double)ARCHIVE_BLOCKS * ARCHIVE_BLOCK_SIZE * records / bytes * interval / 86400 : 0;
+    printf("archive deadband %.1fF: %lu buckets in %lu bytes (%.2f per bucket), a full archive covers %.1f days, "
+      "worst error %.1fF, rms %.2fF, %lu missing\n", deadband / 10.0, records, bytes, records > 0 ? (double)bytes / records : 0,
+      days, worst / 10.0, values > 0 ? sqrt(squares / values) / 10 : 0, missing);
+    ok = ok && worst <= deadband && missing == 0 && records == logged.size();
+  }
+  archiveSetDeadband(inUse);
+  archiveRecords(logged);
+  return ok;
+}
+
+// Cook with 0 to EVENT_CHECK_CLIENTS clients on /events, sending the
+// events every second like the events task.  However many clients there
+// are each tick has to send one lastTemps message and each graph bucket
+// closed one history message, each serialized once, and with none nothing
+// is sent.  One line per client count with the heap the sending took.
+// Returns false if a count is off
+static bool checkEventFanout() {
+  bool ok = true;
+  int resolution = 0;
+  String coarse;
+  fillReply(HISTORY_TIERS - 1, false, &coarse);
+  sscanf(coarse.c_str(), "{\"seq\": %*u, \"since\": %*u, \"size\": %*u, \"interval\": %d", &resolution);
+
+  for (size_t clients = 0; clients <= EVENT_CHECK_CLIENTS; clients++) {
+    AsyncEventSource::clients = clients;
+    sendEvents(); // anything published before the check
+    AsyncEventSource::lastTempsMessages = 0;
+    AsyncEventSource::historyMessages = 0;
+    unsigned long closed = 0;
+    unsigned long bucket = halEpochTime() / resolution;
+    allocCount = 0;
+    allocBytes = 0;
+    for (unsigned long second = 0; second < EVENT_CHECK_SECONDS; second++) {
+      acquireTemps();
+      closed += halEpochTime() / resolution != bucket;
+      bucket = halEpochTime() / resolution;
+      countAllocs = true;
+      sendEvents();
+      countAllocs = false;
+      simAdvance(1);
+    }
+    unsigned long lastTemps = AsyncEventSource::lastTempsMessages;
+    unsigned long history = AsyncEventSource::historyMessages;
+    printf("event fan out: %zu clients, %lu lastTemps and %lu history events in %d seconds (%lu buckets closed), "
+      "%.1f allocs %.0f bytes per second\n", clients, lastTemps, history, EVENT_CHECK_SECONDS, closed,
+      (double)allocCount / EVENT_CHECK_SECONDS, (double)allocBytes / EVENT_CHECK_SECONDS);
+    ok = ok && lastTemps == (clients > 0 ? EVENT_CHECK_SECONDS : 0) && history == (clients > 0 ? closed : 0) && closed > 0;
+  }
+  AsyncEventSource::clients = 0;
+  return ok;
+}
+
+// The rows of each probe in a JSON history reply, as the text of each row
+static std::vector<std::vector<String>> probeRows(const String &reply) {
+  std::vector<std::vector<String>> probes;
+  const char *pos = reply.c_str();
+  while((pos = strstr(pos, "\"data\": [")) != NULL) {
+    pos += 9;
+    const char *end = strstr(pos, "], \"connected\"");
+    std::vector<String> rows;
+    while(pos < end) {
+      const char *close = strchr(pos, ']');
+      rows.push_back(String(pos).substring(0, close + 1 - pos));
+      pos = close + 2; // past the comma
+    }
+    probes.push_back(rows);
+    pos = end;
+  }
+  return probes;
+}
+
+// A client polling since= the way the UI does (applyHistory in
+// data/index.html): a full reply replaces its rows, anything else is
+// appended and the oldest row is dropped once it holds size rows, and
+// then anything past size
+struct sinceClient {
+  unsigned long seq = 0;
+  std::vector<std::vector<String>> rows;
+};
+
+// Returns true if the reply was a full one
+static bool pollSince(struct sinceClient *client, int tier) {
+  struct historyCursor cursor;
+  String reply;
+  unsigned long size = 0;
+  char full[6] = "";
+  cursor.tier = tier;
+  cursor.since = client->seq;
+  streamReply(&cursor, &reply);
+  sscanf(reply.c_str(), "{\"seq\": %lu, \"since\": %*u, \"size\": %lu, \"interval\": %*d, \"full\": %5[a-z]",
+    &client->seq, &size, full);
+  std::vector<std::vector<String>> probes = probeRows(reply);
+  if(strcmp(full, "true") == 0) {
+    client->rows = probes;
+    return true;
+  }
+  for (size_t probe = 0; probe < probes.size() && probe < client->rows.size(); probe++) {
+    for (const String &row : probes[probe]) {
+      std::vector<String> &rows = client->rows[probe];
+      if(rows.size() >= size) {
+        rows.erase(rows.begin());
+      }
+      rows.push_back(row);
+    }
+    // the archive evicts a whole block at a time
+    if(client->rows[probe].size() > size) {
+      client->rows[probe].erase(client->rows[probe].begin(), client->rows[probe].end() - size);
+    }
+  }
+  return false;
+}
+
+// Cook with clients polling since= on the fine tier, which wraps its ring
+// every 10 minutes, and the graph's tier.  Each goes away for longer than
+// the fine ring once, the fine client has to fall back to a full reply
+// and the graph's has to catch up.  Each also once holds a seq the device
+// doesn't have yet, what a reboot that lost the unwritten end of the
+// flash log looks like, and has to fall back.  After every poll the rows the
+// client has merged have to be the rows of a whole reply (getDataJson(0)
+// for the graph's tier).  Returns false if they ever differ or a
+// fallback didn't happen
+static bool checkSinceReplay() {
+  bool ok = true;
+  for (int tier : {0, HISTORY_TIERS - 1}) {
+    struct sinceClient client;
+    unsigned long polls = 0;
+    unsigned long fulls = 0;
+    unsigned long mismatches = 0;
+    bool awayFull = false;   // the poll after the client came back was a full reply
+    bool rebootFull = false;
+    pollSince(&client, tier);
+    for (unsigned long second = 1; second <= SINCE_CHECK_SECONDS; second++) {
+      acquireTemps();
+      simAdvance(1);
+      bool away = second > SINCE_CHECK_SECONDS / 4 && second <= SINCE_CHECK_SECONDS / 4 + SINCE_CHECK_AWAY;
+      if(second % SINCE_CHECK_POLL != 0 || away) {
+        continue;
+      }
+      bool back = second > SINCE_CHECK_SECONDS / 4 + SINCE_CHECK_AWAY &&
+        second <= SINCE_CHECK_SECONDS / 4 + SINCE_CHECK_AWAY + SINCE_CHECK_POLL;
+      bool full = pollSince(&client, tier);
+      if(second == SINCE_CHECK_SECONDS / 4 * 3 / SINCE_CHECK_POLL * SINCE_CHECK_POLL) {
+        // straight after a poll so the client really is ahead of the device
+        client.seq += SINCE_CHECK_LOST;
+        rebootFull = pollSince(&client, tier);
+        polls++;
+        fulls += rebootFull;
+      }
+      polls++;
+      fulls += full;
+      awayFull |= back && full;
+
+      struct historyCursor cursor;
+      String whole;
+      cursor.tier = tier;
+      streamReply(&cursor, &whole);
+      if(tier == HISTORY_TIERS - 1 && whole != getDataJson(0)) {
+        printf("since replay: a whole reply of the graph's tier isn't getDataJson(0)\n");
+        return false;
+      }
+      mismatches += probeRows(whole) != client.rows;
+    }
+    // the graph's tier still holds everything since the client went away
+    bool awayOk = awayFull == (tier == 0);
+    printf("since replay: tier %d, %lu polls, %lu full, %lu merged wrong, back from away %s, reboot %s\n", tier, polls,
+      fulls, mismatches, awayFull ? "fell back" : "caught up", rebootFull ? "fell back" : "didn't fall back");
+    ok = ok && mismatches == 0 && awayOk && rebootFull;
+  }
+  return ok;
+}
+
+static unsigned long binU16(const String &reply, size_t pos) {
+  const uint8_t *in = (const uint8_t *)reply.c_str() + pos;
+  return in[0] | in[1] << 8;
+}
+
+static long binI32(const String &reply, size_t pos) {
+  return (int32_t)(binU16(reply, pos) | binU16(reply, pos + 2) << 16);
+}
+
+// The rows of each probe in a /getTemps.bin reply, written out the way the
+// JSON reply writes them, see nextDataBinPiece for the layout
+static std::vector<std::vector<String>> binProbeRows(const String &bin) {
+  std::vector<std::vector<String>> probes;
+  unsigned long base = binU16(bin, 12) | binU16(bin, 14) << 16;
+  int interval = binU16(bin, 16);
+  unsigned long count = binU16(bin, 18);
+  int spans = (uint8_t)bin.c_str()[20];
+  size_t pos = 21 + spans * 4;
+  for (int probe = 0; probe < (uint8_t)bin.c_str()[11] && pos < bin.length(); probe++) {
+    pos += 2 + NAME_LENGTH;
+    std::vector<String> rows;
+    long centi = 0;
+    int span = 0;
+    for (unsigned long row = 0; row < count; row++) {
+      while(span + 1 < spans && row >= binU16(bin, 21 + (span + 1) * 4)) {
+        span++;
+      }
+      unsigned long local = base + row * interval + (int16_t)binU16(bin, 21 + span * 4 + 2) * 60L;
+      int16_t sample = binU16(bin, pos);
+      pos += 2;
+      char text[40];
+      if(sample == BIN_NAN_SAMPLE) {
+        snprintf(text, sizeof(text), "[%lu000,null]", local);
+      } else {
+        if(sample == BIN_ABS_SAMPLE) {
+          centi = binI32(bin, pos);
+          pos += 4;
+        } else {
+          centi += sample;
+        }
+        snprintf(text, sizeof(text), "[%lu000,%.2f]", local, centi / 100.0);
+      }
+      rows.push_back(text);
+    }
+    probes.push_back(rows);
+  }
+  return probes;
+}
+
+// Every tier of the cook checkDownsampleFidelity played in both formats,
+// the .bin rows decoded have to be the JSON rows.  One line per tier with
+// the size of each reply and how long it took to encode.  Returns false if
+// a row differs
+static bool checkBinRoundTrip() {
+  bool ok = true;
+  for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+    String json;
+    String bin;
+    auto started = std::chrono::steady_clock::now();
+    fillReply(tier, false, &json);
+    auto encoded = std::chrono::steady_clock::now();
+    fillReply(tier, true, &bin);
+    auto finished = std::chrono::steady_clock::now();
+
+    std::vector<std::vector<String>> jsonRows = probeRows(json);
+    std::vector<std::vector<String>> binRows = binProbeRows(bin);
+    unsigned long rows = 0;
+    unsigned long wrong = jsonRows.size() != binRows.size();
+    for (size_t probe = 0; probe < jsonRows.size() && probe < binRows.size(); probe++) {
+      rows += jsonRows[probe].size();
+      wrong += jsonRows[probe].size() != binRows[probe].size();
+      for (size_t row = 0; row < jsonRows[probe].size() && row < binRows[probe].size(); row++) {
+        if(jsonRows[probe][row] != binRows[probe][row] && wrong++ < 5) {
+          printf("!!! tier %d probe %zu row %zu: json %s, bin %s\n", tier, probe, row,
+            jsonRows[probe][row].c_str(), binRows[probe][row].c_str());
+        }
+      }
+    }
+    double jsonUs = std::chrono::duration<double, std::micro>(encoded - started).count();
+    double binUs = std::chrono::duration<double, std::micro>(finished - encoded).count();
+    printf("bin round trip: tier %d, %lu rows, %lu wrong, json %u bytes in %.0fus, bin %u bytes in %.0fus (%.0f%% of the json)\n",
+      tier, rows, wrong, json.length(), jsonUs, bin.length(), binUs, json.length() > 0 ? 100.0 * bin.length() / json.length() : 0);
+    ok = ok && wrong == 0 && rows > 0;
+  }
+  return ok;
+}
+
+// Rows of every tier in both formats have to carry the local time
+// myTZ.toLocal gives their bucket, with history either side of a DST
+// change.  Both changes of 2024 (myDST, mySTD) are crossed.  Returns false
+// if a row is off or a reply didn't cross the change
+static bool checkDstBoundary() {
+  // 2am EST on 10 Mar and 2am EDT on 3 Nov, in UTC
+  const unsigned long changes[] = {1710054000UL, 1730613600UL};
+  unsigned long rows = 0;
+  unsigned long wrong = 0;
+  bool crossed = true;
+
+  for (unsigned long change : changes) {
+    for (unsigned long t = change - DST_CHECK_BEFORE; t <= change + DST_CHECK_AFTER; t += 5) {
+      benchUpdate.updateTime = t;
+      for (int probe = 0; probe < NUM_PROBES; probe++) {
+        benchUpdate.temperatures[probe] = 150 + probe;
+        benchUpdate.connected[probe] = true;
+      }
+      storeData(benchUpdate);
+    }
+
+    for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+      // JSON, row k is bucket since + k
+      String json;
+      fillReply(tier, false, &json);
+      unsigned long first = 0;
+      unsigned long interval = 0;
+      sscanf(json.c_str(), "{\"seq\": %*u, \"since\": %lu, \"size\": %*u, \"interval\": %lu", &first, &interval);
+      unsigned long bucket = first;
+      for (const auto &row : replyRows(json)) {
+        unsigned long utc = bucket++ * interval;
+        rows++;
+        wrong += (unsigned long)row.first != (unsigned long)myTZ.toLocal(utc) * 1000;
+      }
+      crossed &= first * interval < change && bucket * interval > change;
+
+      // binary, the header's offsets applied to each row, see nextDataBinPiece
+      String bin;
+      fillReply(tier, true, &bin);
+      unsigned long base = binU16(bin, 12) | binU16(bin, 14) << 16;
+      interval = binU16(bin, 16);
+      unsigned long count = binU16(bin, 18);
+      int spans = (uint8_t)bin.c_str()[20];
+      int span = 0;
+      for (unsigned long row = 0; row < count; row++) {
+        while(span + 1 < spans && row >= binU16(bin, 21 + (span + 1) * 4)) {
+          span++;
+        }
+        unsigned long utc = base + row * interval;
+        long offset = (int16_t)binU16(bin, 21 + span * 4 + 2) * 60L;
+        rows++;
+        wrong += utc + offset != (unsigned long)myTZ.toLocal(utc);
+      }
+      crossed &= spans == 2;
+    }
+  }
+  printf("dst check: %lu rows, %lu wrong, %s the change\n", rows, wrong, crossed ? "crossed" : "didn't cross");
+  return wrong == 0 && crossed;
+}
+
+int runBenchmarks() {
+  // conversion, inputs cover the range a probe actually sees
+  bench("getResistance", [] {
+    sinkDouble = getResistance(BALANCE_RESISTOR, INPUT_VOLTAGE, 0.1 + (benchOp % 3000) / 1000.0);
+  });
+  bench("getTempK", [] {
+    sinkDouble = getTempK(BETA, ROOM_TEMP, RESISTOR_ROOM_TEMP, 10000 + (benchOp % 4096) * 48);
+  });
+  bench("getTempKSteinhartHart", [] {
+    static thermistorCalibration calibration = betaCalibration(BETA, ROOM_TEMP, RESISTOR_ROOM_TEMP);
+    sinkDouble = getTempKSteinhartHart(calibration, 10000 + (benchOp % 4096) * 48);
+  });
+  bench("kToF", [] {
+    sinkDouble = kToF(250 + (benchOp % 2048) / 8.0);
+  });
+  bench("codeToTempF", [] {
+    sinkDouble = codeToTempF(benchOp % NUM_PROBES, 1000 + (benchOp % 16384));
+  });
+
+  // a whole poll against the simulated rig, conversions, LCD and storage
+  bench("acquireTemps", [] {
+    acquireTemps();
+    simAdvance(1);
+  });
+
+  // LCD traffic for a second of cook, redrawing everything the way the
+  // acquisition loop used to vs only sending what changed
+  bench("lcd.fullRedraw", [] {
+    acquireTemps();
+    simAdvance(1);
+    displayInvalidate();
+    displayFlush();
+  });
+  bench("lcd.changedCells", [] {
+    acquireTemps();
+    simAdvance(1);
+    displayFlush();
+  });
+
+  // storage, a second of cook per op so buckets close at the real rate
+  benchTime = halEpochTime();
+  bench("storeData", [] {
+    nextUpdate();
+    storeData(benchUpdate);
+  });
+  bench("saveLastTemps", [] {
+    saveLastTemps(benchUpdate);
+  });
+
+  // serialization, against a history that's been filling for a while
+  rangeFrom = myTZ.toLocal(benchTime);
+  for (long second = 0; second < BENCH_PREFILL_HOURS * 3600L; second++) {
+    nextUpdate();
+    storeData(benchUpdate);
+  }
+  bench("getLastTempsJson", [] {
+    sinkSize = getLastTempsJson().length();
+  });
+  bench("getDataJson", [] {
+    sinkSize = getDataJson(0).length();
+  });
+  size_t stringLargest = allocLargest;
+  bench("fillHistory.fine", [] {
+    fillReply(0, false);
+  });
+  bench("fillHistory.medium", [] {
+    fillReply(1, false);
+  });
+  bench("fillHistory.coarse", [] {
+    fillReply(HISTORY_TIERS - 1, false);
+  });
+  // the same reply as a String and streamed, the server's chunk buffer is
+  // the only block the streamed one needs on top
+  printf("history peak heap: getDataJson %zu bytes in one block, fillHistory %zu plus the %d byte chunk buffer\n",
+    stringLargest, allocLargest, BENCH_CHUNK_SIZE);
+  bench("fillHistory.coarse.bin", [] {
+    fillReply(HISTORY_TIERS - 1, true);
+  });
+  bench("fillHistory.range", [] {
+    fillRange(0);
+  });
+  bench("fillHistory.range.lttb", [] {
+    fillRange(LTTB_POINTS);
+  });
+  benchArchive();
+
+  // display
+  bench("getTimeString", [] {
+    sinkSize = getTimeString(1700000000 + benchOp * 60).length();
+  });
+  bench("lcdLineClear", [] {
+    sinkSize = lcdLineClear(benchOp % 20).length();
+  });
+
+  // last, they play a whole cook into the history, archive it again and
+  // then move it on to 2024 for the DST changes
+  bool ok = checkTempTables();
+  ok = checkAdcScan() && ok;
+  ok = checkDownsampleFidelity(LTTB_POINTS) && ok;
+  ok = checkBinRoundTrip() && ok;
+  ok = checkEventFanout() && ok;
+  ok = checkSinceReplay() && ok;
+  ok = checkArchiveDeadband() && ok;
+  ok = checkDstBoundary() && ok;
+  return ok ? 0 : 1;
+}
+
+// Days of cook with the UI open on SOAK_EVENT_CLIENTS /events streams, as
+// fast as it'll go.  One line per day:
+//
+//   {"soak_day": 1, "loop_allocs": 0, "request_allocs": 61234,
+//    "live_blocks": 25, "largest_alloc": 4096}
+//
+// loop_allocs is what the acquisition loop allocated after SOAK_WARMUP,
+// it has to be 0, publishing the events included.  Sending them is the
+// events task's job and counts as a request.  live_blocks can't grow
+// after the first day.  The host heap can't say what its largest free
+// block is, largest_alloc is the biggest single block anything asked
+// for, the board's largest free block
+// (probeinator_heap_largest_free_block_bytes) has to stay above it.
+// Returns 1 if either check failed
+int runSoak(double days) {
+  unsigned long seconds = days * 86400;
+  unsigned long loopAllocs = 0;
+  unsigned long requestAllocs = 0;
+  unsigned long since = 0; // seq the graph is up to, from the last reply
+  long firstDayBlocks = -1;
+  int failed = 0;
+  AsyncEventSource::clients = SOAK_EVENT_CLIENTS;
+
+  for (unsigned long second = 1; second <= seconds; second++) {
+    allocCount = 0;
+    countAllocs = second > SOAK_WARMUP;
+    acquireTemps();
+    displayFlush();
+    countAllocs = false;
+    loopAllocs += allocCount;
+    simAdvance(1);
+
+    // what the page and a Prometheus server would be asking for
+    allocCount = 0;
+    countAllocs = true;
+    sendEvents();
+    if(second % SOAK_POLL_INTERVAL == 0) {
+      sinkSize = getLastTempsJson().length();
+    }
+    if(second % SOAK_SCRAPE_INTERVAL == 0) {
+      sinkSize = getMetricsText().length();
+    }
+    if(second % SOAK_GRAPH_INTERVAL == 0) {
+      String reply = getDataJson(since);
+      sscanf(reply.c_str(), "{\"seq\": %lu", &since);
+    }
+    if(second % SOAK_RELOAD_INTERVAL == 0) {
+      fillReply(HISTORY_TIERS - 1, false);
+      fillReply(HISTORY_TIERS - 1, true);
+    }
+    countAllocs = false;
+    requestAllocs += allocCount;
+
+    if(second % 86400 == 0 || second == seconds) {
+      long blocks = liveBlocks.load();
+      if(firstDayBlocks < 0) {
+        firstDayBlocks = blocks;
+      }
+      bool ok = loopAllocs == 0 && blocks <= firstDayBlocks;
+      failed |= !ok;
+      printf("{\"soak_day\": %lu, \"loop_allocs\": %lu, \"request_allocs\": %lu, \"live_blocks\": %ld, \"largest_alloc\": %zu}%s\n",
+        (second + 86399) / 86400, loopAllocs, requestAllocs, blocks, largestAlloc.load(), ok ? "" : " FAILED");
+      fflush(stdout);
+      loopAllocs = 0;
+      requestAllocs = 0;
+    }
+  }
+  return failed;
+}
@@ -0,0 +1,306 @@
+#include <map>
+#include <sstream>
+#include <vector>
+#include "../probeinator.h"
+#include "simRig.h"
+
+//
+// Native HAL: the simulated probe rig
+//
+
+#define SIM_START_TIME 1700000000 // UTC seconds the simulated clock starts at
+#define SIM_FULL_SCALE 6.144      // volts at code 32767, the ADS1115 default gain
+#define SIM_NOISE_CODES 2.0       // std deviation of the conversion noise
+#define SIM_SPIKE_ODDS 200        // 1 in this many conversions is a spike
+#define SIM_LCD_BUS_BYTES 12      // I2C bytes per LCD byte through the PCF8574 backpack
+#define SIM_CONVERSION_US 1280    // an 860 SPS conversion, 1163us plus the ADS1115's 10% rate tolerance
+#define SIM_I2C_BYTE_US 90        // a byte and its ack at Wire's default 100kHz
+#define SIM_ADC_START_BYTES 4     // requestADC writes the config register: address, pointer, 2 bytes
+#define SIM_ADC_READ_BYTES 5      // getValue sets the pointer (address, pointer) then reads (address, 2 bytes)
+
+struct cookPoint {
+  unsigned long minute;
+  float temps[NUM_PROBES]; // nan = unplugged
+};
+
+// A long brisket: pit probe, two in the meat (one sits in the stall a
+// while), and one that gets plugged in part way through and pulled again.
+// The pit stays under ~255F, past that the divider is below
+// MIN_PROBE_RESISTANCE and reads as unplugged
+static const char *defaultScript =
+  "# minute pit  flat point ambient\n"
+  "0        70   38   38    -\n"
+  "30       225  45   44    -\n"
+  "60       240  70   68    -\n"
+  "180      235  140  135   -\n"
+  "240      245  158  152   72\n"
+  "420      240  163  158   75\n"
+  "480      230  165  163   -\n"
+  "600      245  185  180   -\n"
+  "720      235  198  195   -\n"
+  "780      225  203  201   -\n"
+  "840      170  200  199   -\n";
+
+static std::vector<cookPoint> cookScript;
+static unsigned long simTime = SIM_START_TIME;
+static unsigned long scriptStart = SIM_START_TIME; // simTime the script's minute 0 is at
+static int adcChannels[ADS_CHIPS];
+static unsigned long adcMicros = 0;            // bus time the conversions would have taken on the board
+static unsigned long adcReadyAt[ADS_CHIPS];    // adcMicros each chip's conversion is done at
+static std::vector<simAdcConversion> *adcTrace = NULL;
+static uint32_t noiseState = 0x9E3779B9;
+static char displayFrame[LCD_ROWS][LCD_COLS + 1];
+static unsigned long displayBusBytes = 0;
+static std::map<std::string, std::vector<uint8_t>> store;
+
+static bool parseScript(std::istream &in) {
+  std::vector<cookPoint> points;
+  std::string line;
+  while(std::getline(in, line)) {
+    if(line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    cookPoint point;
+    if(!(fields >> point.minute)) {
+      return false;
+    }
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      std::string temp;
+      fields >> temp;
+      point.temps[probe] = temp.empty() || temp == "-" ? nanf("") : atof(temp.c_str());
+    }
+    if(!points.empty() && point.minute < points.back().minute) {
+      return false;
+    }
+    points.push_back(point);
+  }
+  if(points.empty()) {
+    return false;
+  }
+  cookScript = points;
+  return true;
+}
+
+// Use a cook script given as text
+bool simUseScript(const char *text) {
+  std::istringstream in(text);
+  return parseScript(in);
+}
+
+// Load a cook script from a file, the brisket above is used otherwise
+bool simLoadScript(const char *path) {
+  FILE *file = fopen(path, "r");
+  if(file == NULL) {
+    return false;
+  }
+  std::string text;
+  char buffer[256];
+  size_t len;
+  while((len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    text.append(buffer, len);
+  }
+  fclose(file);
+  return simUseScript(text.c_str());
+}
+
+static const std::vector<cookPoint> &script() {
+  if(cookScript.empty()) {
+    std::istringstream in(defaultScript);
+    parseScript(in);
+  }
+  return cookScript;
+}
+
+unsigned long simScriptMinutes() {
+  return script().back().minute;
+}
+
+void simAdvance(unsigned long seconds) {
+  simTime += seconds;
+}
+
+// Play the script again from here, the clock keeps going
+void simRestartScript() {
+  scriptStart = simTime;
+}
+
+// Scripted temp for a probe right now, interpolated between points.  A
+// probe is unplugged from any point marked - until the next one
+static float scriptTemp(int probe) {
+  const std::vector<cookPoint> &points = script();
+  double minute = (simTime - scriptStart) / 60.0;
+  if(minute >= points.back().minute) {
+    return points.back().temps[probe];
+  }
+  size_t next = 1;
+  while(points[next].minute <= minute) {
+    next++;
+  }
+  const cookPoint &from = points[next - 1];
+  const cookPoint &to = points[next];
+  if(isnan(from.temps[probe]) || isnan(to.temps[probe])) {
+    return from.temps[probe];
+  }
+  double fraction = (minute - from.minute) / (to.minute - from.minute);
+  return from.temps[probe] + (to.temps[probe] - from.temps[probe]) * fraction;
+}
+
+// xorshift, the same noise every run
+static double noise() {
+  noiseState ^= noiseState << 13;
+  noiseState ^= noiseState >> 17;
+  noiseState ^= noiseState << 5;
+  return (noiseState % 10000) / 10000.0;
+}
+
+//
+// ADC
+//
+
+void halAdcBegin() {
+}
+
+// The chips are started one after the other and convert side by side,
+// the way the bus task runs a conversion
+void halAdcStart(const int *channels) {
+  memcpy(adcChannels, channels, sizeof(adcChannels));
+  for (int chip = 0; chip < ADS_CHIPS; chip++) {
+    if(channels[chip] < 0) {
+      continue;
+    }
+    adcMicros += SIM_ADC_START_BYTES * SIM_I2C_BYTE_US;
+    adcReadyAt[chip] = adcMicros + SIM_CONVERSION_US;
+    if(adcTrace != NULL) {
+      adcTrace->push_back({adcMicros, chip, channels[chip]});
+    }
+  }
+}
+
+bool halAdcWait(int chip) {
+  if(adcChannels[chip] < 0) {
+    return false;
+  }
+  adcMicros = max(adcMicros, adcReadyAt[chip]);
+  return true;
+}
+
+// The code the divider gives for the scripted temp of the probe on the
+// chip's channel, the thermistor follows the default beta curve.  An
+// unplugged jack reads the full input voltage
+int16_t halAdcValue(int chip) {
+  adcMicros += SIM_ADC_READ_BYTES * SIM_I2C_BYTE_US;
+  float temp = scriptTemp(chip * ADS_CHANNELS + adcChannels[chip]);
+  double voltage = INPUT_VOLTAGE;
+  if(!isnan(temp)) {
+    double tempK = (temp - 32) / 1.8 + ZERO_C;
+    double resistance = RESISTOR_ROOM_TEMP * exp(BETA * (1.0 / tempK - 1.0 / ROOM_TEMP));
+    voltage = INPUT_VOLTAGE * resistance / (resistance + BALANCE_RESISTOR);
+  }
+
+  // roughly gaussian noise, and now and then a spike for the filter
+  double jitter = (noise() + noise() + noise() - 1.5) * 2 * SIM_NOISE_CODES;
+  if((int)(noise() * SIM_SPIKE_ODDS) == 0) {
+    jitter += 400;
+  }
+  return constrain(lround(voltage / SIM_FULL_SCALE * 32767 + jitter), -32768L, 32767L);
+}
+
+double halAdcVoltage(int code) {
+  return code * SIM_FULL_SCALE / 32767;
+}
+
+unsigned long simAdcMicros() {
+  return adcMicros;
+}
+
+void simAdcTrace(std::vector<simAdcConversion> *trace) {
+  adcTrace = trace;
+}
+
+//
+// Display, kept as a frame.  Bus bytes are counted the way LiquidCrystal_I2C
+// sends them: 4 bit mode, each nibble is 3 expander writes (data, enable
+// high, enable low) of address + value
+//
+
+void halDisplayBegin() {
+  halDisplayClear();
+}
+
+bool halDisplayClear() {
+  for (int row = 0; row < LCD_ROWS; row++) {
+    memset(displayFrame[row], ' ', LCD_COLS);
+    displayFrame[row][LCD_COLS] = 0;
+  }
+  displayBusBytes += SIM_LCD_BUS_BYTES;
+  return true;
+}
+
+bool halDisplayPrint(int col, int row, const char *text) {
+  if(row < 0 || row >= LCD_ROWS) {
+    return false;
+  }
+  size_t len = strlen(text);
+  for (unsigned int i = 0; i < len && col + i < LCD_COLS; i++) {
+    displayFrame[row][col + i] = text[i];
+  }
+  displayBusBytes += (1 + len) * SIM_LCD_BUS_BYTES; // setCursor + the text
+  return true;
+}
+
+String simDisplayLine(int row) {
+  return String(displayFrame[row]);
+}
+
+unsigned long simDisplayBusBytes() {
+  return displayBusBytes;
+}
+
+//
+// Clock, only moves when simAdvance is called
+//
+
+void halClockBegin() {
+}
+
+void halClockUpdate() {
+}
+
+unsigned long halEpochTime() {
+  return simTime;
+}
+
+//
+// Key-value store, in memory
+//
+
+static std::string storeKey(const String &space, const char *key) {
+  return std::string(space.c_str()) + "/" + key;
+}
+
+bool halStoreGet(const String &space, const char *key, void *value, size_t len) {
+  auto entry = store.find(storeKey(space, key));
+  if(entry == store.end()) {
+    return false;
+  }
+  memcpy(value, entry->second.data(), min(len, entry->second.size()));
+  return true;
+}
+
+bool halStorePut(const String &space, const char *key, const void *value, size_t len) {
+  store[storeKey(space, key)].assign((const uint8_t *)value, (const uint8_t *)value + len);
+  return true;
+}
+
+bool halStoreClear(const String &space) {
+  std::string prefix = std::string(space.c_str()) + "/";
+  for (auto entry = store.begin(); entry != store.end();) {
+    if(entry->first.compare(0, prefix.size(), prefix) == 0) {
+      entry = store.erase(entry);
+    } else {
+      entry++;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,202 @@
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <stdlib.h>
+#include "../webHandlers.h"
+#include "simRig.h"
+
+//
+// Native entry point.  Runs the same acquisition -> storage -> JSON pipeline
+// as the board, fed by the simulated probe rig and as fast as it'll go:
+//
+//   probeinator [hours] [cook script]
+//   probeinator bench
+//   probeinator soak [days]
+//   probeinator stress [seconds]
+//   probeinator powercut
+//   probeinator step [from] [to]
+//   probeinator serve [port] [cook script]
+//
+// hours defaults to the length of the script, days to SOAK_DAYS, seconds to STRESS_SECONDS,
+// from and to (F) to STEP_FROM and STEP_TO.  Set PROBEINATOR_FS to keep
+// the history log between runs, otherwise each run gets a fresh directory.
+// powercut always starts from a fresh one and runs itself again as
+// "powercut reboot" on the same directory
+//
+// serve runs the board's tasks on a real clock with the web routes on
+// port (SERVE_PORT), for pointing a browser or tools/loadtest.py at.  The
+// first half of the script is played as fast as it'll go first so there's
+// history to serve.  The UI pages come from data/ under the current
+// directory
+//
+
+#define SOAK_DAYS 3
+#define STRESS_SECONDS 5
+#define STEP_FROM 150.0 // the pit reads as unplugged past ~255F
+#define STEP_TO 225.0
+#define SERVE_PORT 8080
+
+// The board's sampler and processing tasks (main.cpp) with a condition
+// variable standing in for the task notification.  The rig's clock moves
+// on with every scan so it keeps up with the real one, it only counts
+// whole seconds so the rest is carried over
+static std::mutex readingsLock;
+static std::condition_variable readingsQueued;
+static bool readingsWaiting = false;
+
+static void serveSampler() {
+  auto nextScan = std::chrono::steady_clock::now();
+  unsigned long simMillis = 0;
+  for (;;) {
+    sampleProbes();
+    {
+      std::lock_guard<std::mutex> guard(readingsLock);
+      readingsWaiting = true;
+    }
+    readingsQueued.notify_one();
+    int interval = nextScanInterval();
+    simMillis += interval;
+    simAdvance(simMillis / 1000);
+    simMillis %= 1000;
+    nextScan += std::chrono::milliseconds(interval);
+    std::this_thread::sleep_until(nextScan);
+  }
+}
+
+static void serveProcessing() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(readingsLock);
+      readingsQueued.wait(guard, [] { return readingsWaiting; });
+      readingsWaiting = false;
+    }
+    processReadings();
+  }
+}
+
+// Copy the UI pages onto the simulated SPIFFS, what uploading the
+// filesystem image does for the board
+static void uploadPages() {
+  for (const char *page : {"/index.html", "/settings.html"}) {
+    FILE *in = fopen((std::string("data") + page).c_str(), "rb");
+    if(in == NULL) {
+      Serial.println("!!! No data" + String(page) + ", run from the project directory");
+      continue;
+    }
+    File out = SPIFFS.open(page, FILE_WRITE);
+    uint8_t buffer[1024];
+    size_t count;
+    while((count = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+      out.write(buffer, count);
+    }
+    out.close();
+    fclose(in);
+  }
+}
+
+static int serve(int port) {
+  for (unsigned long second = 0; second < simScriptMinutes() * 60 / 2; second++) {
+    acquireTemps();
+    simAdvance(1);
+  }
+  uploadPages();
+  initStaticAssets();
+  AsyncWebServer::hostPort = port;
+  initWebRoutes();
+  startDisplayTask();
+  std::thread(serveProcessing).detach();
+  serveSampler();
+  return 0;
+}
+
+// The tasks are detached threads still running when main is done, skip
+// the static destructors so the FS isn't torn down under the log task
+static int finish(int status) {
+  fflush(stdout);
+  quick_exit(status);
+}
+
+int main(int argc, char **argv) {
+  bool benchmarks = argc > 1 && strcmp(argv[1], "bench") == 0;
+  bool soak = argc > 1 && strcmp(argv[1], "soak") == 0;
+  bool stress = argc > 1 && strcmp(argv[1], "stress") == 0;
+  bool powerCut = argc > 1 && strcmp(argv[1], "powercut") == 0;
+  bool rebooted = powerCut && argc > 2 && strcmp(argv[2], "reboot") == 0;
+  bool stepping = argc > 1 && strcmp(argv[1], "step") == 0;
+  bool serving = argc > 1 && strcmp(argv[1], "serve") == 0;
+  const char *script = serving ? (argc > 3 ? argv[3] : NULL) : (argc > 2 ? argv[2] : NULL);
+  if(!benchmarks && !soak && !stress && !powerCut && !stepping && script != NULL && !simLoadScript(script)) {
+    Serial.println("!!! Couldn't load cook script " + String(script));
+    return 1;
+  }
+  double hours = argc > 1 && !benchmarks && !soak && !stress && !powerCut && !stepping && !serving ? atof(argv[1]) : simScriptMinutes() / 60.0;
+
+  if(powerCut && !rebooted) {
+    char fresh[] = "/tmp/probeinator.XXXXXX";
+    if(mkdtemp(fresh) == NULL) {
+      Serial.println("!!! Couldn't make a directory for the power cut");
+      return 1;
+    }
+    setenv("PROBEINATOR_FS", fresh, 1);
+  }
+
+  if(!SPIFFS.begin(true)) {
+    Serial.println("An Error has occurred while mounting SPIFFS");
+    return 1;
+  }
+  halDisplayBegin();
+  initDisplay();
+  halAdcBegin();
+  initTempTables();
+  initProbeFilters();
+  halClockBegin();
+  initHistoryLog();
+  restoreHistory();
+  applyPrefs();
+
+  if(benchmarks) {
+    return finish(runBenchmarks());
+  }
+  if(soak) {
+    return finish(runSoak(argc > 2 ? atof(argv[2]) : SOAK_DAYS));
+  }
+  if(stress) {
+    return finish(runStress(argc > 2 ? atof(argv[2]) : STRESS_SECONDS));
+  }
+  if(powerCut) {
+    return finish(runPowerCut(rebooted));
+  }
+  if(stepping) {
+    return finish(runStep(argc > 2 ? atof(argv[2]) : STEP_FROM, argc > 3 ? atof(argv[3]) : STEP_TO));
+  }
+  if(serving) {
+    return finish(serve(argc > 2 ? atoi(argv[2]) : SERVE_PORT));
+  }
+
+  // the scans come as often as the sampler would ask for them
+  unsigned long loops = 0;
+  unsigned long simMillis = 0;
+  unsigned long started = micros();
+  for (unsigned long played = 0; played < hours * 3600 * 1000; loops++) {
+    acquireTemps();
+    displayFlush(); // the render task's job on the board
+    int interval = nextScanInterval();
+    played += interval;
+    simMillis += interval;
+    simAdvance(simMillis / 1000);
+    simMillis %= 1000;
+  }
+  unsigned long elapsed = micros() - started;
+
+  Serial.println("Simulated " + String(hours) + " hours (" + String(loops) + " loops) in " +
+    String(elapsed / 1000) + "ms, " + String((double)elapsed / max(loops, 1UL), 1) + "us per loop");
+  Serial.println();
+  for (int row = 0; row < LCD_ROWS; row++) {
+    Serial.println("| " + simDisplayLine(row) + " |");
+  }
+  Serial.println();
+  Serial.println("Last temps: " + getLastTempsJson());
+  dumpHistory();
+  return finish(0);
+}
@@ -0,0 +1,276 @@
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../probeinator.h"
+#include "simRig.h"
+
+//
+// Power cut test for the flash history log.  Runs as two boots on the
+// same PROBEINATOR_FS directory:
+//
+// The first cooks until the log has a few segments, waits for the log
+// task to write everything it was handed and then does what a power cut
+// can leave behind to the newest three segments:
+//
+//   oldest of the three  one record corrupted in the middle
+//   next                 cut off half way through its last page
+//   head                 cut off half way through its last record
+//
+// It saves the records that should survive (everything on flash but the
+// corrupted record and whatever was cut off) to POWERCUT_EXPECTED and runs
+// the program again as the next boot.  That one (main has run
+// initHistoryLog and restoreHistory like the board does) checks:
+//
+//   - reading the log back gives exactly the surviving records
+//   - every row of the logged tiers' replies is its surviving record's
+//     avg, and null where the record was lost
+//   - new pages go into a new segment, the cut off head is left alone
+//
+// One JSON line per boot:
+//
+//   {"powercut": "cut", "segments": 5, "records": 2312, "lost": 6}
+//   {"powercut": "reboot", "log_records": 2306, "log_wrong": 0,
+//    "rows": 1480, "rows_wrong": 0, "new_segment": 1}
+//
+// The second returns 1 if any check failed
+//
+
+#define POWERCUT_HOURS 36       // hours of cook before the power goes, enough for a few segments
+#define POWERCUT_DOWNTIME 120   // seconds the power is out for
+#define POWERCUT_AFTER 900      // seconds of cook after the reboot, a couple of pages
+#define POWERCUT_IDLE 100       // ms the log files have to stay the same size for the log task to count as done
+#define POWERCUT_EXPECTED "powercut" // file under PROBEINATOR_FS the first boot leaves for the second
+
+// What the first boot hands the second, followed by the surviving records
+struct powerCutHeader {
+  uint32_t head;     // seq of the segment being written when the power went
+  uint32_t headSize; // bytes left in it
+  uint32_t endTime;  // sim time the power went
+  uint32_t records;
+};
+
+static std::string hostPath(const std::string &name) {
+  return std::string(getenv("PROBEINATOR_FS")) + "/" + name;
+}
+
+static std::string segmentFile(unsigned long seq) {
+  return hostPath("hlog" + std::to_string(seq));
+}
+
+static long fileSize(const std::string &path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 ? info.st_size : -1;
+}
+
+// seqs of the segments on the FS, oldest first
+static std::vector<unsigned long> listSegments() {
+  std::vector<unsigned long> segments;
+  DIR *dir = opendir(getenv("PROBEINATOR_FS"));
+  if(dir == NULL) {
+    return segments;
+  }
+  while(struct dirent *entry = readdir(dir)) {
+    if(strncmp(entry->d_name, "hlog", 4) == 0) {
+      segments.push_back(strtoul(entry->d_name + 4, NULL, 10));
+    }
+  }
+  closedir(dir);
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+// Wait until the log task has written everything it was handed, which is
+// when the segments stop growing
+static void waitForLog() {
+  long last = -1;
+  for (;;) {
+    long total = 0;
+    for (unsigned long seq : listSegments()) {
+      total += fileSize(segmentFile(seq));
+    }
+    if(total == last) {
+      return;
+    }
+    last = total;
+    std::this_thread::sleep_for(std::chrono::milliseconds(POWERCUT_IDLE));
+  }
+}
+
+// Every whole record in a segment, straight off the FS
+static std::vector<historyLogRecord> segmentRecords(unsigned long seq) {
+  std::vector<historyLogRecord> records;
+  FILE *in = fopen(segmentFile(seq).c_str(), "rb");
+  historyLogRecord record;
+  while(in != NULL && fread(&record, sizeof(record), 1, in) == 1) {
+    records.push_back(record);
+  }
+  if(in != NULL) {
+    fclose(in);
+  }
+  return records;
+}
+
+static void cook(unsigned long seconds) {
+  for (unsigned long second = 0; second < seconds; second++) {
+    acquireTemps();
+    simAdvance(1);
+  }
+}
+
+// First boot: cook, cut the power and reboot
+static int powerCut() {
+  cook(POWERCUT_HOURS * 3600UL);
+  waitForLog();
+
+  std::vector<unsigned long> segments = listSegments();
+  if(segments.size() < 3) {
+    printf("!!! Only %zu history log segments, the power cut needs 3\n", segments.size());
+    return 1;
+  }
+  unsigned long head = segments.back();
+  size_t recordSize = sizeof(historyLogRecord);
+  size_t pageRecords = LOG_PAGE_SIZE / recordSize;
+  std::vector<historyLogRecord> survivors;
+  unsigned long records = 0;
+  unsigned long lost = 0;
+
+  for (unsigned long seq : segments) {
+    std::vector<historyLogRecord> written = segmentRecords(seq);
+    size_t keep = written.size();
+    long corrupt = -1;
+    if(seq == head - 2) {
+      corrupt = written.size() / 2;
+      FILE *file = fopen(segmentFile(seq).c_str(), "r+b");
+      long at = corrupt * recordSize + offsetof(historyLogRecord, buckets);
+      fseek(file, at, SEEK_SET);
+      int byte = fgetc(file);
+      fseek(file, at, SEEK_SET);
+      fputc(byte ^ 0x40, file);
+      fclose(file);
+    } else if(seq == head - 1) {
+      keep = written.size() - pageRecords + pageRecords / 2;
+      truncate(segmentFile(seq).c_str(), keep * recordSize);
+    } else if(seq == head) {
+      keep = written.size() - 1;
+      truncate(segmentFile(seq).c_str(), keep * recordSize + recordSize / 2);
+    }
+    for (size_t i = 0; i < written.size(); i++) {
+      if(i < keep && (long)i != corrupt) {
+        survivors.push_back(written[i]);
+      }
+    }
+    records += written.size();
+    lost += written.size() - keep + (corrupt >= 0);
+  }
+
+  struct powerCutHeader header;
+  header.head = head;
+  header.headSize = fileSize(segmentFile(head));
+  header.endTime = halEpochTime();
+  header.records = survivors.size();
+  FILE *out = fopen(hostPath(POWERCUT_EXPECTED).c_str(), "wb");
+  fwrite(&header, sizeof(header), 1, out);
+  fwrite(survivors.data(), recordSize, survivors.size(), out);
+  fclose(out);
+
+  printf("{\"powercut\": \"cut\", \"segments\": %zu, \"records\": %lu, \"lost\": %lu}\n", segments.size(), records, lost);
+  fflush(stdout);
+  execl("/proc/self/exe", "probeinator", "powercut", "reboot", (char *)NULL);
+  printf("!!! Couldn't reboot into the second run\n");
+  return 1;
+}
+
+// Rows of a JSON reply from one tier checked against the surviving records,
+// row k of each probe is bucket since + k.  Adds to rows and wrong
+static void checkTierRows(int tier, const std::map<std::pair<int, unsigned long>, historyLogRecord> &survivors,
+    unsigned long *rows, unsigned long *wrong) {
+  struct historyCursor cursor;
+  uint8_t buffer[HISTORY_PIECE_SIZE];
+  String reply;
+  size_t count;
+  cursor.tier = tier;
+  while((count = fillHistory(&cursor, buffer, sizeof(buffer))) > 0) {
+    reply.concat((char *)buffer, count);
+  }
+  unsigned long since = 0;
+  int interval = 0;
+  sscanf(reply.c_str(), "{\"seq\": %*u, \"since\": %lu, \"size\": %*u, \"interval\": %d", &since, &interval);
+
+  const char *pos = reply.c_str();
+  for (int probe = 0; (pos = strstr(pos, "\"data\": [")) != NULL; probe++) {
+    pos += 9;
+    for (unsigned long bucket = since; *pos == '['; bucket++) {
+      const char *value = strchr(pos, ',') + 1;
+      auto found = survivors.find(std::make_pair(interval, bucket));
+      int16_t avg = found != survivors.end() ? found->second.buckets[probe].avg : BUCKET_NAN;
+      bool null = strncmp(value, "null", 4) == 0;
+      (*rows)++;
+      if(null != (avg == BUCKET_NAN) || (!null && fabs(atof(value) - avg / 10.0) > 0.001)) {
+        if((*wrong)++ < 10) {
+          printf("!!! Restored %ds bucket %lu probe %d is %.8s, logged %d\n", interval, bucket, probe, value, avg);
+        }
+      }
+      pos = strchr(value, ']') + 1;
+      pos += *pos == ',';
+    }
+  }
+}
+
+// Second boot: check what came back and that the log carries on in a new
+// segment
+static int reboot() {
+  struct powerCutHeader header;
+  std::vector<historyLogRecord> survivors;
+  FILE *in = fopen(hostPath(POWERCUT_EXPECTED).c_str(), "rb");
+  if(in == NULL || fread(&header, sizeof(header), 1, in) != 1) {
+    printf("!!! Nothing from before the power cut, run powercut without reboot\n");
+    return 1;
+  }
+  survivors.resize(header.records);
+  survivors.resize(fread(survivors.data(), sizeof(historyLogRecord), header.records, in));
+  fclose(in);
+
+  // the log read back, record for record
+  struct historyLogReader reader;
+  unsigned long logRecords = 0;
+  unsigned long logWrong = 0;
+  historyLogRewind(&reader, 0);
+  while(historyLogNext(&reader)) {
+    logWrong += logRecords >= survivors.size() ||
+      memcmp(&reader.record, &survivors[logRecords], sizeof(historyLogRecord)) != 0;
+    logRecords++;
+  }
+  logWrong += logRecords < survivors.size() ? survivors.size() - logRecords : 0;
+
+  // and the tiers restoreHistory rebuilt from it
+  std::map<std::pair<int, unsigned long>, historyLogRecord> byBucket;
+  for (const historyLogRecord &record : survivors) {
+    byBucket[std::make_pair((int)record.resolution, (unsigned long)record.bucket)] = record;
+  }
+  unsigned long rows = 0;
+  unsigned long rowsWrong = 0;
+  for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+    checkTierRows(tier, byBucket, &rows, &rowsWrong);
+  }
+
+  // power back on a little later, the new pages can't go after the cut
+  simAdvance(header.endTime + POWERCUT_DOWNTIME - halEpochTime());
+  cook(POWERCUT_AFTER);
+  waitForLog();
+  bool newSegment = fileSize(segmentFile(header.head + 1)) > 0 &&
+    fileSize(segmentFile(header.head)) == (long)header.headSize;
+
+  bool ok = logWrong == 0 && logRecords > 0 && rowsWrong == 0 && rows > 0 && newSegment;
+  printf("{\"powercut\": \"reboot\", \"log_records\": %lu, \"log_wrong\": %lu, \"rows\": %lu, \"rows_wrong\": %lu, "
+    "\"new_segment\": %d}%s\n", logRecords, logWrong, rows, rowsWrong, newSegment, ok ? "" : " FAILED");
+  return ok ? 0 : 1;
+}
+
+int runPowerCut(bool rebooted) {
+  return rebooted ? reboot() : powerCut();
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <vector>
+#include <Arduino.h>
+
+//
+// Simulated probe rig behind the native HAL (hal_native.cpp)
+//
+// Probes follow a cook script, one line per point in time:
+//
+//   <minute> <probe 0 F> <probe 1 F> ... <probe NUM_PROBES - 1 F>
+//
+// Temps are interpolated between lines and two lines at the same minute
+// are a step.  "-" or a missing column means unplugged and lines starting
+// with # are comments.  Each conversion is the ADS code the real divider
+// would give for that temp, plus noise and the odd spike.  Conversions
+// also move an ADC clock on by the bus and conversion time they'd take on
+// the board (Wire at 100kHz, 860 SPS)
+//
+
+// A conversion started on a chip, adcMicros is the ADC clock then
+struct simAdcConversion {
+  unsigned long adcMicros;
+  int chip;
+  int channel;
+};
+
+bool simLoadScript(const char *path);
+bool simUseScript(const char *text);
+void simAdvance(unsigned long seconds);
+void simRestartScript();
+unsigned long simScriptMinutes();
+String simDisplayLine(int row);
+unsigned long simDisplayBusBytes(); // I2C bytes sent to the LCD so far
+unsigned long simAdcMicros();       // the ADC clock
+void simAdcTrace(std::vector<simAdcConversion> *trace); // record conversions started into trace, NULL stops
+
+// Microbenchmarks and the heap soak (bench.cpp), the lock free read
+// stress test (stress.cpp), the history log power cut (powercut.cpp) and
+// the filter step response (step.cpp), run instead of the cook with
+// "bench", "soak", "stress", "powercut" or "step"
+int runBenchmarks();
+int runSoak(double days);
+int runStress(double seconds);
+int runPowerCut(bool rebooted);
+int runStep(double from, double to);
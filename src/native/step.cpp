@@ -0,0 +1,134 @@
+#include <string>
+#include "../probeinator.h"
+#include "simRig.h"
+
+//
+// Step response of the probe filters.  Every probe sits at one temp, then
+// jumps to another, played through the whole pipeline (adaptive scan rate
+// included) on the noisy, spiky simulated ADC.  Alongside each scan one
+// extra conversion per probe is taken straight off the ADC, the raw signal
+// the filter is working from.  One JSON line per probe:
+//
+//   {"step": 0, "from": 150.0, "to": 225.0, "raw_t90_ms": 1000,
+//    "filtered_t90_ms": 2000, "filtered_settled_ms": 3250,
+//    "raw_rms": 0.912, "filtered_rms": 0.061, "raw_spikes": 21,
+//    "filtered_spikes": 0}
+//
+// t90 is how long after the step the signal first got 90% of the way
+// there, settled is how long until it stayed within STEP_SETTLED of the
+// new temp.  rms is the noise against the scripted temp over the steady
+// STEP_WINDOW before the step and at the end, spikes are readings in those
+// windows more than STEP_SPIKE off.  Returns 1 if a filtered signal never
+// settled or came out noisier than the raw one
+//
+
+#define STEP_AT 20       // minute the step comes at, long enough for scanning to back off
+#define STEP_AFTER 20    // minutes played after it
+#define STEP_WINDOW 10   // minutes at each end the noise is measured over
+#define STEP_SETTLED 1.0 // F from the new temp a signal has to stay within
+#define STEP_SPIKE 5.0   // F off the scripted temp that counts as a spike
+
+struct stepSignal {
+  long t90 = -1;      // ms after the step, -1 = never
+  long settled = -1;
+  double squares = 0; // error squared over the steady windows
+  unsigned long samples = 0;
+  unsigned long spikes = 0;
+};
+
+// One reading of a signal at ms, truth is the scripted temp then
+static void sampleSignal(struct stepSignal *signal, long ms, double temp, double truth, double from, double to) {
+  long stepMs = STEP_AT * 60000L;
+  long endMs = (STEP_AT + STEP_AFTER) * 60000L;
+  bool steady = (ms < stepMs && ms >= stepMs - STEP_WINDOW * 60000L) || ms >= endMs - STEP_WINDOW * 60000L;
+  if(steady && !isnan(temp)) {
+    double error = temp - truth;
+    signal->squares += error * error;
+    signal->samples++;
+    signal->spikes += fabs(error) > STEP_SPIKE;
+  }
+  if(ms < stepMs) {
+    return;
+  }
+  if(signal->t90 < 0 && (temp - from) / (to - from) >= 0.9) {
+    signal->t90 = ms - stepMs;
+  }
+  // the first reading after the last one that wasn't settled
+  if(isnan(temp) || fabs(temp - to) > STEP_SETTLED) {
+    signal->settled = -1;
+  } else if(signal->settled < 0) {
+    signal->settled = ms - stepMs;
+  }
+}
+
+static double signalRms(const struct stepSignal *signal) {
+  return signal->samples > 0 ? sqrt(signal->squares / signal->samples) : nan("");
+}
+
+// One conversion of a probe straight off the ADC, as a temp
+static double rawTemp(int probe) {
+  int channels[ADS_CHIPS];
+  int chip = probe / ADS_CHANNELS;
+  for (int i = 0; i < ADS_CHIPS; i++) {
+    channels[i] = i == chip ? probe % ADS_CHANNELS : -1;
+  }
+  halAdcStart(channels);
+  if(!halAdcWait(chip)) {
+    return nan("");
+  }
+  return codeToTempF(probe, halAdcValue(chip));
+}
+
+int runStep(double from, double to) {
+  // flat, the step, flat again
+  std::string script;
+  const int minutes[] = {0, STEP_AT, STEP_AT, STEP_AT + STEP_AFTER};
+  for (int line = 0; line < 4; line++) {
+    double temp = line < 2 ? from : to;
+    script += std::to_string(minutes[line]);
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      script += " " + std::to_string(temp);
+    }
+    script += "\n";
+  }
+  if(!simUseScript(script.c_str())) {
+    Serial.println("!!! Couldn't build the step script");
+    return 1;
+  }
+  simRestartScript();
+
+  struct stepSignal raw[NUM_PROBES];
+  struct stepSignal filtered[NUM_PROBES];
+  unsigned long simMillis = 0;
+  long stepMs = STEP_AT * 60000L;
+  for (long ms = 0; ms < (STEP_AT + STEP_AFTER) * 60000L;) {
+    // the script only moves on whole sim seconds
+    double truth = ms / 1000 * 1000 < stepMs ? from : to;
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      sampleSignal(&raw[probe], ms, rawTemp(probe), truth, from, to);
+    }
+    acquireTemps();
+    struct temperatureUpdate last;
+    readLastTemps(&last);
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      sampleSignal(&filtered[probe], ms, last.connected[probe] ? last.temperatures[probe] : nan(""), truth, from, to);
+    }
+
+    int interval = nextScanInterval();
+    ms += interval;
+    simMillis += interval;
+    simAdvance(simMillis / 1000);
+    simMillis %= 1000;
+  }
+
+  bool ok = true;
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    bool probeOk = filtered[probe].settled >= 0 && signalRms(&filtered[probe]) < signalRms(&raw[probe]);
+    printf("{\"step\": %d, \"from\": %.1f, \"to\": %.1f, \"raw_t90_ms\": %ld, \"filtered_t90_ms\": %ld, "
+      "\"filtered_settled_ms\": %ld, \"raw_rms\": %.3f, \"filtered_rms\": %.3f, \"raw_spikes\": %lu, \"filtered_spikes\": %lu}%s\n",
+      probe, from, to, raw[probe].t90, filtered[probe].t90, filtered[probe].settled, signalRms(&raw[probe]),
+      signalRms(&filtered[probe]), raw[probe].spikes, filtered[probe].spikes, probeOk ? "" : " FAILED");
+    ok = ok && probeOk;
+  }
+  return ok ? 0 : 1;
+}
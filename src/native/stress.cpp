@@ -0,0 +1,386 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../probeinator.h"
+#include "simRig.h"
+
+//
+// Stress test for the lock free reads.  One thread plays the processing
+// task, calling storeData and saveLastTemps back to back, while reader
+// threads pull every reply the web server serves.  Build it with
+// -fsanitize=thread (pio run -e native_tsan) and ThreadSanitizer checks
+// the memory ordering too.  One JSON line at the end:
+//
+//   {"stress": 5.0, "writes": 812345, "last_temps_reads": 40211,
+//    "history_replies": 3120, "range_replies": 210, "log_segments": 9,
+//    "history_rows": 9123456, "history_nulls": 12, "bad": 0}
+//
+// Every probe gets the same temp and it only changes every STRESS_STEP
+// seconds, a multiple of every tier's resolution, so a torn read shows:
+// the probes in a /getLastTemps reply disagree or a history row isn't the
+// temp for its own time.  Rows that rotated out mid-read come back null
+// and only count as history_nulls.  The archive runs without a deadband
+// so its rows come back exact too.
+//
+// Range replies (/getTemps?from=&to=) read the flash log.  So the log
+// rolls over to new segments and drops old ones while they're in it, a
+// filler thread logs records for a made up tier nothing reads on top of
+// the writer's.  log_segments is how many segments were started during
+// the run, it has to be more than 0.
+//
+// After the threads stop the same reads are run once more with a write
+// forced into the gap between each reader's copy and its check (see
+// SNAPSHOT_CHECKPOINT), so the retry and the dropped row are seen every
+// run rather than only when the scheduler happens to line them up:
+//
+//   "forced_last_temps": 1, "forced_ring": 1, "forced_archive": 1
+//
+// Returns 1 if anything was bad
+//
+
+#define STRESS_STEP 240  // seconds the made up temp holds for, the coarse tier's resolution
+#define STRESS_TICK 5    // seconds between writes, every write closes a fine bucket
+#define STRESS_CHUNK 1436 // what AsyncWebServer asks fillHistory for at a time
+#define STRESS_POINTS 300 // rows per probe for the downsampled replies
+#define STRESS_FILL_RESOLUTION 1 // seconds per bucket of the tier the log filler logs, no reply reads it
+#define STRESS_FILL_US 50 // us between the log filler's records, fast enough to start a segment every second or so
+
+static std::atomic<bool> stressDone(false);
+static std::atomic<unsigned long> lastTempsReads(0);
+static std::atomic<unsigned long> historyReplies(0);
+static std::atomic<unsigned long> rangeReplies(0);
+static std::atomic<unsigned long> historyRows(0);
+static std::atomic<unsigned long> historyNulls(0);
+static std::atomic<unsigned long> badReads(0);
+static unsigned long writerTime;  // UTC second the writer would have written next
+static unsigned long stressStart; // UTC second of the first write
+
+// The write snapshotCheckpoint lands in the middle of a read, run once at
+// the first checkpoint of kind forcedCheck
+static std::atomic<int> forcedCheck(-1);
+static std::atomic<int> forcedHits(0);
+static std::atomic<void (*)()> forcedWrite(nullptr);
+
+void snapshotCheckpoint(int check) {
+  if(check != forcedCheck.load(std::memory_order_relaxed)) {
+    return;
+  }
+  forcedHits++;
+  void (*write)() = forcedWrite.exchange(nullptr);
+  if(write != nullptr) {
+    write();
+  }
+}
+
+// The temp every probe reads at UTC second t, whole tenths so buckets
+// hold it exactly
+static double stressTemp(unsigned long t) {
+  return 50 + (t / STRESS_STEP) % 1000 / 10.0;
+}
+
+// A row is good if its temp is the one for its time under either of the
+// UTC offsets the replies can have used
+static bool rowMatches(long local, double temp) {
+  for (int offset : {mySTD.offset, myDST.offset}) {
+    long utc = local - offset * 60;
+    if(fabs(stressTemp(utc) - temp) < 0.001) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void badRead(const char *what, long local, double temp) {
+  if(badReads.fetch_add(1) < 10) {
+    printf("!!! %s: %ld = %.2f, expected %.2f\n", what, local, temp, stressTemp(local - mySTD.offset * 60));
+  }
+}
+
+// Processing task stand in, as fast as it'll go
+static void stressWriter(unsigned long *writes) {
+  struct temperatureUpdate update;
+  unsigned long t = halEpochTime();
+  while(!stressDone.load(std::memory_order_relaxed)) {
+    update.updateTime = t;
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      update.temperatures[probe] = stressTemp(t);
+      update.connected[probe] = true;
+    }
+    storeData(update);
+    saveLastTemps(update);
+    (*writes)++;
+    t += STRESS_TICK;
+  }
+  writerTime = t;
+}
+
+// The next write stressWriter would have done, jumped on by skip seconds
+static void forcedUpdate(unsigned long skip) {
+  struct temperatureUpdate update;
+  writerTime += skip;
+  update.updateTime = writerTime;
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    update.temperatures[probe] = stressTemp(writerTime);
+    update.connected[probe] = true;
+  }
+  storeData(update);
+  saveLastTemps(update);
+  writerTime += STRESS_TICK;
+}
+
+// Every probe in a /getLastTemps reply has to have the same temp
+static void lastTempsReader() {
+  while(!stressDone.load(std::memory_order_relaxed)) {
+    String reply = getLastTempsJson();
+    const char *pos = reply.c_str();
+    double first = NAN;
+    while((pos = strstr(pos, "\"last_temp\": ")) != NULL) {
+      pos += 13;
+      if(strncmp(pos, "null", 4) == 0) {
+        continue;
+      }
+      double temp = atof(pos);
+      if(isnan(first)) {
+        first = temp;
+      } else if(temp != first) {
+        badRead("lastTemps", 0, temp);
+      }
+    }
+    lastTempsReads++;
+  }
+}
+
+// Check the [time, temp] rows of a JSON history reply
+static void checkJsonRows(const String &reply) {
+  const char *pos = reply.c_str();
+  while((pos = strstr(pos, "[")) != NULL) {
+    pos++;
+    if(!isdigit(*pos)) {
+      continue;
+    }
+    long long ms = atoll(pos);
+    const char *value = strchr(pos, ',') + 1;
+    historyRows++;
+    if(strncmp(value, "null", 4) == 0) {
+      historyNulls++;
+    } else if(!rowMatches(ms / 1000, atof(value))) {
+      badRead("history row", ms / 1000, atof(value));
+    }
+  }
+}
+
+static uint32_t getU32(const uint8_t *in) {
+  return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+// Check the samples of a /getTemps.bin reply, see nextDataBinPiece
+static void checkBinRows(const std::vector<uint8_t> &reply) {
+  const uint8_t *in = reply.data();
+  unsigned long base = getU32(in + 12);
+  int interval = in[16] | in[17] << 8;
+  int count = in[18] | in[19] << 8;
+  int spans = in[20];
+  const uint8_t *offsets = in + 21;
+  size_t pos = 21 + spans * 4;
+  for (int probe = 0; probe < in[11] && pos < reply.size(); probe++) {
+    pos += 2 + NAME_LENGTH;
+    long centi = 0;
+    int span = 0;
+    for (int row = 0; row < count; row++) {
+      while(span + 1 < spans && row >= (offsets[(span + 1) * 4] | offsets[(span + 1) * 4 + 1] << 8)) {
+        span++;
+      }
+      long local = base + row * interval + (int16_t)(offsets[span * 4 + 2] | offsets[span * 4 + 3] << 8) * 60;
+      int16_t sample = in[pos] | in[pos + 1] << 8;
+      pos += 2;
+      historyRows++;
+      if(sample == BIN_NAN_SAMPLE) {
+        historyNulls++;
+        continue;
+      }
+      if(sample == BIN_ABS_SAMPLE) {
+        centi = (int32_t)getU32(in + pos);
+        pos += 4;
+      } else {
+        centi += sample;
+      }
+      if(!rowMatches(local, centi / 100.0)) {
+        badRead("bin row", local, centi / 100.0);
+      }
+    }
+  }
+}
+
+// Whole replies from every tier in every format, the way the web server
+// streams them
+static void historyReader(int reader) {
+  uint8_t buffer[STRESS_CHUNK];
+  for (unsigned long pass = reader; !stressDone.load(std::memory_order_relaxed); pass++) {
+    struct historyCursor cursor;
+    cursor.tier = pass % HISTORY_TIERS;
+    cursor.binary = pass / HISTORY_TIERS % 3 == 1;
+    cursor.points = pass / HISTORY_TIERS % 3 == 2 ? STRESS_POINTS : 0;
+    String json;
+    std::vector<uint8_t> bin;
+    size_t count;
+    while((count = fillHistory(&cursor, buffer, sizeof(buffer))) > 0) {
+      if(cursor.binary) {
+        bin.insert(bin.end(), buffer, buffer + count);
+      } else {
+        json.concat((char *)buffer, count);
+      }
+    }
+    if(cursor.binary) {
+      checkBinRows(bin);
+    } else {
+      checkJsonRows(json);
+    }
+    historyReplies++;
+  }
+}
+
+// /getTemps?from=&to= from the first write on, out of the flash log
+static void rangeReader() {
+  uint8_t buffer[STRESS_CHUNK];
+  while(!stressDone.load(std::memory_order_relaxed)) {
+    struct historyCursor cursor;
+    String json;
+    size_t count;
+    setHistoryRange(&cursor, myTZ.toLocal(stressStart), 0);
+    while((count = fillHistory(&cursor, buffer, sizeof(buffer))) > 0) {
+      json.concat((char *)buffer, count);
+    }
+    checkJsonRows(json);
+    rangeReplies++;
+  }
+}
+
+// Pads the flash log so writePage keeps starting segments and deleting
+// the oldest under the range readers
+static void logFiller() {
+  historyBucket buckets[NUM_PROBES] = {};
+  for (unsigned long bucket = 0; !stressDone.load(std::memory_order_relaxed); bucket++) {
+    historyLogAppend(bucket, STRESS_FILL_RESOLUTION, buckets);
+    std::this_thread::sleep_for(std::chrono::microseconds(STRESS_FILL_US));
+  }
+}
+
+// seq of the newest history log segment on the FS
+static unsigned long newestSegment() {
+  unsigned long newest = 0;
+  File root = SPIFFS.open("/");
+  for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+    String name = file.name();
+    name = name.substring(name.lastIndexOf('/') + 1);
+    if(name.startsWith("hlog")) {
+      newest = max(newest, (unsigned long)name.substring(4).toInt());
+    }
+  }
+  return newest;
+}
+
+// Whole JSON reply from one tier, and whether its first row is null
+static bool firstRowNull(int tier) {
+  struct historyCursor cursor;
+  uint8_t buffer[STRESS_CHUNK];
+  String json;
+  size_t count;
+  cursor.tier = tier;
+  while((count = fillHistory(&cursor, buffer, sizeof(buffer))) > 0) {
+    json.concat((char *)buffer, count);
+  }
+  const char *pos = json.c_str();
+  while((pos = strstr(pos, "[")) != NULL && !isdigit(*++pos)) {}
+  return pos == NULL || strncmp(strchr(pos, ',') + 1, "null", 4) == 0;
+}
+
+// Run a read with write landing at its checkpoint.  Returns how many times
+// the reader got to the checkpoint
+template <typename Read>
+static int forceRead(int check, void (*write)(), Read read) {
+  forcedHits = 0;
+  forcedWrite = write;
+  forcedCheck = check;
+  read();
+  forcedCheck = -1;
+  return forcedHits;
+}
+
+// saveLastTemps mid copy, the reader has to go round again and come back
+// with the new temps
+static bool forceLastTemps() {
+  struct temperatureUpdate last;
+  int hits = forceRead(SNAPSHOT_CHECK_LAST_TEMPS, [] { forcedUpdate(STRESS_STEP); }, [&] { readLastTemps(&last); });
+  return hits == 2 && (unsigned long)last.updateTime == writerTime - STRESS_TICK &&
+    last.temperatures[0] == (float)stressTemp(last.updateTime);
+}
+
+// One more fine bucket mid copy rotates the oldest out from under the
+// reader, that row has to come back null
+static bool forceRing() {
+  if(firstRowNull(0)) {
+    return false;
+  }
+  bool dropped;
+  forceRead(SNAPSHOT_CHECK_RING, [] { forcedUpdate(0); }, [&] { dropped = firstRowNull(0); });
+  return dropped;
+}
+
+// A jump too far for the archive mid decode clears it once the bucket
+// after the jump closes, the row has to come back null rather than decoded
+// from cleared blocks
+static bool forceArchive() {
+  if(firstRowNull(HISTORY_TIERS - 1)) {
+    return false;
+  }
+  bool dropped;
+  forceRead(SNAPSHOT_CHECK_ARCHIVE, [] {
+      forcedUpdate((ARCHIVE_MAX_GAP + 1) * STRESS_STEP);
+      forcedUpdate(STRESS_STEP);
+    }, [&] { dropped = firstRowNull(HISTORY_TIERS - 1); });
+  return dropped;
+}
+
+int runStress(double seconds) {
+  unsigned long writes = 0;
+  std::vector<std::thread> threads;
+
+  archiveSetDeadband(0);
+  unsigned long firstSegment = newestSegment();
+  stressStart = halEpochTime();
+  threads.emplace_back(stressWriter, &writes);
+  threads.emplace_back(logFiller);
+  threads.emplace_back(rangeReader);
+  threads.emplace_back(rangeReader);
+  threads.emplace_back(lastTempsReader);
+  threads.emplace_back(lastTempsReader);
+  for (int reader = 0; reader < 3; reader++) {
+    threads.emplace_back(historyReader, reader);
+  }
+  threads.emplace_back([] {
+    while(!stressDone.load(std::memory_order_relaxed)) {
+      getMetricsText();
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds((long)(seconds * 1000)));
+  stressDone = true;
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  unsigned long segments = newestSegment() - firstSegment;
+
+  bool lastTemps = forceLastTemps();
+  bool ring = forceRing();
+  bool archive = forceArchive();
+
+  bool ok = badReads == 0 && writes > 0 && lastTempsReads > 0 && historyReplies > 0 && rangeReplies > 0 &&
+    segments > 0 && lastTemps && ring && archive;
+  printf("{\"stress\": %.1f, \"writes\": %lu, \"last_temps_reads\": %lu, "
+    "\"history_replies\": %lu, \"range_replies\": %lu, \"log_segments\": %lu, \"history_rows\": %lu, "
+    "\"history_nulls\": %lu, \"bad\": %lu, \"forced_last_temps\": %d, \"forced_ring\": %d, \"forced_archive\": %d}%s\n",
+    seconds, writes, lastTempsReads.load(), historyReplies.load(), rangeReplies.load(), segments, historyRows.load(),
+    historyNulls.load(), badReads.load(), lastTemps, ring, archive, ok ? "" : " FAILED");
+  return ok ? 0 : 1;
+}
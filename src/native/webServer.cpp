@@ -0,0 +1,334 @@
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <WiFi.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//
+// Host side of ESPAsyncWebServer.h: HTTP/1.1 with keep-alive on a plain
+// socket.  One thread polls every connection and answers requests in the
+// order they come in, bodies are pulled from the reply WEB_CHUNK_SIZE at
+// a time the way the library does
+//
+
+#define WEB_CHUNK_SIZE 1436  // what AsyncWebServer asks a filler for, a TCP segment
+#define WEB_MAX_REQUEST 8192 // a connection sending more than this without a whole request is dropped
+
+WiFiClass WiFi;
+uint16_t AsyncWebServer::hostPort = 0;
+std::atomic<size_t> AsyncEventSource::clients(0);
+std::atomic<unsigned long> AsyncEventSource::lastTempsMessages(0);
+std::atomic<unsigned long> AsyncEventSource::historyMessages(0);
+
+//
+// Requests and responses
+//
+
+AsyncWebHeader *AsyncWebServerRequest::getHeader(const String &name) const {
+  for (const AsyncWebHeader &header : headers) {
+    if(strcasecmp(header.name().c_str(), name.c_str()) == 0) {
+      return (AsyncWebHeader *)&header;
+    }
+  }
+  return NULL;
+}
+
+AsyncWebParameter *AsyncWebServerRequest::findParam(const String &name, bool post) const {
+  for (const AsyncWebParameter &param : allParams) {
+    if(param.isPost() == post && param.name() == name) {
+      return (AsyncWebParameter *)&param;
+    }
+  }
+  return NULL;
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse(int code, const String &contentType, const String &content) {
+  AsyncWebServerResponse *response = new AsyncWebServerResponse(code, contentType);
+  response->length = content.length();
+  response->fill = [content](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    size_t count = min(maxLen, (size_t)content.length() - min(index, (size_t)content.length()));
+    memcpy(buffer, content.c_str() + index, count);
+    return count;
+  };
+  return response;
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse(fs::FS &fs, const String &path, const String &contentType) {
+  File file = fs.open(path, FILE_READ);
+  if(!file) {
+    return beginResponse(404, "text/plain", "Not found");
+  }
+  AsyncWebServerResponse *response = new AsyncWebServerResponse(200, contentType);
+  response->length = file.size();
+  response->fill = [file](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+    return file.read(buffer, maxLen);
+  };
+  return response;
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginChunkedResponse(const String &contentType, AwsResponseFiller filler) {
+  AsyncWebServerResponse *response = new AsyncWebServerResponse(200, contentType);
+  response->fill = filler;
+  return response;
+}
+
+void AsyncWebServerRequest::send(AsyncWebServerResponse *response) {
+  delete this->response;
+  this->response = response;
+}
+
+//
+// HTTP
+//
+
+struct webConnection {
+  int fd;
+  std::string in; // received and not parsed yet
+};
+
+static bool sendAll(int fd, const char *data, size_t len) {
+  while(len > 0) {
+    ssize_t sent = ::send(fd, data, len, MSG_NOSIGNAL);
+    if(sent <= 0) {
+      return false;
+    }
+    data += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+static String urlDecode(const std::string &text) {
+  std::string out;
+  for (size_t i = 0; i < text.size(); i++) {
+    if(text[i] == '+') {
+      out += ' ';
+    } else if(text[i] == '%' && i + 2 < text.size()) {
+      out += (char)strtol(text.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    } else {
+      out += text[i];
+    }
+  }
+  return out;
+}
+
+// a=1&b=2 into params, form for ones from a POST body
+static void parseParams(const std::string &text, bool form, std::vector<AsyncWebParameter> &params) {
+  size_t pos = 0;
+  while(pos < text.size()) {
+    size_t end = text.find('&', pos);
+    if(end == std::string::npos) {
+      end = text.size();
+    }
+    std::string pair = text.substr(pos, end - pos);
+    size_t equals = pair.find('=');
+    if(!pair.empty()) {
+      params.emplace_back(urlDecode(pair.substr(0, equals)), equals == std::string::npos ? "" : urlDecode(pair.substr(equals + 1)), form);
+    }
+    pos = end + 1;
+  }
+}
+
+// Take one request off the front of in.  Returns false if it isn't all
+// there yet
+static bool parseRequest(std::string &in, AsyncWebServerRequest *request, bool *keepAlive) {
+  size_t headerEnd = in.find("\r\n\r\n");
+  if(headerEnd == std::string::npos) {
+    return false;
+  }
+  size_t lineEnd = in.find("\r\n");
+  std::string line = in.substr(0, lineEnd);
+  size_t space = line.find(' ');
+  size_t secondSpace = line.find(' ', space + 1);
+  std::string method = line.substr(0, space);
+  std::string target = line.substr(space + 1, secondSpace - space - 1);
+  *keepAlive = line.compare(secondSpace + 1, std::string::npos, "HTTP/1.1") == 0;
+
+  size_t contentLength = 0;
+  bool formBody = false;
+  size_t pos = lineEnd + 2;
+  while(pos < headerEnd) {
+    size_t end = in.find("\r\n", pos);
+    std::string header = in.substr(pos, end - pos);
+    size_t colon = header.find(':');
+    if(colon != std::string::npos) {
+      String name = header.substr(0, colon);
+      String value = header.substr(header.find_first_not_of(' ', colon + 1) == std::string::npos ? header.size() : header.find_first_not_of(' ', colon + 1));
+      if(strcasecmp(name.c_str(), "Content-Length") == 0) {
+        contentLength = value.toInt();
+      } else if(strcasecmp(name.c_str(), "Content-Type") == 0) {
+        formBody = value.startsWith("application/x-www-form-urlencoded");
+      } else if(strcasecmp(name.c_str(), "Connection") == 0) {
+        *keepAlive = strcasecmp(value.c_str(), "close") != 0;
+      }
+      request->headers.emplace_back(name, value);
+    }
+    pos = end + 2;
+  }
+  if(in.size() < headerEnd + 4 + contentLength) {
+    request->headers.clear();
+    return false;
+  }
+
+  request->requestMethod = method == "POST" ? HTTP_POST : HTTP_GET;
+  size_t query = target.find('?');
+  request->path = urlDecode(target.substr(0, query));
+  if(query != std::string::npos) {
+    parseParams(target.substr(query + 1), false, request->allParams);
+  }
+  if(formBody) {
+    parseParams(in.substr(headerEnd + 4, contentLength), true, request->allParams);
+  }
+  in.erase(0, headerEnd + 4 + contentLength);
+  return true;
+}
+
+static const char *statusText(int code) {
+  switch(code) {
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 404: return "Not Found";
+    default: return "Error";
+  }
+}
+
+static bool writeResponse(int fd, AsyncWebServerResponse *response, bool keepAlive) {
+  std::string head = "HTTP/1.1 " + std::to_string(response->code) + " " + statusText(response->code) + "\r\n";
+  if(response->contentType.length() > 0) {
+    head += "Content-Type: " + std::string(response->contentType.c_str()) + "\r\n";
+  }
+  for (const AsyncWebHeader &header : response->headers) {
+    head += std::string(header.name().c_str()) + ": " + header.value().c_str() + "\r\n";
+  }
+  bool chunked = response->length < 0;
+  if(response->code == 304) {
+    response->length = 0;
+    chunked = false;
+  } else if(chunked) {
+    head += "Transfer-Encoding: chunked\r\n";
+  } else {
+    head += "Content-Length: " + std::to_string(response->length) + "\r\n";
+  }
+  head += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  if(!sendAll(fd, head.data(), head.size())) {
+    return false;
+  }
+
+  uint8_t buffer[WEB_CHUNK_SIZE];
+  char size[16];
+  size_t index = 0;
+  while(chunked || index < (size_t)response->length) {
+    size_t count = response->fill(buffer, sizeof(buffer), index);
+    if(count == 0) {
+      break;
+    }
+    index += count;
+    if(chunked) {
+      int len = snprintf(size, sizeof(size), "%zx\r\n", count);
+      if(!sendAll(fd, size, len) || !sendAll(fd, (char *)buffer, count) || !sendAll(fd, "\r\n", 2)) {
+        return false;
+      }
+    } else if(!sendAll(fd, (char *)buffer, count)) {
+      return false;
+    }
+  }
+  return !chunked || sendAll(fd, "0\r\n\r\n", 5);
+}
+
+ArRequestHandlerFunction AsyncWebServer::findHandler(AsyncWebServerRequest *request) {
+  std::lock_guard<std::mutex> guard(routesLock);
+  for (route &route : routes) {
+    if(route.uri == request->url() && (route.method & request->method()) != 0) {
+      return route.handler;
+    }
+  }
+  return ArRequestHandlerFunction();
+}
+
+// Answer a request, false if the connection should be closed
+static bool answer(int fd, AsyncWebServer *server, AsyncWebServerRequest *request, bool keepAlive) {
+  ArRequestHandlerFunction handler = server->findHandler(request);
+  if(handler) {
+    handler(request);
+  }
+  if(request->response == NULL) {
+    request->send(404, "text/plain", "Not found");
+  }
+  bool ok = writeResponse(fd, request->response, keepAlive);
+  delete request->response;
+  return ok && keepAlive;
+}
+
+static void serve(int listener, AsyncWebServer *server) {
+  std::vector<webConnection> connections;
+  char buffer[2048];
+  for (;;) {
+    std::vector<pollfd> fds;
+    fds.push_back({listener, POLLIN, 0});
+    for (webConnection &connection : connections) {
+      fds.push_back({connection.fd, POLLIN, 0});
+    }
+    if(poll(fds.data(), fds.size(), -1) < 0) {
+      continue;
+    }
+
+    for (size_t i = connections.size(); i-- > 0;) {
+      if(fds[i + 1].revents == 0) {
+        continue;
+      }
+      webConnection &connection = connections[i];
+      ssize_t count = recv(connection.fd, buffer, sizeof(buffer), 0);
+      bool open = count > 0;
+      if(open) {
+        connection.in.append(buffer, count);
+      }
+      bool keepAlive;
+      for (;;) {
+        AsyncWebServerRequest request;
+        if(!open || !parseRequest(connection.in, &request, &keepAlive)) {
+          break;
+        }
+        open = answer(connection.fd, server, &request, keepAlive);
+      }
+      if(!open || connection.in.size() > WEB_MAX_REQUEST) {
+        close(connection.fd);
+        connections.erase(connections.begin() + i);
+      }
+    }
+
+    if(fds[0].revents != 0) {
+      int fd = accept(listener, NULL, NULL);
+      if(fd >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        connections.push_back({fd, ""});
+      }
+    }
+  }
+}
+
+void AsyncWebServer::begin() {
+  uint16_t listenPort = hostPort != 0 ? hostPort : port;
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(listenPort);
+  if(listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+    Serial.println("!!! Couldn't listen on port " + String((int)listenPort));
+    return;
+  }
+  Serial.println("Listening on port " + String((int)listenPort));
+  std::thread(serve, listener, this).detach();
+}
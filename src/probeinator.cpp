@@ -1,26 +1,348 @@
+#include <atomic>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <Timezone.h>
-#include <Preferences.h>
 #include "probeinator.h"
 
 
-Preferences preferences;
+// Every probe starts out connected with its default name, ids are the
+// probe numbers
+static struct pinDetails defaultPinConfig() {
+  struct pinDetails config;
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    config.probeIds[probe] = probe;
+    snprintf(config.probeNames[probe], NAME_LENGTH, "probe_%d", probe);
+  }
+  return config;
+}
+
+struct pinDetails pinConfig = defaultPinConfig();
+
+// Latest temps, a seqlock.  Only saveLastTemps (the processing task) writes
+// them, the sequence is odd while it's part way through.  Readers copy them
+// out with readLastTemps and try again if the sequence moved, so a reader
+// never holds up the writer.  0 = nothing saved yet
+static std::atomic<uint32_t> lastTempsSeq(0);
+static std::atomic<float> lastTemps[NUM_PROBES];
+static std::atomic<bool> lastConnected[NUM_PROBES];
+static std::atomic<long> lastUpdateTime(0);
+
+
+//
+// Reading filters
+//
+
+static probeFilter probeFilters[NUM_PROBES];
+
+SemaphoreHandle_t thermistorReadMutex = xSemaphoreCreateMutex();
+
+// Change the filter settings for a probe, this restarts the filter
+void setProbeFilter(int probe, struct probeFilterConfig config) {
+  config.medianWindow = constrain(config.medianWindow, 1, FILTER_MAX_MEDIAN);
+  config.alpha = constrain(config.alpha, 0.01, 1.0);
+  probeFilters[probe].config = config;
+  probeFilters[probe].filled = 0;
+  probeFilters[probe].next = 0;
+  probeFilters[probe].value = nan("");
+}
+
+// Start every probe with the default filter
+void initProbeFilters() {
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    setProbeFilter(probe, {FILTER_MEDIAN_WINDOW, FILTER_ALPHA});
+  }
+}
+
+// Push one conversion through a probe's filter and return the filtered
+// code.  Constant work per conversion.  A conversion that can't be a probe
+// resets the filter so unplugging shows up right away, and plugging back in
+// doesn't ramp up from the old value
+static double filterReading(int probe, double code) {
+  probeFilter *filter = &probeFilters[probe];
+
+  if(isnan(codeToTempF(probe, code))) {
+    filter->filled = 0;
+    filter->next = 0;
+    filter->value = nan("");
+    return code;
+  }
+
+  filter->window[filter->next] = code;
+  filter->next = (filter->next + 1) % filter->config.medianWindow;
+  if(filter->filled < filter->config.medianWindow) {
+    filter->filled++;
+  }
+
+  // median of the window, insertion sort is plenty for a handful of values
+  double sorted[FILTER_MAX_MEDIAN];
+  for (int i = 0; i < filter->filled; i++) {
+    int j = i;
+    for (; j > 0 && sorted[j - 1] > filter->window[i]; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = filter->window[i];
+  }
+  double median = sorted[filter->filled / 2];
+
+  if(isnan(filter->value)) {
+    filter->value = median;
+  } else {
+    filter->value += filter->config.alpha * (median - filter->value);
+  }
+  return filter->value;
+}
+
+// Reads the raw ADS code from every thermistor voltage divider.  Takes
+// READING_COUNT conversions per probe, round robin across the channels so
+// they're sampled evenly, and runs each one through the probe's filter.
+// Each channel is converted on every chip at once and the task sleeps
+// until they're done instead of delaying, so a full scan takes
+// READING_COUNT * ADS_CHANNELS conversion times (~25ms at 860 SPS) however
+// many chips there are.  Probes without any good conversions get nan
+void scanProbes(double codes[NUM_PROBES]) {
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    codes[probe] = nan("");
+  }
+
+  if(takeMutex(thermistorReadMutex, MUTEX_W_TIMEOUT, METRIC_THERMISTOR_MUTEX)) {
+    for (int reading = 0; reading < READING_COUNT; reading++) {
+      for (int channel = 0; channel < ADS_CHANNELS && channel < NUM_PROBES; channel++) {
+        int channels[ADS_CHIPS];
+        for (int chip = 0; chip < ADS_CHIPS; chip++) {
+          channels[chip] = chip * ADS_CHANNELS + channel < NUM_PROBES ? channel : -1;
+        }
+        unsigned long started = micros();
+        halAdcStart(channels);
+        for (int probe = channel; probe < NUM_PROBES; probe += ADS_CHANNELS) {
+          if(!halAdcWait(probeChip(probe))) {
+            Serial.println("Timed out waiting for ADS conversion");
+            continue;
+          }
+          int16_t code = halAdcValue(probeChip(probe));
+          metricAdcTime(probe, micros() - started);
+          codes[probe] = filterReading(probe, code);
+        }
+      }
+    }
+    xSemaphoreGive(thermistorReadMutex);
+  } else {
+    Serial.println("Failed to get mutex for thermistor read");
+  }
 
-// Reads the voltage from the thermistor voltage divider
-double getThermistorVoltage(int ads_pin) {
-  double reading_sum = 0;
-  for (int i = 0; i < READING_COUNT; i++){
-    if(xSemaphoreTake(thermistorReadMutex, PROBE_READ_DELAY)){
-      reading_sum = reading_sum + ADS.readADC(ads_pin);
+}
+
+
+//
+// Acquisition pipeline
+//
+// The sampler (sampleProbes) only scans the probes and pushes the raw
+// codes into readingRing.  The processing side (processReadings) turns
+// them into temps, fills in the LCD frame and stores them.  On the board
+// they're separate tasks so slow storage or publishing never delays the
+// next scan.  The ring has one writer and one reader so it needs no lock,
+// each side only ever moves its own index.  When it's full the newest
+// reading is dropped and counted
+//
+// The scan rate follows the temps.  Processing averages each probe over
+// SCAN_RATE_WINDOW and compares it with the window before, a probe moving
+// faster than SCAN_FAST_RATE (a lid opening, a stall breaking) drops the
+// sampler to SCAN_FAST_INTERVAL and once every probe is slower than
+// SCAN_SLOW_RATE it backs off to SCAN_SLOW_INTERVAL.  Leaving either takes
+// a rate twice past its threshold, so a probe sitting near one doesn't
+// flip the sampler back and forth every window.  Windows are timed by
+// the intervals the readings were scheduled at, so the simulated rig sees
+// the same rates the board does
+//
+
+static rawReading readingRing[READING_RING_SIZE];
+static std::atomic<uint32_t> ringHead(0); // readings pushed, only the sampler writes it
+static std::atomic<uint32_t> ringTail(0); // readings taken, only processing writes it
+static std::atomic<int> scanInterval(MAIN_LOOP_INTERVAL); // ms, processing picks it for the sampler
+static unsigned long scheduledInterval = MAIN_LOOP_INTERVAL; // ms before the scan coming up, only the sampler uses it
+
+// The rate window, only processing uses these
+static unsigned long rateElapsed = 0; // ms of readings in the window so far
+static float rateSums[NUM_PROBES];
+static int rateCounts[NUM_PROBES];
+static float rateMeans[NUM_PROBES]; // last window's, nan if the probe had no readings
+static bool rateMeasured = false;   // rateMeans holds a whole window
+
+static bool ringPush(const rawReading *reading) {
+  uint32_t head = ringHead.load(std::memory_order_relaxed);
+  uint32_t depth = head - ringTail.load(std::memory_order_acquire);
+  if(depth >= READING_RING_SIZE) {
+    metricRingDropped();
+    return false;
+  }
+  readingRing[head % READING_RING_SIZE] = *reading;
+  ringHead.store(head + 1, std::memory_order_release);
+  metricRingDepth(depth + 1);
+  return true;
+}
+
+static bool ringPop(rawReading *reading) {
+  uint32_t tail = ringTail.load(std::memory_order_relaxed);
+  if(tail == ringHead.load(std::memory_order_acquire)) {
+    return false;
+  }
+  *reading = readingRing[tail % READING_RING_SIZE];
+  ringTail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+// Scan every probe and queue the raw codes.  Returns false if the ring
+// was full and the reading was dropped
+bool sampleProbes() {
+  static unsigned long lastStarted = 0; // only the sampler scans
+  unsigned long started = micros();
+  struct rawReading reading;
+
+  if(lastStarted != 0) {
+    metricScanInterval(started - lastStarted, scheduledInterval);
+  }
+  lastStarted = started;
+
+  // Set the update time
+  reading.updateTime = halEpochTime();
+  reading.interval = scheduledInterval;
+
+  // get the reading from the sensor on every thermistor's divider
+  scanProbes(reading.codes);
+  reading.sampledAt = micros();
+  metricAcquireTime(reading.sampledAt - started);
+  return ringPush(&reading);
+}
+
+// ms the sampler should wait after a scan before the next one
+int nextScanInterval() {
+  scheduledInterval = scanInterval.load(std::memory_order_relaxed);
+  return scheduledInterval;
+}
+
+// Add a reading to the rate window.  Once the window's full pick the scan
+// interval from the fastest moving probe
+static void updateScanRate(const struct temperatureUpdate *update, unsigned long interval) {
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    if(update->connected[probe]) {
+      rateSums[probe] += update->temperatures[probe];
+      rateCounts[probe]++;
+    }
+  }
+  rateElapsed += interval;
+  if(rateElapsed < SCAN_RATE_WINDOW) {
+    return;
+  }
+
+  float fastest = 0;
+  bool measured = false; // a probe was in both windows
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    float mean = rateCounts[probe] > 0 ? rateSums[probe] / rateCounts[probe] : nanf("");
+    if(rateMeasured && !isnan(mean) && !isnan(rateMeans[probe])) {
+      fastest = max(fastest, fabsf(mean - rateMeans[probe]) * 1000 / rateElapsed);
+      measured = true;
+    }
+    rateMeans[probe] = mean;
+    rateSums[probe] = 0;
+    rateCounts[probe] = 0;
+  }
+  rateElapsed = 0;
+  rateMeasured = true;
+
+  int current = scanInterval.load(std::memory_order_relaxed);
+  float fastRate = current == SCAN_FAST_INTERVAL ? SCAN_FAST_RATE / 2 : SCAN_FAST_RATE;
+  float slowRate = current == SCAN_SLOW_INTERVAL ? SCAN_SLOW_RATE * 2 : SCAN_SLOW_RATE;
+  int next = MAIN_LOOP_INTERVAL;
+  if(fastest > fastRate) {
+    next = SCAN_FAST_INTERVAL;
+  } else if(measured && fastest < slowRate) {
+    next = SCAN_SLOW_INTERVAL;
+  }
+  scanInterval.store(next, std::memory_order_relaxed);
+}
+
+// What a probe shows on the LCD, padded out to LCD_PROBE_COLS.  Built in
+// place, this runs for every probe every poll.  With more probes than rows
+// they share rows and the names get cut short
+static void formatProbeCell(int probe, float temp_f, char cell[LCD_COLS + 1]) {
+  char line[LCD_COLS + 1];
+  const char *name = pinConfig.probeNames[probe];
+
+  if(LCD_PROBE_COLS < LCD_COLS) {
+    // whole degrees and as much of the name as fits, leaving a space
+    // before the next probe
+    char temp[12];
+    if(isnan(temp_f)) {
+      strcpy(temp, "--");
     } else {
-      Serial.println("Failed to get mutex for thermistor read");
+      snprintf(temp, sizeof(temp), "%.0fF", temp_f);
+    }
+    int nameLen = min(LCD_PROBE_COLS - 2 - (int)strlen(temp), NAME_LENGTH);
+    if(nameLen > 0) {
+      snprintf(line, sizeof(line), "%.*s:%s", nameLen, name, temp);
+    } else {
+      snprintf(line, sizeof(line), "%s", temp);
+    }
+  } else if(isnan(temp_f)) {
+    snprintf(line, sizeof(line), "%.*s: --", NAME_LENGTH, name);
+  } else {
+    snprintf(line, sizeof(line), "%.*s: %.2fF", NAME_LENGTH, name, temp_f);
+  }
+  snprintf(cell, LCD_PROBE_COLS + 1, "%-*s", LCD_PROBE_COLS, line);
+}
+
+// Turn one raw reading into temps, put them in the LCD frame and push
+// them into the history and last temps.  Nothing here touches the heap,
+// it runs every scan for the whole cook
+static void processReading(const struct rawReading *reading) {
+  struct temperatureUpdate updateStruct;
+  char cell[LCD_COLS + 1];
+
+  updateStruct.updateTime = reading->updateTime;
+
+  // loop through the probes and ...  
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    // ... look up the temperature for that reading
+    float temp_f = codeToTempF(probe, reading->codes[probe]);
+
+    // If there's no temp the resistance was low (or the read failed), assume there's
+    // no probe and set the connected state
+    if(isnan(temp_f)) {
+      temp_f = nanf("");
+      updateStruct.connected[probe] = false;
+    }
+    else{
+      updateStruct.connected[probe] = true;
     }
     
-    xSemaphoreGive(thermistorReadMutex);
-    vTaskDelay(PROBE_READ_DELAY * portTICK_PERIOD_MS);
+    // set the temp in the update struct and update the LCD
+    updateStruct.temperatures[probe] = temp_f;
+    formatProbeCell(probe, temp_f, cell);
+    displayPrint((probe / LCD_ROWS) * LCD_PROBE_COLS, probe % LCD_ROWS, cell); // the render task sends it
   }
-  return ADS.toVoltage(reading_sum / READING_COUNT);
+  // push the current temperature into the storage FIFO
+  storeData(updateStruct);
+  saveLastTemps(updateStruct);
+  updateScanRate(&updateStruct, reading->interval);
+
+  // the reading is in /getLastTemps from here
+  metricReadingLatency(micros() - reading->sampledAt);
+}
+
+// Process everything the sampler has queued, returns how many readings
+int processReadings() {
+  struct rawReading reading;
+  int processed = 0;
+  while(ringPop(&reading)) {
+    processReading(&reading);
+    processed++;
+  }
+  return processed;
+}
+
+// One pass of the whole pipeline in the calling task
+void acquireTemps() {
+  sampleProbes();
+  processReadings();
 }
 
 
@@ -31,19 +353,35 @@ double getTempK(double BETA, double ROOM_TEMP, double RESISTOR_ROOM_TEMP, double
     (BETA + (ROOM_TEMP * log(resistance / RESISTOR_ROOM_TEMP)));
 }
 
+// Steinhart-Hart version of the above, the beta formula is the special case
+// where c is 0 (see betaCalibration)
+double getTempKSteinhartHart(struct thermistorCalibration calibration, double resistance) {
+  double lnR = log(resistance);
+  return 1.0 / (calibration.a + calibration.b * lnR + calibration.c * lnR * lnR * lnR);
+}
+
+// Steinhart-Hart coefficients equivalent to the beta formula
+thermistorCalibration betaCalibration(double BETA, double ROOM_TEMP, double RESISTOR_ROOM_TEMP) {
+  return {
+    1.0 / ROOM_TEMP - log(RESISTOR_ROOM_TEMP) / BETA,
+    1.0 / BETA,
+    0
+  };
+}
+
 // Figure out the thermistor resistance from the voltage coming out of the divider
 double getResistance(double BALANCE_RESISTOR, double VOLTAGE, double thermistorVoltage) {
   return (thermistorVoltage * BALANCE_RESISTOR) / (VOLTAGE - thermistorVoltage);
 }
 
-// true if a probe is connected
+// true if a probe is connected, probes count as connected until the first reading
 bool isConnected(int probe){
-  return pinConfig.connected[probe];
+  return lastTempsSeq.load(std::memory_order_acquire) == 0 || lastConnected[probe].load(std::memory_order_relaxed);
 }
 
 // Temperature conversion
 double kToC(double temp_k) {
-  return temp_k-273;
+  return temp_k - ZERO_C;
 }
 double cToF(double temp_c){
   return (1.8 * temp_c) + 32;
@@ -52,6 +390,67 @@ double kToF(double temp_k){
   return cToF(kToC(temp_k));
 }
 
+//
+// ADS code -> temperature tables
+//
+// Converting a reading takes a log and a handful of divides, so each probe
+// gets a table of temps (F) every TEMP_TABLE_STEP codes that's rebuilt when
+// its calibration changes.  Readings are interpolated between entries,
+// within ~0.05F of the formula from 32-600F.  Entries at or past the
+// supply voltage are nan.  Codes under MIN_PROBE_RESISTANCE are cut off by
+// code (firstProbeCode) rather than by nan entries, which would take the
+// codes up to a whole step above the cut off with them
+static thermistorCalibration probeCalibrations[NUM_PROBES];
+static float tempTables[NUM_PROBES][TEMP_TABLE_SIZE];
+static int firstProbeCode = 0; // lowest code over MIN_PROBE_RESISTANCE
+
+static void buildTempTable(int probe) {
+  for (int i = 0; i < TEMP_TABLE_SIZE; i++) {
+    double voltage = halAdcVoltage(i * TEMP_TABLE_STEP);
+    double resistance = getResistance(BALANCE_RESISTOR, INPUT_VOLTAGE, voltage);
+
+    if(voltage >= INPUT_VOLTAGE || resistance <= 0) {
+      tempTables[probe][i] = nanf("");
+    } else {
+      tempTables[probe][i] = kToF(getTempKSteinhartHart(probeCalibrations[probe], resistance));
+    }
+  }
+}
+
+// Change the calibration for a probe.  The table is rebuilt in place so a
+// reading taken mid rebuild may land between the old and new calibration
+void setProbeCalibration(int probe, struct thermistorCalibration calibration) {
+  probeCalibrations[probe] = calibration;
+  buildTempTable(probe);
+}
+
+// Build every probe's table from the default thermistor values.  Needs the
+// ADC gain to be set first (halAdcBegin)
+void initTempTables() {
+  firstProbeCode = 0;
+  while(firstProbeCode < TEMP_TABLE_SIZE * TEMP_TABLE_STEP &&
+      getResistance(BALANCE_RESISTOR, INPUT_VOLTAGE, halAdcVoltage(firstProbeCode)) < MIN_PROBE_RESISTANCE) {
+    firstProbeCode++;
+  }
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    setProbeCalibration(probe, betaCalibration(BETA, ROOM_TEMP, RESISTOR_ROOM_TEMP));
+  }
+}
+
+// Look up the temp (F) for an averaged ADS code, nan if there's no probe
+float codeToTempF(int probe, double code) {
+  if(isnan(code) || code < firstProbeCode) {
+    return nanf("");
+  }
+  double position = code / TEMP_TABLE_STEP;
+  int index = (int)position;
+  if(index >= TEMP_TABLE_SIZE - 1) {
+    return nanf("");
+  }
+  float fraction = position - index;
+  return tempTables[probe][index] + (tempTables[probe][index + 1] - tempTables[probe][index]) * fraction;
+}
+
 // Returns a formatted time string in local time
 String getTimeString(time_t epoch_time) {
 
@@ -94,42 +493,262 @@ void printData(int channel_num, double divider_voltage, double temp_k, double re
 // Data handling
 //
 
-// Update temp history.  Only save data every HISTORY_INTERVAL seconds
+//
+// Data storage
+//
+
+// History tiers, finest first.  Each reading is folded into every tier so
+// the recent past is kept at a fine grain and the whole cook at a coarse
+// one.  The coarse tier is compressed into the archive as buckets close,
+// which along with the two rings comes to ~14KB in total.  Closed buckets
+// of the logged tiers also go to the flash log (historyLog.cpp) so they
+// can be rebuilt after a reboot
+static ringBucket fineBuckets[HISTORY_RING_SIZE][NUM_PROBES];
+static ringBucket mediumBuckets[HISTORY_RING_SIZE][NUM_PROBES];
+static ringBucket coarseBuckets[1][NUM_PROBES];
+
+static struct historyTier historyTiers[HISTORY_TIERS] = {
+  {5, HISTORY_RING_SIZE, fineBuckets, false, false},   // 10 minutes at 5 seconds
+  {60, HISTORY_RING_SIZE, mediumBuckets, false, true}, // 2 hours at 1 minute
+  {240, 1, coarseBuckets, true, true}    // as long as the archive holds at 4 minutes
+};
+
+// Convert between temps and tenths of a degree for the history buckets
+static int16_t toBucketTemp(float temp) {
+  return lroundf(temp * 10);
+}
+static float fromBucketTemp(int16_t temp) {
+  if(temp == BUCKET_NAN) {
+    return nanf("");
+  }
+  return temp / 10.0;
+}
+
+// Copy a bucket out of or into a tier's ring
+static historyBucket loadBucket(const ringBucket *slot) {
+  return {slot->min.load(std::memory_order_relaxed), slot->max.load(std::memory_order_relaxed),
+    slot->avg.load(std::memory_order_relaxed)};
+}
+static void storeBucket(ringBucket *slot, const historyBucket &value) {
+  slot->min.store(value.min, std::memory_order_relaxed);
+  slot->max.store(value.max, std::memory_order_relaxed);
+  slot->avg.store(value.avg, std::memory_order_relaxed);
+}
+
+// Copy of the head bucket of a tier for every probe
+static void copyHead(struct historyTier *tier, historyBucket *out) {
+  ringBucket *slots = tier->buckets[tier->head.load(std::memory_order_relaxed) % tier->size];
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    out[probe] = loadBucket(&slots[probe]);
+  }
+}
+
+// Move the head of a tier on to bucket, closing the old head.  Buckets
+// skipped over are left empty.  The new head is published before any slot
+// is reused so readers can tell when a bucket they read was overwritten,
+// see readRingBucket.  Only the task calling storeData can call this
+static void advanceTier(struct historyTier *tier, unsigned long bucket) {
+  unsigned long head = tier->head.load(std::memory_order_relaxed);
+  int count = tier->count.load(std::memory_order_relaxed);
+  if(count > 0 && bucket <= head) {
+    return;
+  }
+  if(tier->archived && count > 0) {
+    historyBucket closed[NUM_PROBES];
+    copyHead(tier, closed);
+    archiveAppend(head, closed);
+  }
+  unsigned long skipped = count == 0 ? 1 : bucket - head;
+  tier->head.store(bucket, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (unsigned long i = 0; i < skipped && i < (unsigned long)tier->size; i++) {
+    for (int probe = 0; probe < NUM_PROBES; probe++) {
+      storeBucket(&tier->buckets[(bucket - i) % tier->size][probe], {BUCKET_NAN, BUCKET_NAN, BUCKET_NAN});
+    }
+  }
+  tier->count.store(min((unsigned long)tier->size, count + skipped), std::memory_order_release);
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    tier->sum[probe] = 0;
+    tier->samples[probe] = 0;
+  }
+}
+
+// Fold a reading into the head bucket of a tier, moving on to a new bucket
+// when the reading falls past it.  Returns true if a bucket was closed.
+// Only the task calling storeData can call this
+static bool foldIntoTier(struct historyTier *tier, struct temperatureUpdate *updateStruct) {
+  unsigned long bucket = updateStruct->updateTime / tier->resolution;
+  unsigned long head = tier->head.load(std::memory_order_relaxed);
+  bool started = tier->count.load(std::memory_order_relaxed) > 0;
+
+  if(started && bucket < head) {
+    return false; // clock went backwards (NTP correction), drop the reading
+  }
+
+  bool closed = started && bucket > head;
+  if(closed && tier->logged) {
+    historyBucket logged[NUM_PROBES];
+    copyHead(tier, logged);
+    historyLogAppend(head, tier->resolution, logged);
+  }
+  advanceTier(tier, bucket);
+
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    float temp = updateStruct->temperatures[probe];
+    if(!updateStruct->connected[probe] || isnan(temp)) {
+      continue;
+    }
+
+    ringBucket *slot = &tier->buckets[bucket % tier->size][probe];
+    historyBucket value = loadBucket(slot);
+    int16_t bucketTemp = toBucketTemp(temp);
+    tier->sum[probe] += temp;
+    tier->samples[probe]++;
+    if(tier->samples[probe] == 1 || bucketTemp < value.min) {
+      value.min = bucketTemp;
+    }
+    if(tier->samples[probe] == 1 || bucketTemp > value.max) {
+      value.max = bucketTemp;
+    }
+    value.avg = toBucketTemp(tier->sum[probe] / tier->samples[probe]);
+    storeBucket(slot, value);
+  }
+  return closed;
+}
+
+//
+// Reply generations
+//
+
+// Bumped whenever what a /getLastTemps or /getTemps reply would hold
+// changes, so the web server can tell if a cached reply (or the copy a
+// client already has) is still current
+static std::atomic<unsigned long> lastTempsGeneration(1);
+static std::atomic<unsigned long> historyGeneration(1);
+
+unsigned long getLastTempsGeneration() {
+  return lastTempsGeneration;
+}
+
+unsigned long getHistoryGeneration() {
+  return historyGeneration;
+}
+
+// Update temp history, every reading is folded into all of the tiers.
+// When the graph's (default) tier closes a bucket the new rows are pushed
+// out to the event stream.  Replies read the tiers without locking so
+// nothing here ever waits on them.  Only the processing task calls this
 void storeData(struct temperatureUpdate updateStruct) {
-  if(lastUpdate + HISTORY_INTERVAL <= updateStruct.updateTime) {
-    if(xSemaphoreTake(historyMutex, MUTEX_W_TIMEOUT / portTICK_PERIOD_MS) == pdTRUE) {
-      for (int i = 0; i < NUM_PROBES; i++){
-        String temperature = "null";
-
-        // if the probe is connected update the temp, otherwise put null
-        if(updateStruct.connected[i]) {
-          temperature = String(updateStruct.temperatures[i]);
-        } else {
-          temperature = "null";
-        }
+  struct historyTier *graphTier = &historyTiers[HISTORY_TIERS - 1];
+  bool started = graphTier->count.load(std::memory_order_relaxed) > 0;
+  unsigned long lastHead = graphTier->head.load(std::memory_order_relaxed);
+  bool changed = false;
+
+  for (int tier = 0; tier < HISTORY_TIERS; tier++){
+    // replies only carry closed buckets, an open one changing doesn't count
+    changed |= foldIntoTier(&historyTiers[tier], &updateStruct);
+  }
+  if(changed) {
+    historyGeneration++;
+  }
 
-        temperatureHistories[i].push(updateStruct.temperatures[i]);
+  if(started && graphTier->head.load(std::memory_order_relaxed) != lastHead) {
+    publishHistory(lastHead);
+  }
+}
+
+// Put a logged bucket back into its tier.  Buckets have to come in order
+static void restoreBucket(struct historyTier *tier, const struct historyLogRecord *record) {
+  if(tier->count.load(std::memory_order_relaxed) > 0 && record->bucket <= tier->head.load(std::memory_order_relaxed)) {
+    return;
+  }
+  advanceTier(tier, record->bucket);
+  for (int probe = 0; probe < NUM_PROBES; probe++) {
+    storeBucket(&tier->buckets[record->bucket % tier->size][probe], record->buckets[probe]);
+  }
+}
+
+// Rebuild the logged tiers (and so the archive) from the flash log after a
+// reboot.  Call before the data task starts.  The fine tier starts empty
+void restoreHistory() {
+  struct historyLogReader reader;
+  unsigned long restored = 0;
+
+  historyLogRewind(&reader, 0);
+  while(historyLogNext(&reader)) {
+    for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+      if(historyTiers[tier].logged && historyTiers[tier].resolution == reader.record.resolution) {
+        restoreBucket(&historyTiers[tier], &reader.record);
+        restored++;
       }
-      temperatureHistoryTimes.push(updateStruct.updateTime);
-      lastUpdate = updateStruct.updateTime;
-      xSemaphoreGive(historyMutex);
-    } else {
-      Serial.println("!!!!!Failed to get write mutex!!!!!");
     }
-  } 
+  }
+  // the last bucket restored was closed, open the one after it
+  for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+    if(historyTiers[tier].count.load(std::memory_order_relaxed) > 0) {
+      advanceTier(&historyTiers[tier], historyTiers[tier].head.load(std::memory_order_relaxed) + 1);
+    }
+  }
+  historyGeneration++;
+  Serial.println("Restored " + String(restored) + " buckets from the history log");
+}
+
+// Pick the finest tier that covers window seconds of history.
+// A window of 0 means everything we have
+int pickHistoryTier(unsigned long window) {
+  if(window == 0) {
+    return HISTORY_TIERS - 1;
+  }
+  for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+    if(historyTiers[tier].archived ||
+        (unsigned long)historyTiers[tier].resolution * historyTiers[tier].size >= window) {
+      return tier;
+    }
+  }
+  return HISTORY_TIERS - 1;
 }
 
-// store the latest temperature in the pin details struct
+// Store the latest temps for /getLastTemps and the event stream.  Never
+// waits, see lastTempsSeq.  Only the processing task calls this
 void saveLastTemps(struct temperatureUpdate updateStruct){
-  if(xSemaphoreTake(probeLastTempMutex, MUTEX_W_TIMEOUT / portTICK_PERIOD_MS) == pdTRUE) {
-    for (int i = 0; i < NUM_PROBES; i++){
-        pinConfig.lastTemps[i] = updateStruct.temperatures[i];
-        pinConfig.connected[i] = updateStruct.connected[i];
+  uint32_t seq = lastTempsSeq.load(std::memory_order_relaxed);
+  bool plugged = false; // a probe was plugged in or pulled out
+  lastTempsSeq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (int i = 0; i < NUM_PROBES; i++){
+    plugged |= (seq == 0 || lastConnected[i].load(std::memory_order_relaxed)) != updateStruct.connected[i];
+    lastTemps[i].store(updateStruct.temperatures[i], std::memory_order_relaxed);
+    lastConnected[i].store(updateStruct.connected[i], std::memory_order_relaxed);
+  }
+  lastUpdateTime.store(updateStruct.updateTime, std::memory_order_relaxed);
+  lastTempsSeq.store(seq + 2, std::memory_order_release);
+  lastTempsGeneration++;
+  // history replies carry the connected flags too
+  if(plugged) {
+    historyGeneration++;
+  }
+  publishLastTemps();
+}
+
+// Consistent copy of the latest temps.  Taken again if saveLastTemps was
+// part way through, which only costs the reader
+void readLastTemps(struct temperatureUpdate *out) {
+  for (;;) {
+    uint32_t seq = lastTempsSeq.load(std::memory_order_acquire);
+    if((seq & 1) == 0) {
+      for (int probe = 0; probe < NUM_PROBES; probe++) {
+        out->temperatures[probe] = seq == 0 ? nanf("") : lastTemps[probe].load(std::memory_order_relaxed);
+        out->connected[probe] = seq == 0 || lastConnected[probe].load(std::memory_order_relaxed);
       }
-  } else {
-  Serial.println("!!! Couldn't get W mutex to save temps");
+      out->updateTime = lastUpdateTime.load(std::memory_order_relaxed);
+      SNAPSHOT_CHECKPOINT(SNAPSHOT_CHECK_LAST_TEMPS);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(lastTempsSeq.load(std::memory_order_relaxed) == seq) {
+        return;
+      }
+    }
+    metricSnapshotRetry(METRIC_SNAPSHOT_LAST_TEMPS);
   }
-  xSemaphoreGive(probeLastTempMutex);
 }
 
 
@@ -137,8 +756,11 @@ void saveLastTemps(struct temperatureUpdate updateStruct){
 // dump the contents of the history array for each probe
 void dumpHistory() {
     Serial.println("History: ");
-    Serial.println(getDataJson());
+    Serial.println(getDataJson(0));
     Serial.println();
+    printArchiveStats();
+    printHistoryLogStats();
+    printCacheStats();
     Serial.println("Free Heap: " + String(ESP.getFreeHeap()));
     Serial.println("min free words: " + String(uxTaskGetStackHighWaterMark( NULL )));
     Serial.println("---"); 
@@ -150,87 +772,507 @@ void dumpHistory() {
 //
 
 
-// Return the logged data as a json array
-String getProbeDataJson(int probe) {
-  String retStr = "[";
-  if(xSemaphoreTake(historyMutex, MUTEX_R_TIMEOUT / portTICK_PERIOD_MS) == pdTRUE) {
-    for (int i = 0; i < temperatureHistories[probe].size(); i++){
-      
-      String tempString = "null";
-       // tempF should be the string null if nan otherwise temp
-      if(isConnected(probe)) {
-        tempString = String(temperatureHistories[probe][i]);
-      }else{
-        tempString = "null";
-      }
+// First bucket still held by a tier.  count is read before head, storeData
+// writes them the other way round, so a tier moving on meanwhile can only
+// make this too new, never a bucket that's gone
+static unsigned long firstBucket(struct historyTier *tier) {
+  if(tier->archived) {
+    return archiveEmpty() ? tier->head.load(std::memory_order_acquire) : archiveFirstBucket();
+  }
+  int count = tier->count.load(std::memory_order_acquire);
+  return tier->head.load(std::memory_order_acquire) + 1 - count;
+}
+
+// Number of closed buckets a tier holds
+static unsigned long closedBuckets(struct historyTier *tier) {
+  if(tier->count.load(std::memory_order_acquire) == 0) {
+    return 0;
+  }
+  unsigned long first = firstBucket(tier);
+  return tier->head.load(std::memory_order_acquire) - first;
+}
+
+// Copy a closed bucket out of a tier's ring.  storeData publishes a new head
+// before it reuses a slot, so if head has come a whole ring past the bucket
+// by the time the copy is done it may be half overwritten and is dropped
+static bool readRingBucket(struct historyTier *tier, unsigned long bucket, int probe, historyBucket *out) {
+  *out = loadBucket(&tier->buckets[bucket % tier->size][probe]);
+  SNAPSHOT_CHECKPOINT(SNAPSHOT_CHECK_RING);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if(bucket + tier->size <= tier->head.load(std::memory_order_relaxed)) {
+    metricSnapshotRetry(METRIC_SNAPSHOT_HISTORY);
+    return false;
+  }
+  return true;
+}
+
+// Value of a bucket for the stat the reply asked for, nan if there were no
+// readings, it isn't closed or it already rotated out.  archive/log are the
+// readers to use for archived and logged buckets
+static float readBucketTemp(struct historyCursor *cursor, struct archiveReader *archive, struct historyLogReader *log,
+    unsigned long bucket, int probe) {
+  struct historyTier *tier = &historyTiers[cursor->tier];
+  historyBucket value;
+
+  if(cursor->fromLog) {
+    if(!historyLogGet(log, tier->resolution, bucket, probe, &value)) {
+      return nanf("");
+    }
+  } else if(tier->count.load(std::memory_order_acquire) == 0 || bucket < firstBucket(tier) ||
+      bucket >= tier->head.load(std::memory_order_acquire)) {
+    return nanf("");
+  } else if(tier->archived) {
+    if(!archiveGet(archive, bucket, probe, &value)) {
+      return nanf("");
+    }
+  } else if(!readRingBucket(tier, bucket, probe, &value)) {
+    return nanf("");
+  }
+
+  switch(cursor->stat) {
+    case STAT_MIN:
+      return fromBucketTemp(value.min);
+    case STAT_MAX:
+      return fromBucketTemp(value.max);
+    default:
+      return fromBucketTemp(value.avg);
+  }
+}
+
+static float getBucketTemp(struct historyCursor *cursor, unsigned long bucket, int probe) {
+  return readBucketTemp(cursor, &cursor->archive, &cursor->log, bucket, probe);
+}
+
+// Work out which buckets a reply covers, only closed buckets are sent.
+// If the client is too far behind (or the device rebooted) everything is
+// sent.  Ranges from the flash log are set up by setHistoryRange instead
+static void startHistoryReply(struct historyCursor *cursor) {
+  if(cursor->fromLog) {
+    return;
+  }
+  struct historyTier *tier = &historyTiers[cursor->tier];
+  bool started = tier->count.load(std::memory_order_acquire) > 0;
+  unsigned long first = started ? firstBucket(tier) : 0;
+  unsigned long end = started ? tier->head.load(std::memory_order_acquire) : 0;
+
+  cursor->full = cursor->points > 0 || cursor->since < first || cursor->since > end;
+  if(cursor->full) {
+    cursor->since = first;
+  }
+  cursor->end = end;
+}
+
+// Buckets the client should expect to hold after a reply
+static unsigned long replySize(struct historyCursor *cursor) {
+  if(cursor->fromLog) {
+    return cursor->end - cursor->since;
+  }
+  return closedBuckets(&historyTiers[cursor->tier]);
+}
 
-      if(i > 0) {
-        retStr += ",";
-      };
-      retStr += "[";
-      retStr += int64String((uint64_t) myTZ.toLocal(temperatureHistoryTimes[i]) * 1000ull);
-      retStr += ",";
-      retStr += tempString;
-      retStr += "]";
+// Point a reply at the local time range [from, to] (seconds) of the finest
+// logged tier, read from the flash log.  A to of 0 means up to now.  Long
+// ranges are cut down to the newest LOG_MAX_RANGE buckets
+void setHistoryRange(struct historyCursor *cursor, unsigned long from, unsigned long to) {
+  for (int tier = HISTORY_TIERS - 1; tier >= 0; tier--) {
+    if(historyTiers[tier].logged) {
+      cursor->tier = tier;
     }
-    xSemaphoreGive(historyMutex);
+  }
+  struct historyTier *tier = &historyTiers[cursor->tier];
+
+  cursor->fromLog = true;
+  cursor->full = true;
+  cursor->since = from > 0 ? myTZ.toUTC(from) / tier->resolution : 0;
+  if(to > 0) {
+    cursor->end = myTZ.toUTC(to) / tier->resolution + 1;
   } else {
-    Serial.println("!!!! Failed to get read mutex !!!!");
+    cursor->end = tier->head.load(std::memory_order_acquire);
+  }
+  if(cursor->end < cursor->since) {
+    cursor->end = cursor->since;
+  }
+  if(cursor->end - cursor->since > LOG_MAX_RANGE) {
+    cursor->since = cursor->end - LOG_MAX_RANGE;
   }
-  retStr += "]";
-  return retStr;
 }
 
-// Get all of the probe data for use in the UI
-String getDataJson() {
-  String retStr = "[";
-  
-  for (int probe = 0; probe < NUM_PROBES; probe++){
-    // if we're not the first probe, add a comma
-    // to continue the list
-    if(probe != 0) {
-      retStr += ", ";
+// Seconds local time is ahead of UTC at a UTC time
+static long utcOffsetAt(unsigned long utc) {
+  return (long)(myTZ.toLocal(utc) - utc);
+}
+
+// Work out the UTC offsets the rows of a reply fall under so a row's local
+// time is one add instead of running the timezone rules for every row.
+// The range is checked TZ_SCAN_STEP at a time and a change is bisected
+// down to the second, a handful of toLocal calls however many rows there
+// are.  Past HISTORY_MAX_OFFSETS changes the last offset sticks, no reply
+// covers that much time
+static void findReplyOffsets(struct historyCursor *cursor) {
+  struct replyOffsets *offsets = &cursor->offsets;
+  int resolution = historyTiers[cursor->tier].resolution;
+  unsigned long t = cursor->since * resolution;
+  unsigned long last = cursor->end * resolution;
+
+  offsets->spans = 1;
+  offsets->span = 0;
+  offsets->from[0] = cursor->since;
+  offsets->offset[0] = utcOffsetAt(t);
+  while(t < last && offsets->spans < HISTORY_MAX_OFFSETS) {
+    long current = offsets->offset[offsets->spans - 1];
+    unsigned long next = min(t + TZ_SCAN_STEP, last);
+    if(utcOffsetAt(next) == current) {
+      t = next;
+      continue;
+    }
+    // the change is somewhere in (t, next]
+    while(next - t > 1) {
+      unsigned long mid = t + (next - t) / 2;
+      if(utcOffsetAt(mid) == current) {
+        t = mid;
+      } else {
+        next = mid;
+      }
     }
-    retStr += "{";
-    retStr += "\"id\": \"" + String(pinConfig.adsChannels[probe]) + "\",";
-    retStr += "\"name\": \"" + String((char *)(pinConfig.probeNames[probe])) + "\",";
-    retStr += "\"data\": " + getProbeDataJson(probe) + ", ";
-    retStr += "\"connected\": " + String(isConnected(probe));
-    retStr += "}";
+    // rows are stamped with the start of their bucket
+    offsets->from[offsets->spans] = (next + resolution - 1) / resolution;
+    offsets->offset[offsets->spans] = utcOffsetAt(next);
+    offsets->spans++;
+    t = next;
   }
-  retStr += "]";
+}
+
+// Local time (seconds) of a bucket in a reply.  Rows mostly come in order
+// so the span only ever moves a step, each probe starts back at the first
+static unsigned long bucketLocalTime(struct historyCursor *cursor, unsigned long bucket) {
+  struct replyOffsets *offsets = &cursor->offsets;
+  while(offsets->span > 0 && bucket < offsets->from[offsets->span]) {
+    offsets->span--;
+  }
+  while(offsets->span + 1 < offsets->spans && bucket >= offsets->from[offsets->span + 1]) {
+    offsets->span++;
+  }
+  return bucket * historyTiers[cursor->tier].resolution + offsets->offset[offsets->span];
+}
 
+// Write a JSON row for a bucket into cursor->pending and return its length
+static size_t jsonRow(struct historyCursor *cursor, unsigned long bucket, float temp) {
+  unsigned long localTime = bucketLocalTime(cursor, bucket);
+  const char *sep = cursor->rows > 0 ? "," : "";
+  cursor->rows++;
+
+  // temp should be null if the probe is disconnected or the sample is nan
+  if(!isConnected(cursor->probe) || isnan(temp)) {
+    return snprintf(cursor->pending, sizeof(cursor->pending), "%s[%lu000,null]", sep, localTime);
+  }
+  return snprintf(cursor->pending, sizeof(cursor->pending), "%s[%lu000,%.2f]", sep, localTime, temp);
+}
+
+// Next row of a downsampled (points=) reply.  The first and last buckets
+// are always sent.  The buckets between are cut into points - 2 slices
+// and each row is the bucket of its slice that makes the biggest triangle
+// with the last row sent and the average of the next slice
+// (Largest-Triangle-Three-Buckets), so spikes and stalls keep their shape.
+// The ahead readers run one slice in front working out its average, so
+// it's one walk over the buckets and nothing is copied.  Buckets with no
+// temp are skipped, a slice with none at all is sent as a null row so gaps
+// still show
+static size_t nextDownsampledRow(struct historyCursor *cursor) {
+  struct lttbState *lttb = &cursor->lttb;
+  int probe = cursor->probe;
+  bool connected = isConnected(probe);
+  unsigned long pick;
+  float temp;
+
+  if(cursor->rows == 0) {
+    lttb->count = cursor->end > cursor->since ? cursor->end - cursor->since : 0;
+    lttb->every = lttb->count > (unsigned long)cursor->points ? (double)(lttb->count - 2) / (cursor->points - 2) : 0;
+    lttb->picked = 0;
+    lttb->aheadSeq = (unsigned long)lttb->every + 1;
+  }
+  unsigned long rows = lttb->every > 0 ? cursor->points : lttb->count;
+  if((unsigned long)cursor->rows >= rows) {
+    cursor->part = HISTORY_PROBE_FOOTER;
+    return 0;
+  }
+
+  if(lttb->every == 0 || cursor->rows == 0 || cursor->rows == cursor->points - 1) {
+    // every bucket, or the first/last one
+    pick = lttb->every == 0 || cursor->rows == 0 ? cursor->rows : lttb->count - 1;
+    temp = getBucketTemp(cursor, cursor->since + pick, probe);
+  } else {
+    unsigned long from = (unsigned long)(lttb->picked * lttb->every) + 1;
+    unsigned long to = (unsigned long)((lttb->picked + 1) * lttb->every) + 1;
+    unsigned long aheadTo = min((unsigned long)((lttb->picked + 2) * lttb->every) + 1, lttb->count);
+
+    // average of the next slice
+    double sumX = 0;
+    double sumY = 0;
+    int samples = 0;
+    for (; lttb->aheadSeq < aheadTo; lttb->aheadSeq++) {
+      float ahead = readBucketTemp(cursor, &lttb->aheadArchive, &lttb->aheadLog, cursor->since + lttb->aheadSeq, probe);
+      if(!isnan(ahead)) {
+        sumX += lttb->aheadSeq;
+        sumY += ahead;
+        samples++;
+      }
+    }
+    // with no last row or no next average, measure against whichever there is
+    double lastY = !isnan(lttb->lastY) ? lttb->lastY : samples > 0 ? sumY / samples : 0;
+    double avgX = samples > 0 ? sumX / samples : (to + aheadTo) / 2.0;
+    double avgY = samples > 0 ? sumY / samples : lastY;
+
+    double bestArea = -1;
+    pick = from;
+    temp = nanf("");
+    for (unsigned long seq = from; seq < to; seq++) {
+      float candidate = getBucketTemp(cursor, cursor->since + seq, probe);
+      if(isnan(candidate)) {
+        continue;
+      }
+      double area = fabs((lttb->lastX - avgX) * (candidate - lastY) - (lttb->lastX - seq) * (avgY - lastY));
+      if(area > bestArea) {
+        bestArea = area;
+        pick = seq;
+        temp = candidate;
+      }
+    }
+    lttb->picked++;
+  }
+
+  lttb->lastX = pick;
+  lttb->lastY = connected ? temp : nanf("");
+  return jsonRow(cursor, cursor->since + pick, temp);
+}
+
+// Write the next piece of the history json into cursor->pending and
+// return its length
+static size_t nextDataJsonPiece(struct historyCursor *cursor) {
+  char *out = cursor->pending;
+  size_t len = sizeof(cursor->pending);
+  struct historyTier *tier = &historyTiers[cursor->tier];
+  int probe = cursor->probe;
+
+  switch(cursor->part) {
+    case HISTORY_HEADER:
+      startHistoryReply(cursor);
+      findReplyOffsets(cursor);
+      cursor->part = HISTORY_PROBE_HEADER;
+      return snprintf(out, len, "{\"seq\": %lu, \"since\": %lu, \"size\": %lu, \"interval\": %d, \"full\": %s, \"probes\": [",
+        cursor->end, cursor->since, replySize(cursor), tier->resolution, cursor->full ? "true" : "false");
+
+    case HISTORY_PROBE_HEADER:
+      cursor->seq = cursor->since;
+      cursor->rows = 0;
+      cursor->part = HISTORY_ROWS;
+      return snprintf(out, len, "%s{\"id\": \"%d\",\"name\": \"%.*s\",\"data\": [",
+        probe != 0 ? ", " : "", pinConfig.probeIds[probe], NAME_LENGTH, pinConfig.probeNames[probe]);
+
+    case HISTORY_ROWS: {
+      if(cursor->points > 0) {
+        return nextDownsampledRow(cursor);
+      }
+      // skip anything that rotated out of the buffer while we were sending
+      if(!cursor->fromLog && cursor->seq < firstBucket(tier)) {
+        cursor->seq = firstBucket(tier);
+      }
+      if(cursor->seq >= cursor->end) {
+        cursor->part = HISTORY_PROBE_FOOTER;
+        return 0;
+      }
+      float temp = getBucketTemp(cursor, cursor->seq, probe);
+      return jsonRow(cursor, cursor->seq++, temp);
+    }
+
+    case HISTORY_PROBE_FOOTER:
+      cursor->probe++;
+      cursor->part = cursor->probe < NUM_PROBES ? HISTORY_PROBE_HEADER : HISTORY_FOOTER;
+      return snprintf(out, len, "], \"connected\": %d}", isConnected(probe));
+
+    case HISTORY_FOOTER:
+      cursor->part = HISTORY_DONE;
+      return snprintf(out, len, "]}");
+
+    default:
+      return 0;
+  }
+}
+
+// Little endian writers for the binary history format
+static size_t putU8(uint8_t *out, uint8_t value) {
+  out[0] = value;
+  return 1;
+}
+static size_t putU16(uint8_t *out, uint16_t value) {
+  out[0] = value & 0xFF;
+  out[1] = value >> 8;
+  return 2;
+}
+static size_t putU32(uint8_t *out, uint32_t value) {
+  putU16(out, value & 0xFFFF);
+  putU16(out + 2, value >> 16);
+  return 4;
+}
+
+// Write the next piece of /getTemps.bin into cursor->pending and return its
+// length.  Layout (little endian):
+//
+//   header: "PRB" version:u8 seq:u32 size:u16 full:u8 probes:u8
+//           base:u32 interval:u16 count:u16
+//           offsets:u8, offsets x (row:u16 minutes:i16)
+//   per probe: id:u8 connected:u8 name:char[NAME_LENGTH]
+//              count x int16 samples
+//
+// Row i is bucket since + i, at UTC time base + i * interval seconds.
+// Its local time is that plus the minutes of the last offset whose row
+// is <= i, the first offset is always row 0.  seq is the bucket to pass as since next time.  Samples are deltas
+// in hundredths of a degree from the previous real sample (starting at 0).
+// BIN_NAN_SAMPLE marks nan/disconnected, BIN_ABS_SAMPLE is followed by an
+// int32 absolute value for jumps too big for an int16
+static size_t nextDataBinPiece(struct historyCursor *cursor) {
+  uint8_t *out = (uint8_t *)cursor->pending;
+  size_t len = 0;
+  struct historyTier *tier = &historyTiers[cursor->tier];
+  int probe = cursor->probe;
+
+  switch(cursor->part) {
+    case HISTORY_HEADER: {
+      startHistoryReply(cursor);
+      findReplyOffsets(cursor);
+      struct replyOffsets *offsets = &cursor->offsets;
+      unsigned long count = cursor->end - cursor->since;
+
+      memcpy(out, "PRB", 3);
+      len += 3;
+      len += putU8(out + len, HISTORY_BIN_VERSION);
+      len += putU32(out + len, cursor->end);
+      len += putU16(out + len, replySize(cursor));
+      len += putU8(out + len, cursor->full);
+      len += putU8(out + len, NUM_PROBES);
+      len += putU32(out + len, cursor->since * tier->resolution);
+      len += putU16(out + len, tier->resolution);
+      len += putU16(out + len, count);
+      len += putU8(out + len, offsets->spans);
+      for (int span = 0; span < offsets->spans; span++) {
+        len += putU16(out + len, offsets->from[span] - cursor->since);
+        len += putU16(out + len, (uint16_t)(int16_t)(offsets->offset[span] / 60));
+      }
+      cursor->part = HISTORY_PROBE_HEADER;
+      return len;
+    }
+
+    case HISTORY_PROBE_HEADER:
+      cursor->seq = cursor->since;
+      cursor->lastCenti = 0;
+      cursor->part = HISTORY_ROWS;
+      len += putU8(out + len, pinConfig.probeIds[probe]);
+      len += putU8(out + len, isConnected(probe));
+      memcpy(out + len, pinConfig.probeNames[probe], NAME_LENGTH);
+      return len + NAME_LENGTH;
+
+    case HISTORY_ROWS: {
+      if(cursor->seq >= cursor->end) {
+        cursor->part = HISTORY_PROBE_FOOTER;
+        return 0;
+      }
+      // rows that rotated out while we were sending still take their slot
+      float temp = getBucketTemp(cursor, cursor->seq, probe);
+      cursor->seq++;
+
+      if(!isConnected(probe) || isnan(temp)) {
+        return putU16(out, (uint16_t)BIN_NAN_SAMPLE);
+      }
+      long centi = lroundf(temp * 100);
+      long delta = centi - cursor->lastCenti;
+      cursor->lastCenti = centi;
+      if(delta > BIN_NAN_SAMPLE && delta < BIN_ABS_SAMPLE) {
+        return putU16(out, (uint16_t)(int16_t)delta);
+      }
+      len += putU16(out, (uint16_t)BIN_ABS_SAMPLE);
+      return len + putU32(out + len, (uint32_t)centi);
+    }
+
+    case HISTORY_PROBE_FOOTER:
+      cursor->probe++;
+      cursor->part = cursor->probe < NUM_PROBES ? HISTORY_PROBE_HEADER : HISTORY_FOOTER;
+      return 0;
+
+    case HISTORY_FOOTER:
+      cursor->part = HISTORY_DONE;
+      return 0;
+
+    default:
+      return 0;
+  }
+}
+
+// Fill buffer with as much of the history reply as fits, picking up where
+// the last call left off.  Returns 0 once the reply is finished.  Only a
+// single piece is ever buffered so memory use doesn't depend on the history size.
+// Nothing is locked, however slow the client is storeData never waits on
+// a reply.  Rows that rotate out while they're being read are sent as null
+size_t fillHistory(struct historyCursor *cursor, uint8_t *buffer, size_t maxLen) {
+  size_t written = 0;
+
+  while(written < maxLen) {
+    // flush whatever is left of the last piece first
+    if(cursor->pendingPos < cursor->pendingLen) {
+      size_t count = min(cursor->pendingLen - cursor->pendingPos, maxLen - written);
+      memcpy(buffer + written, cursor->pending + cursor->pendingPos, count);
+      cursor->pendingPos += count;
+      written += count;
+      continue;
+    }
+    if(cursor->part == HISTORY_DONE) {
+      break;
+    }
+    size_t pieceLen = cursor->binary ? nextDataBinPiece(cursor) : nextDataJsonPiece(cursor);
+    // snprintf reports the untruncated length, never trust more than the buffer
+    cursor->pendingLen = min(pieceLen, sizeof(cursor->pending) - 1);
+    cursor->pendingPos = 0;
+  }
+  return written;
+}
+
+// Get the probe data for use in the UI as a single string. since is the
+// seq value from a previous reply, only newer samples are sent.
+String getDataJson(unsigned long since) {
+  String retStr = "";
+  struct historyCursor cursor;
+  uint8_t buffer[HISTORY_PIECE_SIZE];
+  size_t count;
+
+  cursor.since = since;
+  while((count = fillHistory(&cursor, buffer, sizeof(buffer))) > 0) {
+    retStr.concat((char *)buffer, count);
+  }
   return retStr;
 }
 
 
 // returns the last recorded temperatures for connected probes
 String getLastTempsJson() {
-  String retString = "[";
-  if(xSemaphoreTake(probeLastTempMutex, MUTEX_W_TIMEOUT / portTICK_PERIOD_MS) == pdTRUE) {
-    for(int probe=0; probe < NUM_PROBES;probe++){
-      String tempString = "null";
-
-      // if we're not the first probe, add a comma
-      // to continue the list
-      if(probe != 0) {
-        retString += ", ";
-      }
+  String retString;
+  char piece[HISTORY_PIECE_SIZE];
+  struct temperatureUpdate last;
+  readLastTemps(&last);
+  retString.reserve(NUM_PROBES * 72 + 2); // one allocation for the whole reply
+  retString = "[";
+  for(int probe=0; probe < NUM_PROBES;probe++){
+    char tempString[16] = "null";
 
-      // tempF should be the string null if nan otherwise temp
-      if(isConnected(probe)) {
-        tempString = String(pinConfig.lastTemps[probe]);
-      }
+    // tempF should be the string null if nan otherwise temp
+    if(last.connected[probe]) {
+      snprintf(tempString, sizeof(tempString), "%.2f", last.temperatures[probe]);
+    }
 
-      retString += "{\"id\": \"" + String(pinConfig.adsChannels[probe]) + "\", ";
-      retString += "\"name\": \"" + String(pinConfig.probeNames[probe]) + "\", ";
-      retString += "\"last_temp\": " + tempString + ",";
-      retString += "\"connected\": " + String(pinConfig.connected[probe])+ "}"; ;
-    }    
-  } else {
-  Serial.println("!!! Couldn't get R mutex to read temps");
+    // if we're not the first probe, add a comma
+    // to continue the list
+    snprintf(piece, sizeof(piece), "%s{\"id\": \"%d\", \"name\": \"%.*s\", \"last_temp\": %s,\"connected\": %d}",
+      probe != 0 ? ", " : "", pinConfig.probeIds[probe], NAME_LENGTH, pinConfig.probeNames[probe], tempString,
+      last.connected[probe]);
+    retString += piece;
   }
-  xSemaphoreGive(probeLastTempMutex);
   retString += "]";
   return retString;
 }
@@ -251,25 +1293,24 @@ String lcdLineClear(int length) {
 // Save the config passed in probeConfig to preferences
 // creates a namespace for each probe as needed
 void savePrefs(int probe, struct probeConfig config_data){
-  if(preferences.begin(getPrefNamespace(probe).c_str(), false)){
-    preferences.putBytes("probeName", config_data.probeName, NAME_LENGTH);
-    preferences.end();
-  } else {
-    Serial.println("!!! Couldn't open write prefs probe: " + String(probe));
+  if(!halStorePut(getPrefNamespace(probe), "probeName", config_data.probeName, NAME_LENGTH)) {
+    Serial.println("!!! Couldn't write prefs probe: " + String(probe));
+  }
+}
+
+// Save the archive deadband in tenths of a degree, applyPrefs puts it in
+// use
+void saveArchiveDeadband(int tenths) {
+  int16_t value = constrain(tenths, 0, ARCHIVE_MAX_DEADBAND);
+  if(!halStorePut(PREF_HISTORY_NAME, "deadband", &value, sizeof(value))) {
+    Serial.println("!!! Couldn't write the archive deadband pref");
   }
 }
 
 // load the config for the specified probe
 probeConfig getPrefs(int probe){
   struct probeConfig config_data = {};
-  if(preferences.begin(getPrefNamespace(probe).c_str(), true)) {
-    if(preferences.isKey("probeName")){
-      preferences.getBytes("probeName", &config_data.probeName, NAME_LENGTH);
-    }
-    preferences.end();
-  } else {
-    Serial.println("!!! Failed to get config for probe: " + String(probe));
-  }
+  halStoreGet(getPrefNamespace(probe), "probeName", &config_data.probeName, NAME_LENGTH);
   return config_data;
 }
 
@@ -279,11 +1320,13 @@ String getProbeName(int probe) {
 
 // print the stored config data
 void printConfig() {
+  struct temperatureUpdate last;
+  readLastTemps(&last);
   for (int probe = 0; probe < NUM_PROBES; probe++) {
     Serial.println("Probe " + String(probe));
     Serial.println("\tName: " + String(pinConfig.probeNames[probe]));
-    Serial.println("\tADS Channel: " + String(pinConfig.adsChannels[probe]));
-    Serial.println("\tLast Temp: " + String(pinConfig.lastTemps[probe]));
+    Serial.println("\tADS: chip " + String(probeChip(probe)) + " channel " + String(probeChannel(probe)));
+    Serial.println("\tLast Temp: " + String(last.temperatures[probe]));
   }
 }
 
@@ -302,22 +1345,28 @@ void applyPrefs() {
       strncpy(pinConfig.probeNames[probe], tmpName.c_str(), NAME_LENGTH);
     }
   }
+  // names are in both replies
+  lastTempsGeneration++;
+  historyGeneration++;
+
+  // only buckets archived from here on use it
+  int16_t deadband = ARCHIVE_DEADBAND;
+  halStoreGet(PREF_HISTORY_NAME, "deadband", &deadband, sizeof(deadband));
+  archiveSetDeadband(deadband);
 }
 
-// Clears all of the saved probe prefs and restores pinConfig to default
+// Clears all of the saved prefs and restores pinConfig to default
 void clearPrefs() {
   for (int probe = 0; probe < NUM_PROBES; probe++) {
-    if(preferences.begin(getPrefNamespace(probe).c_str(), false)) {
-      preferences.clear();
-      preferences.end();
-    }
+    halStoreClear(getPrefNamespace(probe));
   }
-  // Reset back to defaults
+  halStoreClear(PREF_HISTORY_NAME);
+  // Reset back to defaults, this also moves the reply generations on
   applyPrefs();
 }
 
 // returns the name for the probes namespace
-// PREF_BASE_NAME + probe id (ads channel id)
+// PREF_BASE_NAME + probe id
 String getPrefNamespace(int probe){
   return PREF_BASE_NAME + String(probe);
 }
\ No newline at end of file
@@ -1,15 +1,9 @@
-#include <ADS1X15.h>
 #include <Arduino.h>
 #include <SPIFFS.h>
+#include <atomic>
 
-#include <CircularBuffer.h>
-
-// Network core
-#include <WiFi.h>
-#include <AsyncTCP.h>
-#include <NTPClient.h>
-#include <WiFiUdp.h>
-#include <ESPAsyncWebServer.h>
+// Anything that touches the board goes through here
+#include "hal.h"
 
 
 // Timers etc are handled in ms. Things related to clock-time
@@ -19,44 +13,89 @@
 // TimeHandling
 #include <Timezone.h>
 #include <TimeLib.h>
-#include <Int64String.h>
-
-#include "secrets.h" // needs to provide WIFI_NAME / WIFI_PW you need to create this
 
 
-#define MAIN_LOOP_INTERVAL 1000 // this is the main loop timer, doesn't control much.
-#define HISTORY_INTERVAL 120// how often to update history samples (SECONDS!)
-#define HISTORY_SIZE 720 
+#define MAIN_LOOP_INTERVAL 1000 // ms between probe scans while temps move at a normal pace, see nextScanInterval
+#define SCAN_FAST_INTERVAL 250 // ms between scans while a probe is moving fast
+#define SCAN_SLOW_INTERVAL 2000 // ms between scans once every probe has settled
+#define SCAN_RATE_WINDOW 10000 // ms of readings each probe is averaged over to see how fast it's moving
+#define SCAN_FAST_RATE 0.2 // F per second, a probe moving faster than this speeds scanning up
+#define SCAN_SLOW_RATE 0.02 // F per second, every probe has to be slower than this for scanning to back off
+#define HISTORY_TIERS 3 // number of history resolutions kept, see historyTiers in probeinator.cpp
 #define MUTEX_W_TIMEOUT 200
 #define MUTEX_R_TIMEOUT 400
-#define READING_COUNT 5 // number of readings to average together per poll
-#define PROBE_READ_DELAY 50 // delay between each probe reading when averaging READING_COUNT
-#define NUM_PROBES 4 // number of probes
+#define READING_COUNT 5 // number of conversions per probe per poll, each one goes through the probe filter
+#define READING_RING_SIZE 8 // raw readings the sampler can get ahead of processing
+#define ACQUISITION_CORE 1 // sampling, processing and the I2C bus, the network stays on the other core
+#define FILTER_MAX_MEDIAN 5 // largest median window a probe filter can use
+#define FILTER_MEDIAN_WINDOW 3 // default median window, knocks out single conversion spikes
+#define FILTER_ALPHA 0.3 // default smoothing applied after the median, 1 = no smoothing
+#define ADS_CHANNELS 4 // inputs per ADS1115
+#define ADS_MAX_CHIPS 4 // ADS1115s the address pin allows, 0x48 - 0x4B
+#define ADS_BASE_ADDRESS 0x48 // I2C address of the first ADS1115, the rest follow on
+#define ADS_READY_PINS {4, 16, 17, 5} // GPIOs wired to each ADS1115's ALERT/RDY pin
+#define ADS_DATA_RATE 7 // ADS1115 data rate setting, 7 = 860 samples per second
+#define ADS_READY_TIMEOUT 5 // ms to wait for the RDY interrupt before giving up on a conversion
+#define I2C_ADC_QUEUE 2 // conversions waiting for the I2C bus task
+#define I2C_DISPLAY_QUEUE 8 // LCD writes waiting for the I2C bus task
+#define I2C_ADC_TIMEOUT 10 // ms a conversion can take including waiting for the bus
+#define TEMP_TABLE_STEP 64 // ADS codes between entries in the code -> temp tables
+#define TEMP_TABLE_SIZE 288 // table entries, covers codes up to ~3.4V at the default gain
+#define MIN_PROBE_RESISTANCE 10000 // anything lower is treated as no probe plugged in
+#ifndef NUM_PROBES
+#define NUM_PROBES 4 // number of probes, up to ADS_CHANNELS per ADS1115
+#endif
+#define ADS_CHIPS ((NUM_PROBES + ADS_CHANNELS - 1) / ADS_CHANNELS) // ADS1115s fitted
+#ifndef HISTORY_RING_SIZE
+#define HISTORY_RING_SIZE 120 // buckets in each of the fine and medium history rings
+#endif
 #define MAX_PROBE_NAME 10
 #define SPLASH_SCREEN_DELAY 6 * 1000
+#define LCD_COLS 20
+#define LCD_ROWS 4
+#define LCD_PROBE_COLS (LCD_COLS / ((NUM_PROBES + LCD_ROWS - 1) / LCD_ROWS)) // columns each probe gets, probes share rows past LCD_ROWS
+#define DISPLAY_RENDER_INTERVAL 250 // ms between passes of the LCD render task
 #define NAME_LENGTH 10
+#define HISTORY_PIECE_SIZE 96 // largest single piece (row, probe header) written by fillHistory
+#define HISTORY_BIN_VERSION 2 // bump when the /getTemps.bin layout changes, along with binVersion in data/index.html
+#define BIN_NAN_SAMPLE INT16_MIN // /getTemps.bin sample for a disconnected probe or nan
+#define BIN_ABS_SAMPLE INT16_MAX // /getTemps.bin sample escape, followed by an int32 absolute value
+#define BUCKET_NAN INT16_MIN // history bucket value when a probe had no readings
+#define ARCHIVE_BLOCKS 32 // compressed history blocks, oldest is evicted when full
+#define ARCHIVE_STREAMS (NUM_PROBES * 3) // min/max/avg per probe
+#define ARCHIVE_BLOCK_SIZE (ARCHIVE_STREAMS * 64 / 3) // bytes per compressed history block, 256 at 4 probes and the same buckets per block at any count
+#define ARCHIVE_RAW_RECORD_BITS (32 + ARCHIVE_STREAMS * 16) // first record of a block
+#define ARCHIVE_MAX_RECORD_BITS (36 + ARCHIVE_STREAMS * 27) // worst case encoded record
+#define ARCHIVE_MIN_RECORDS 3 // worst case records a block has to hold after its raw one
+#define ARCHIVE_MAX_GAP 360 // buckets, a bigger jump forward clears the archive
+#ifndef ARCHIVE_DEADBAND
+#define ARCHIVE_DEADBAND 0 // tenths of a degree an archived value can stray from the line through the ones stored, until /settings saves one
+#endif
+#define ARCHIVE_MAX_DEADBAND 50 // tenths of a degree, the most /settings accepts
+#define ARCHIVE_MAX_HOLD 15 // buckets, every archived value is stored for real at least this often
+#define LOG_PAGE_SIZE 256 // bytes the history log writes to flash at a time
+#define LOG_SEGMENT_PAGES 64 // pages per history log segment file
+#define LOG_SEGMENTS 16 // segment files kept, the oldest is deleted when a new one starts
+#define LOG_QUEUE_PAGES 2 // full pages waiting for the log task to write them
+#define LOG_MAX_RANGE 4096 // most buckets a /getTemps?from=&to= reply will cover
+#define HISTORY_MAX_OFFSETS 4 // UTC offsets one history reply can cross, DST changes twice a year
+#define TZ_SCAN_STEP (7 * 86400UL) // seconds between checks for a UTC offset change, less than any gap between DST changes
+#define HISTORY_MIN_POINTS 3 // smallest points= a downsampled reply takes, the first and last rows plus one
+#define METRIC_BUCKETS 13 // histogram buckets before +Inf, bounds are in metrics.cpp
 
 
 // get some constants out of the way
-static const char* ssid = WIFI_NAME; // SSID
-static const char* password = WIFI_PW; // Password
-
 static const double INPUT_VOLTAGE = 3.30;
 static const double BALANCE_RESISTOR = 22000.0;
 static const double BETA = 3500.0;
 static const double ROOM_TEMP = 298.15;
 static const double RESISTOR_ROOM_TEMP = 200000.0;
+static const double ZERO_C = 273.15;
 
 static const String PREF_BASE_NAME = "probePref";
-
-static double lastUpdate = 0;  // tracks when the last update was made to the storage buffer
+static const String PREF_HISTORY_NAME = "historyPref"; // settings that aren't per probe
 
 
-// Setup some default objects
-ADS1115 static ADS(0x48);
-WiFiUDP static ntpUDP;
-NTPClient static timeClient(ntpUDP);
-AsyncWebServer static webServer(80);
 
 // Setup timezone stuff (assuming US Eastern, change if ya want)
 TimeChangeRule static myDST = {"EDT", Second, Sun, Mar, 2, -240};    // Daylight time = UTC - 4 hours
@@ -64,29 +103,47 @@ TimeChangeRule static mySTD = {"EST", First, Sun, Nov, 2, -300};     // Standard
 Timezone static myTZ(myDST, mySTD);
 
 
-// Read/write mutex on the history array
-SemaphoreHandle_t static historyMutex = xSemaphoreCreateMutex();
-SemaphoreHandle_t static probeLastTempMutex = xSemaphoreCreateMutex();
+// Mutex on the probe names.  The history tiers and last temps don't have
+// one, a single task writes them and readers take snapshots, see storeData
+// and saveLastTemps
 SemaphoreHandle_t static probeNameMutex = xSemaphoreCreateMutex();
-SemaphoreHandle_t static thermistorReadMutex = xSemaphoreCreateMutex();
+// Held while a probe scan is running, one for the whole program rather
+// than a copy per file, see probeinator.cpp
+extern SemaphoreHandle_t thermistorReadMutex;
+
+
+static_assert(ADS_CHIPS <= ADS_MAX_CHIPS, "NUM_PROBES needs more ADS1115s than there are addresses");
+static_assert(ARCHIVE_RAW_RECORD_BITS + ARCHIVE_MIN_RECORDS * ARCHIVE_MAX_RECORD_BITS <= ARCHIVE_BLOCK_SIZE * 8,
+  "ARCHIVE_BLOCK_SIZE is too small to compress anything at this NUM_PROBES");
+static_assert(ARCHIVE_BLOCK_SIZE * 8 <= UINT16_MAX, "archive bit positions are 16 bits");
+
 
+// Probe bank: probes fill the ADS1115s in order, probe n is on channel
+// n % ADS_CHANNELS of chip n / ADS_CHANNELS (address ADS_BASE_ADDRESS + chip)
+static inline int probeChip(int probe) {
+  return probe / ADS_CHANNELS;
+}
+static inline int probeChannel(int probe) {
+  return probe % ADS_CHANNELS;
+}
 
-// Setup our thermistor pins and the corresponding ads channels
-// just mapped using array indexes.
+// Setup our thermistor pins, just mapped using array indexes.
 struct pinDetails {
-  int adsChannels[NUM_PROBES];
+  int probeIds[NUM_PROBES];
   char probeNames[NUM_PROBES][NAME_LENGTH];
-  float lastTemps[NUM_PROBES];
-  bool connected[NUM_PROBES];
 };
 
 // NOTE: Code assumes that the first thermistor and the voltage pin are connected to the 
 // first ads channel.  Default: GPIO_NUM_19, and GPIO_NUM_25 are connected to ads channel 0
-static struct pinDetails pinConfig = {
-  {0,1,2,3}, // Set the ads channels, this also serves as a loose probe id
-  {"probe_0","probe_1","probe_2","probe_3"}, // ... and their default names
-  {nanf(""),nanf(""),nanf(""),nanf("")},
-  {true,true,true,true}
+// One for the whole program, see probeinator.cpp
+extern struct pinDetails pinConfig;
+
+// Raw codes from one scan of every probe, sampler -> processing
+struct rawReading {
+  long updateTime;            // UTC seconds
+  unsigned long sampledAt;    // micros() when the scan finished
+  unsigned long interval;     // ms the sampler was scheduled to wait before the scan
+  double codes[NUM_PROBES];   // filtered ADS codes, nan = no good conversions
 };
 
 // This is used to hold the temperature updates
@@ -97,6 +154,205 @@ struct temperatureUpdate {
 };
 
 
+// Sections of the history reply, in the order fillHistory writes them
+enum historyPart {
+  HISTORY_HEADER,
+  HISTORY_PROBE_HEADER,
+  HISTORY_ROWS,
+  HISTORY_PROBE_FOOTER,
+  HISTORY_FOOTER,
+  HISTORY_DONE
+};
+
+// Where one stream of the compressed history archive expects its next
+// value, on the line through the last two values it stored
+struct archivePredictor {
+  int16_t anchor = BUCKET_NAN;     // last value stored
+  int16_t prevAnchor = BUCKET_NAN; // the one before
+  uint16_t span = 0;               // buckets between them, 0 = hold anchor
+  unsigned long anchorBucket = 0;
+};
+
+// Decoder state for walking the compressed history archive
+struct archiveReader {
+  unsigned long block = 0;   // seq of the block being read
+  unsigned long epoch = 0;   // archiveEpoch when the block was found
+  uint16_t record = 0;       // records already read from the block
+  uint16_t bitPos = 0;
+  bool loaded = false;       // bucket/values hold a decoded record
+  unsigned long bucket = 0;
+  long delta = 0;
+  int16_t values[ARCHIVE_STREAMS];
+  archivePredictor predictors[ARCHIVE_STREAMS];
+  uint8_t leading[ARCHIVE_STREAMS];
+  uint8_t meaningful[ARCHIVE_STREAMS];
+};
+
+// One history bucket for one probe.  Temps are kept as tenths of a degree
+// so all of the tiers fit in the memory the single float history used
+struct historyBucket {
+  int16_t min;
+  int16_t max;
+  int16_t avg;
+};
+
+// A history bucket as it sits in a tier's ring.  storeData fills these in
+// while replies are reading them so the fields are atomics, a reply checks
+// the tier's head afterwards to tell if the slot was reused under it
+struct ringBucket {
+  std::atomic<int16_t> min;
+  std::atomic<int16_t> max;
+  std::atomic<int16_t> avg;
+};
+
+// One closed bucket in the flash history log, stored as is.  Records are
+// logged in the order buckets close so their end times never go backwards
+struct historyLogRecord {
+  uint32_t bucket;
+  uint16_t resolution;                 // seconds per bucket of the tier it came from
+  historyBucket buckets[NUM_PROBES];
+  uint16_t check;                      // fletcher16 of everything above
+};
+
+// Position in the flash history log
+struct historyLogReader {
+  File file;                 // open segment, if any
+  unsigned long segment = 0; // seq of the segment being read
+  int pageRecord = -1;       // >= 0 once reading the page that isn't written yet
+  bool started = false;
+  bool loaded = false;       // record holds a valid record
+  bool done = false;         // ran off the end of the log
+  unsigned long target = 0;  // last bucket asked for by historyLogGet
+  historyLogRecord record;
+};
+
+// Where a downsampled (points=) reply is in the current probe.  The ahead
+// readers average the slice after the one rows are being picked from, see
+// nextDownsampledRow
+struct lttbState {
+  unsigned long count = 0;    // buckets being downsampled
+  double every = 0;           // buckets per picked row, 0 = sending them all
+  int picked = 0;             // slices picked from so far
+  double lastX = 0;           // last row sent, as a bucket offset from since
+  float lastY = 0;            // and its temp, nan if it was null
+  unsigned long aheadSeq = 0; // next bucket offset the ahead readers read
+  archiveReader aheadArchive;
+  historyLogReader aheadLog;
+};
+
+// Which value of each history bucket a reply carries
+enum historyStat {
+  STAT_AVG,
+  STAT_MIN,
+  STAT_MAX
+};
+
+// UTC offsets the rows of a history reply fall under, worked out once per
+// reply.  Span i runs from bucket from[i] up to from[i + 1]
+struct replyOffsets {
+  int spans = 0;
+  unsigned long from[HISTORY_MAX_OFFSETS] = {}; // first bucket of each span
+  long offset[HISTORY_MAX_OFFSETS] = {};        // seconds local time is ahead of UTC
+  int span = 0;                                 // span of the last row written
+};
+
+// Tracks where a /getTemps (or /getTemps.bin) reply is while it's streamed
+// out in chunks. Rows are addressed by bucket number so buckets closed
+// mid-reply don't shift them
+struct historyCursor {
+  bool binary = false;     // true for the /getTemps.bin format
+  int tier = HISTORY_TIERS - 1;
+  historyStat stat = STAT_AVG;
+  unsigned long since = 0; // first bucket to send
+  unsigned long end = 0;   // open bucket when the reply started, not sent
+  unsigned long seq = 0;   // next bucket to write for the current probe
+  long lastCenti = 0;      // last value written, binary samples are deltas from it
+  replyOffsets offsets;    // local time of each row, see findReplyOffsets
+  archiveReader archive;   // position in the archive for archived tiers
+  bool fromLog = false;    // rows come from the flash log (from=&to=)
+  historyLogReader log;
+  int points = 0;          // most rows per probe (JSON only), 0 = every bucket
+  lttbState lttb;
+  bool full = false;
+  int probe = 0;
+  int rows = 0;            // rows written for the current probe
+  historyPart part = HISTORY_HEADER;
+  char pending[HISTORY_PIECE_SIZE]; // piece that didn't fit in the last chunk
+  size_t pendingLen = 0;
+  size_t pendingPos = 0;
+};
+
+// Steinhart-Hart coefficients for a thermistor
+// 1/T = a + b * ln(R) + c * ln(R)^3
+struct thermistorCalibration {
+  double a;
+  double b;
+  double c;
+};
+
+// Settings for the per probe reading filter, a short median to drop spikes
+// feeding an exponential moving average
+struct probeFilterConfig {
+  int medianWindow; // conversions in the median, 1 - FILTER_MAX_MEDIAN
+  float alpha;      // weight of each new median in the average, 0 - 1
+};
+
+// Running state of a probe filter
+struct probeFilter {
+  probeFilterConfig config;
+  double window[FILTER_MAX_MEDIAN]; // last medianWindow conversions
+  int filled;                       // conversions in the window so far
+  int next;                         // slot the next conversion goes in
+  double value;                     // filtered reading, nan until seeded
+};
+
+// Mutexes whose waits are recorded by takeMutex
+enum metricMutex {
+  METRIC_THERMISTOR_MUTEX,
+  METRIC_MUTEXES
+};
+
+// Lock free reads that can have to start over when the writer gets in
+// the way, see metricSnapshotRetry
+enum metricSnapshot {
+  METRIC_SNAPSHOT_LAST_TEMPS, // copy of the last temps taken again
+  METRIC_SNAPSHOT_HISTORY,    // history row dropped, its slot was reused mid-read
+  METRIC_SNAPSHOTS
+};
+
+// The points where a lock free read has its copy and is about to check
+// the writer didn't get in the way
+enum snapshotCheck {
+  SNAPSHOT_CHECK_LAST_TEMPS,
+  SNAPSHOT_CHECK_RING,
+  SNAPSHOT_CHECK_ARCHIVE
+};
+
+// Nothing on the board.  The native build (SNAPSHOT_HOOKS) calls into the
+// stress test there so it can land a write in exactly that gap
+#ifdef SNAPSHOT_HOOKS
+void snapshotCheckpoint(int);
+#define SNAPSHOT_CHECKPOINT(check) snapshotCheckpoint(check)
+#else
+#define SNAPSHOT_CHECKPOINT(check)
+#endif
+
+// Devices on the I2C bus, for the bus metrics
+enum metricDevice {
+  METRIC_DEVICE_ADC,
+  METRIC_DEVICE_LCD,
+  METRIC_DEVICES
+};
+
+// Replies whose serialization time is recorded
+enum metricReply {
+  METRIC_REPLY_LAST_TEMPS,
+  METRIC_REPLY_HISTORY_CHUNK,
+  METRIC_REPLY_HISTORY_EVENT,
+  METRIC_REPLY_METRICS,
+  METRIC_REPLIES
+};
+
 // probe config update struct
 struct probeConfig {
   char probeName[NAME_LENGTH];
@@ -106,15 +362,40 @@ struct probeConfig {
 // Data storage
 //
 
-// using a float here, most of the data is a double, 
-// but this structure wont fit in memory as a double :)
-static CircularBuffer<float,HISTORY_SIZE> temperatureHistories[NUM_PROBES];
-static CircularBuffer<int,HISTORY_SIZE> temperatureHistoryTimes;
+// A ring of fixed size buckets.  Bucket n covers the seconds
+// [n * resolution, (n + 1) * resolution) and lives in slot n % size, so
+// the time of a bucket comes from its number and no time buffer is needed.
+// Archived tiers only keep the head bucket in the ring, closed buckets are
+// compressed into the archive (historyArchive.cpp).  Only storeData writes
+// a tier, it moves head on before reusing a slot so readers can check a
+// bucket they read is still in the ring
+struct historyTier {
+  int resolution;                      // seconds per bucket
+  int size;                            // buckets kept
+  ringBucket (*buckets)[NUM_PROBES];
+  bool archived;
+  bool logged;                         // closed buckets go to the flash log
+  std::atomic<unsigned long> head;     // bucket number being filled, buckets before it are closed
+  std::atomic<int> count;              // buckets in use including head
+  float sum[NUM_PROBES];               // running total for the head bucket avg
+  int samples[NUM_PROBES];
+};
 
 // Prototypes
 bool isConnected(int);
-double getThermistorVoltage(int);
+void scanProbes(double*);
+bool sampleProbes();
+int processReadings();
+int nextScanInterval();
+void acquireTemps();
+void setProbeFilter(int, struct probeFilterConfig);
+void initProbeFilters();
 double getTempK(double, double, double, double);
+double getTempKSteinhartHart(struct thermistorCalibration, double);
+thermistorCalibration betaCalibration(double, double, double);
+void setProbeCalibration(int, struct thermistorCalibration);
+void initTempTables();
+float codeToTempF(int, double);
 double getResistance(double, double, double);
 double kToC(double);
 double cToF(double);
@@ -127,17 +408,61 @@ void savePrefs(int, struct probeConfig);
 void printConfig();
 void clearPrefs();
 String getPrefNamespace(int);
-String getProbeDataJson(int);
-String getDataJson();
+int pickHistoryTier(unsigned long);
+void archiveClear();
+void archiveAppend(unsigned long, const historyBucket*);
+bool archiveGet(struct archiveReader*, unsigned long, int, historyBucket*);
+bool archiveEmpty();
+unsigned long archiveFirstBucket();
+void archiveSetDeadband(int);
+int archiveGetDeadband();
+void archiveUsage(unsigned long*, unsigned long*);
+void printArchiveStats();
+void initHistoryLog();
+void historyLogAppend(unsigned long, int, const historyBucket*);
+void historyLogRewind(struct historyLogReader*, unsigned long);
+bool historyLogNext(struct historyLogReader*);
+bool historyLogGet(struct historyLogReader*, int, unsigned long, int, historyBucket*);
+void printHistoryLogStats();
+void restoreHistory();
+void setHistoryRange(struct historyCursor*, unsigned long, unsigned long);
+size_t fillHistory(struct historyCursor*, uint8_t*, size_t);
+String getDataJson(unsigned long);
 String getLastTempsJson();
+void readLastTemps(struct temperatureUpdate*);
+unsigned long getLastTempsGeneration();
+unsigned long getHistoryGeneration();
+void metricAcquireTime(unsigned long);
+void metricAdcTime(int, unsigned long);
+void metricSerializeTime(int, unsigned long);
+bool takeMutex(SemaphoreHandle_t, int, int);
+void metricSnapshotRetry(int);
+void metricReadingLatency(unsigned long);
+void metricScanInterval(unsigned long, unsigned long);
+void metricRingDepth(int);
+void metricRingDropped();
+void metricBusTime(int, unsigned long);
+void metricBusQueue(int, int);
+void metricBusDropped(int);
+String getMetricsText();
+void initDisplay();
+void startDisplayTask();
+void displayPrint(int, int, const char*);
+void displayLine(int, const char*);
+void displayClear();
+void displayInvalidate();
+int displayFlush();
 String getTimeString(time_t);
 String zeroPad(int);
 String lcdLineClear(int);
 String getProbeName(int probe);
 probeConfig getPrefs(int);
 
-//
-// Web server handling prototypes
-void initWebRoutes();
-String savePrefData(AsyncWebServerRequest*);
-void applyPrefs();
\ No newline at end of file
+void applyPrefs();
+void saveArchiveDeadband(int);
+
+// Live update hooks, webHandlers.cpp
+void publishLastTemps();
+void publishHistory(unsigned long);
+void sendEvents();
+void printCacheStats();
\ No newline at end of file
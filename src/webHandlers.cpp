@@ -1,4 +1,52 @@
-#include "probeinator.h"
+#include <climits>
+#include <memory>
+#include <MD5Builder.h>
+#include "webHandlers.h"
+
+// Live updates for the UI, see publishLastTemps/publishHistory
+AsyncEventSource events("/events");
+
+// Events the processing task has asked for.  It only sets these and wakes
+// the events task, which does the serializing and sending on the web
+// server's core.  A tick that comes before the last one was sent folds
+// into it, so history keeps the oldest seq clients could be holding
+#define NO_HISTORY_EVENT ULONG_MAX
+static std::atomic<bool> lastTempsPending(false);
+static std::atomic<unsigned long> historyPending(NO_HISTORY_EVENT); // seq the rows go after
+static QueueHandle_t eventsWake = xQueueCreate(1, 1);
+
+// Serialized /getLastTemps reply, shared by every client and the event
+// stream until the temps generation moves on
+struct cachedReply {
+  unsigned long generation = 0; // 0 = nothing cached yet
+  String body;
+};
+static cachedReply lastTempsCache;
+static SemaphoreHandle_t replyCacheMutex = xSemaphoreCreateMutex();
+
+// Changes every boot so ETags from before a reboot never match
+static uint32_t bootTag = 0;
+
+// UI pages.  The build gzips data/ (tools/gzip_data.py) so SPIFFS holds
+// path + ".gz", the plain file is only used if that's missing
+struct staticAsset {
+  const char *path;
+  const char *contentType;
+  String file;  // what's actually on SPIFFS, set by initStaticAssets
+  String etag;  // md5 of file
+  bool gzipped;
+};
+static staticAsset staticAssets[] = {
+  {"/index.html", "text/html"},
+  {"/settings.html", "text/html"}
+};
+#define ASSET_INDEX 0
+#define ASSET_SETTINGS 1
+
+// How well the cache is doing, see /getCacheStats
+static unsigned long cacheHits = 0;
+static unsigned long cacheMisses = 0;
+static unsigned long cacheNotModified = 0;
 
 void initWebRoutes(){
 
@@ -6,32 +54,75 @@ void initWebRoutes(){
   Serial.println("Starting web server");
   webServer.begin();
   Serial.println("Setting routes");
+  bootTag = esp_random();
 
   // Load the main ui
   webServer.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
-    request->send(SPIFFS, "/index.html");
+    sendAsset(request, ASSET_INDEX, true);
   });
 
   // load the settings page
   webServer.on("/settings", HTTP_GET, [](AsyncWebServerRequest *request){
-    request->send(SPIFFS, "/settings.html");
+    sendAsset(request, ASSET_SETTINGS, true);
   });
 
-  // get temp history
+  // get temp history.  Streamed straight out of the history buffers a
+  // chunk at a time, see sendHistory for the query params
   webServer.on("/getTemps", HTTP_GET, [](AsyncWebServerRequest *request){
-      String tempData = getDataJson();
-      request->send(200, "application/json", tempData);
+      sendHistory(request, false);
+  });
+
+  // same as /getTemps in the compact binary layout described in
+  // nextDataBinPiece, the UI uses it for the first full load
+  webServer.on("/getTemps.bin", HTTP_GET, [](AsyncWebServerRequest *request){
+      sendHistory(request, true);
+  });
+
+  // push live temps and new history rows instead of having every client poll
+  events.onConnect([](AsyncEventSourceClient *client){
+    client->send("hello", NULL, millis(), EVENT_RETRY);
+  });
+  webServer.addHandler(&events);
+  startEventsTask();
+
+  // settings that aren't per probe, for the settings page
+  webServer.on("/getSettings", HTTP_GET, [](AsyncWebServerRequest *request){
+    request->send(200, "application/json", "{\"archive_deadband\": " + String(archiveGetDeadband() / 10.0, 1) + "}");
   });
 
   // get the most recent temps
   webServer.on("/getLastTemps", HTTP_GET, [](AsyncWebServerRequest *request){
-    String tempData = getLastTempsJson();
-    request->send(200, "application/json", tempData);
+    String etag = replyETag('t', getLastTempsGeneration());
+    if(notModified(request, etag)) {
+      return;
+    }
+    AsyncWebServerResponse *response = request->beginResponse(200, "application/json", getCachedLastTemps());
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache");
+    request->send(response);
+  });
+
+  // reply cache counters
+  webServer.on("/getCacheStats", HTTP_GET, [](AsyncWebServerRequest *request){
+    request->send(200, "application/json", "{\"hits\": " + String(cacheHits) +
+      ", \"misses\": " + String(cacheMisses) +
+      ", \"notModified\": " + String(cacheNotModified) + "}");
+  });
+
+  // Prometheus scrape target, see metrics.cpp
+  webServer.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    unsigned long started = micros();
+    String body = getMetricsText();
+    body += "# HELP probeinator_wifi_rssi_dbm Signal strength of the Wi-Fi connection\n";
+    body += "# TYPE probeinator_wifi_rssi_dbm gauge\n";
+    body += "probeinator_wifi_rssi_dbm " + String(WiFi.RSSI()) + "\n";
+    metricSerializeTime(METRIC_REPLY_METRICS, micros() - started);
+    request->send(200, "text/plain; version=0.0.4", body);
   });
 
   webServer.on("/clearPrefs", HTTP_GET, [](AsyncWebServerRequest *request){
     clearPrefs();
-    request->send(SPIFFS, "/settings.html");
+    sendAsset(request, ASSET_SETTINGS, false);
   });
 
   // save the config to preferences
@@ -40,13 +131,225 @@ void initWebRoutes(){
     errors = savePrefData(request);
     applyPrefs();
     // printConfig();
-    request->send(SPIFFS, "/settings.html");
+    sendAsset(request, ASSET_SETTINGS, false);
   });
 }
 
 
+// Have the latest temps sent to every connected client.  Called by the
+// processing task, never allocates or waits
+void publishLastTemps(){
+  lastTempsPending.store(true, std::memory_order_release);
+  uint8_t wake = 0;
+  xQueueSend(eventsWake, &wake, 0); // already full = the task is already due to run
+}
+
+// Have the graph rows after lastSeq (the seq clients should be holding)
+// sent to every connected client.  Clients that are somewhere else
+// refetch.  Called by the processing task, never allocates or waits
+void publishHistory(unsigned long lastSeq){
+  unsigned long none = NO_HISTORY_EVENT;
+  historyPending.compare_exchange_strong(none, lastSeq, std::memory_order_release, std::memory_order_relaxed);
+  uint8_t wake = 0;
+  xQueueSend(eventsWake, &wake, 0);
+}
+
+// Send whatever has been published since the last call.  Each event is
+// serialized once no matter how many clients there are, and not at all
+// when there are none.  The events task's job, the native soak and bench
+// call it themselves
+void sendEvents() {
+  bool lastTemps = lastTempsPending.exchange(false, std::memory_order_acquire);
+  unsigned long lastSeq = historyPending.exchange(NO_HISTORY_EVENT, std::memory_order_acquire);
+  if(events.count() == 0) {
+    return;
+  }
+  if(lastTemps) {
+    String tempData = getCachedLastTemps();
+    events.send(tempData.c_str(), "lastTemps", millis());
+  }
+  if(lastSeq != NO_HISTORY_EVENT) {
+    unsigned long started = micros();
+    String tempData = getDataJson(lastSeq);
+    metricSerializeTime(METRIC_REPLY_HISTORY_EVENT, micros() - started);
+    events.send(tempData.c_str(), "history", millis());
+  }
+}
+
+static void eventsTask(void *params) {
+  uint8_t wake;
+  while(1) {
+    xQueueReceive(eventsWake, &wake, portMAX_DELAY);
+    sendEvents();
+  }
+}
+
+void startEventsTask() {
+  xTaskCreatePinnedToCore(eventsTask, "events", 4096, NULL, 2, NULL, EVENTS_CORE);
+}
+
+// Find the files behind the UI pages and hash them for their ETags.  Only
+// done once, SPIFFS doesn't change while we're running.  Call once SPIFFS
+// is mounted
+void initStaticAssets() {
+  for (staticAsset &asset : staticAssets) {
+    String gzipPath = String(asset.path) + ".gz";
+    asset.gzipped = SPIFFS.exists(gzipPath);
+    asset.file = asset.gzipped ? gzipPath : String(asset.path);
+
+    File file = SPIFFS.open(asset.file, FILE_READ);
+    if(!file) {
+      Serial.println("!!! Missing UI file " + asset.file);
+      continue;
+    }
+    MD5Builder md5;
+    md5.begin();
+    md5.addStream(file, file.size());
+    md5.calculate();
+    asset.etag = "\"" + md5.toString() + "\"";
+    file.close();
+  }
+}
+
+// Send a UI page.  Cacheable pages carry an ETag and a max-age and get a
+// 304 if the browser already has them, pages sent as the result of an
+// action (clearPrefs, updateConfig) are sent in full and never cached
+void sendAsset(AsyncWebServerRequest *request, int index, bool cacheable) {
+  staticAsset *asset = &staticAssets[index];
+  if(cacheable && asset->etag.length() > 0 && notModified(request, asset->etag)) {
+    return;
+  }
+
+  AsyncWebServerResponse *response = request->beginResponse(SPIFFS, asset->file, asset->contentType);
+  if(asset->gzipped) {
+    response->addHeader("Content-Encoding", "gzip");
+  }
+  if(cacheable && asset->etag.length() > 0) {
+    response->addHeader("ETag", asset->etag);
+    response->addHeader("Cache-Control", "max-age=" + String(STATIC_MAX_AGE));
+  } else {
+    response->addHeader("Cache-Control", "no-store");
+  }
+  request->send(response);
+}
+
+// The /getLastTemps reply, only serialized again once the temps have
+// changed.  The generation is read before building so a change that races
+// the build just means one extra rebuild
+String getCachedLastTemps() {
+  unsigned long generation = getLastTempsGeneration();
+  String body;
+  if(xSemaphoreTake(replyCacheMutex, MUTEX_R_TIMEOUT / portTICK_PERIOD_MS) == pdTRUE) {
+    if(lastTempsCache.generation == generation) {
+      cacheHits++;
+      body = lastTempsCache.body;
+      xSemaphoreGive(replyCacheMutex);
+      return body;
+    }
+    cacheMisses++;
+    xSemaphoreGive(replyCacheMutex);
+  } else {
+    Serial.println("!!! Couldn't get reply cache mutex");
+    return getLastTempsJson();
+  }
+
+  unsigned long started = micros();
+  body = getLastTempsJson();
+  metricSerializeTime(METRIC_REPLY_LAST_TEMPS, micros() - started);
+  if(xSemaphoreTake(replyCacheMutex, MUTEX_W_TIMEOUT / portTICK_PERIOD_MS) == pdTRUE) {
+    lastTempsCache.generation = generation;
+    lastTempsCache.body = body;
+    xSemaphoreGive(replyCacheMutex);
+  }
+  return body;
+}
+
+// ETag for a reply of the given kind at a generation
+String replyETag(char kind, unsigned long generation) {
+  return "\"" + String(bootTag, HEX) + "-" + String(kind) + String(generation) + "\"";
+}
+
+// Answer with a 304 if the client already has the reply tagged etag
+bool notModified(AsyncWebServerRequest *request, const String &etag) {
+  if(!request->hasHeader("If-None-Match") || request->getHeader("If-None-Match")->value() != etag) {
+    return false;
+  }
+  cacheNotModified++;
+  AsyncWebServerResponse *response = request->beginResponse(304);
+  response->addHeader("ETag", etag);
+  request->send(response);
+  return true;
+}
+
+void printCacheStats() {
+  Serial.println("Reply cache: " + String(cacheHits) + " hits, " + String(cacheMisses) +
+    " misses, " + String(cacheNotModified) + " not modified");
+}
+
+// Stream the temp history.  Query params:
+//   window=<seconds>  use the finest history tier covering that much time
+//   stat=min|max|avg  which value of each bucket to send (default avg)
+//   since=<seq>       only buckets newer than the seq from a previous reply
+//   from=<t>&to=<t>   local time range in seconds read from the flash log,
+//                     either can be left off.  window and since are ignored
+//   points=<n>        at most n rows per probe picked to keep the shape of
+//                     the graph (LTTB), the whole range is sent and since
+//                     is ignored.  JSON only, .bin has a row per bucket
+// Rows from the compressed archive (the default, coarsest tier) can be off
+// by up to the archive deadband on /settings, exact when it's 0.  from/to
+// and the finer tiers are always exact
+// History replies are too big to keep a copy of, so they're tagged with the
+// history generation and only the 304 path is cached
+void sendHistory(AsyncWebServerRequest *request, bool binary){
+    String etag = replyETag('h', getHistoryGeneration());
+    if(notModified(request, etag)) {
+      return;
+    }
+    std::shared_ptr<historyCursor> cursor = std::make_shared<historyCursor>();
+    cursor->binary = binary;
+    if(request->hasParam("window")) {
+      cursor->tier = pickHistoryTier(request->getParam("window")->value().toInt());
+    }
+    if(request->hasParam("stat")) {
+      String stat = request->getParam("stat")->value();
+      if(stat == "min") {
+        cursor->stat = STAT_MIN;
+      } else if(stat == "max") {
+        cursor->stat = STAT_MAX;
+      }
+    }
+    if(request->hasParam("since")) {
+      cursor->since = request->getParam("since")->value().toInt();
+    }
+    if(request->hasParam("points")) {
+      long points = request->getParam("points")->value().toInt();
+      cursor->points = points > 0 ? max(points, (long)HISTORY_MIN_POINTS) : 0;
+    }
+    if(request->hasParam("from") || request->hasParam("to")) {
+      unsigned long from = request->hasParam("from") ? request->getParam("from")->value().toInt() : 0;
+      unsigned long to = request->hasParam("to") ? request->getParam("to")->value().toInt() : 0;
+      setHistoryRange(cursor.get(), from, to);
+    }
+    AsyncWebServerResponse *response = request->beginChunkedResponse(binary ? "application/octet-stream" : "application/json",
+      [cursor](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        unsigned long started = micros();
+        size_t written = fillHistory(cursor.get(), buffer, maxLen);
+        metricSerializeTime(METRIC_REPLY_HISTORY_CHUNK, micros() - started);
+        return written;
+      });
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache");
+    request->send(response);
+}
+
 // This handles saving the preference data from the settings page
 String savePrefData(AsyncWebServerRequest *request){
+    // the history form only has the deadband, in degrees
+    if(request->hasParam("archiveDeadband", true)) {
+      saveArchiveDeadband(lroundf(request->getParam("archiveDeadband", true)->value().toFloat() * 10));
+      return "";
+    }
+
     int probe = -1;
     String errors = "";
     int params = request->params();
@@ -70,7 +373,7 @@ String savePrefData(AsyncWebServerRequest *request){
     }
 
     // We found a probe and we don't have any errors
-    if(probe > -1 && errors.length() == 0) {
+    if(probe > -1 && probe < NUM_PROBES && errors.length() == 0) {
       savePrefs(probe, config_data);
     } else {
       Serial.println("Bad probe id or errors when saving\n\tErrors: " + errors + String(errors.length()));
@@ -0,0 +1,26 @@
+#include "probeinator.h"
+
+// Network core
+#include <WiFi.h>
+#include <AsyncTCP.h>
+#include <ESPAsyncWebServer.h>
+
+
+#define EVENT_RETRY 2000 // ms browsers wait before reconnecting to /events
+#define EVENTS_CORE (1 - ACQUISITION_CORE) // the events task serializes with the web server, off the acquisition core
+#define STATIC_MAX_AGE 86400 // seconds browsers keep the UI pages before revalidating
+
+AsyncWebServer static webServer(80);
+
+
+//
+// Web server handling prototypes
+void initWebRoutes();
+void startEventsTask();
+void initStaticAssets();
+void sendAsset(AsyncWebServerRequest*, int, bool);
+void sendHistory(AsyncWebServerRequest*, bool);
+String getCachedLastTemps();
+String replyETag(char, unsigned long);
+bool notModified(AsyncWebServerRequest*, const String&);
+String savePrefData(AsyncWebServerRequest*);
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+# Build the native env for each NUM_PROBES / HISTORY_RING_SIZE combination,
+# run its microbenchmarks (src/native/bench.cpp) and save the results.
+#
+#   tools/bench.py -o bench.json                # this build
+#   tools/bench.py -o new.json -b old.json      # and compare against another
+#
+# With -b anything more than --threshold percent slower, or allocating more
+# or sending more to the LCD per op, is listed and the exit status is 1
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+PROBES = [4, 8, 16]
+RINGS = [120, 480]
+
+project_dir = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def run_config(probes, ring):
+    build_dir = os.path.join(project_dir, ".pio", "bench", "%dx%d" % (probes, ring))
+    env = dict(os.environ)
+    env["PLATFORMIO_BUILD_DIR"] = build_dir
+    env["PLATFORMIO_BUILD_FLAGS"] = "-O2 -DNUM_PROBES=%d -DHISTORY_RING_SIZE=%d" % (probes, ring)
+    subprocess.run(["pio", "run", "-e", "native", "-s"], cwd=project_dir, env=env, check=True)
+
+    out = subprocess.run([os.path.join(build_dir, "native", "program"), "bench"],
+                         cwd=project_dir, check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout
+    results = [json.loads(line) for line in out.splitlines() if line.startswith("{")]
+    for result in results:
+        print("%-24s probes %d ring %4d  %12.1f ns/op  %7.2f allocs/op  %9.1f bytes/op  %7d largest alloc  "
+              "%7.1f lcd bus bytes/op" % (
+                  result["bench"], probes, ring, result["ns_per_op"], result["allocs_per_op"], result["bytes_per_op"],
+                  result["largest_alloc"], result["lcd_bus_bytes_per_op"]))
+    return results
+
+
+def key(result):
+    return (result["bench"], result["probes"], result["ring"])
+
+
+def compare(results, baseline, threshold):
+    old = {key(result): result for result in baseline["results"]}
+    regressions = 0
+    for result in results:
+        before = old.get(key(result))
+        if before is None:
+            continue
+        slower = (result["ns_per_op"] / before["ns_per_op"] - 1) * 100 if before["ns_per_op"] else 0
+        more_bus = result["lcd_bus_bytes_per_op"] > before.get("lcd_bus_bytes_per_op", result["lcd_bus_bytes_per_op"])
+        bigger_alloc = result["largest_alloc"] > before.get("largest_alloc", result["largest_alloc"])
+        if slower > threshold or result["allocs_per_op"] > before["allocs_per_op"] or more_bus or bigger_alloc:
+            regressions += 1
+            print("REGRESSION %-24s probes %d ring %4d  %.1f -> %.1f ns/op (%+.0f%%)  %.2f -> %.2f allocs/op  "
+                  "%d -> %d largest alloc" % (
+                      result["bench"], result["probes"], result["ring"], before["ns_per_op"], result["ns_per_op"],
+                      slower, before["allocs_per_op"], result["allocs_per_op"],
+                      before.get("largest_alloc", result["largest_alloc"]), result["largest_alloc"]))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the probeinator microbenchmarks")
+    parser.add_argument("-o", "--output", default="bench.json", help="where to write the results")
+    parser.add_argument("-b", "--baseline", help="results from another build to compare against")
+    parser.add_argument("--threshold", type=float, default=10, help="percent slower that counts as a regression")
+    args = parser.parse_args()
+
+    results = []
+    for probes in PROBES:
+        for ring in RINGS:
+            results += run_config(probes, ring)
+
+    revision = subprocess.run(["git", "describe", "--always", "--dirty"], cwd=project_dir,
+                              stdout=subprocess.PIPE, universal_newlines=True).stdout.strip()
+    with open(args.output, "w") as f:
+        json.dump({"revision": revision, "results": results}, f, indent=1)
+    print("bench: %d results written to %s" % (len(results), args.output))
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        regressions = compare(results, baseline, args.threshold)
+        print("bench: %d regressions against %s (%s)" % (regressions, args.baseline, baseline.get("revision")))
+        return 1 if regressions else 0
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
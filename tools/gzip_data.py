@@ -0,0 +1,27 @@
+# PlatformIO pre script: gzip everything in data/ into the directory the
+# SPIFFS image is built from (data_dir in platformio.ini).  The web server
+# sends the .gz copies with Content-Encoding: gzip, see sendAsset.
+# mtime is pinned so unchanged files give the same bytes and the same ETag
+Import("env")
+
+import gzip
+import os
+import shutil
+
+src_dir = os.path.join(env.subst("$PROJECT_DIR"), "data")
+out_dir = env.subst("$PROJECT_DATA_DIR")
+
+if os.path.isdir(out_dir):
+    shutil.rmtree(out_dir)
+os.makedirs(out_dir)
+
+for name in sorted(os.listdir(src_dir)):
+    src = os.path.join(src_dir, name)
+    if not os.path.isfile(src):
+        continue
+    with open(src, "rb") as f:
+        data = f.read()
+    with open(os.path.join(out_dir, name + ".gz"), "wb") as out:
+        with gzip.GzipFile(filename="", mode="wb", fileobj=out, compresslevel=9, mtime=0) as gz:
+            gz.write(data)
+    print("gzip_data: %s %d -> %d bytes" % (name, len(data), os.path.getsize(out.name)))
@@ -0,0 +1,307 @@
+#!/usr/bin/env python3
+# Point N simulated browsers at the web API and measure what it costs.
+# Each one replays what index.html does without /events: a page load
+# (/ and /getTemps.bin), /getLastTemps every 5 s and /getTemps?since= every
+# 30 s, with ETags like a browser.  Now and then one opens the settings
+# page and saves a probe name (/settings, /getLastTemps, /updateConfig).
+#
+#   tools/loadtest.py -n 6                        # native build, pio run -e native first
+#   tools/loadtest.py -n 6 --url http://10.0.0.7  # a board on the LAN
+#
+# /metrics is scraped before and after a quiet spell and again after the
+# load, so the scan interval and jitter (and the reading latency) can be
+# compared with and without the clients.  Prints p50/p99 latency and bytes
+# per route, -o saves everything as JSON
+import argparse
+import http.client
+import json
+import os
+import random
+import re
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+import urllib.parse
+
+TEMP_INTERVAL = 5      # seconds, tempUpdateInterval in index.html
+GRAPH_INTERVAL = 30    # seconds, graphUpdateInterval in index.html
+NATIVE_PORT = 8080     # SERVE_PORT in src/native/main.cpp
+
+project_dir = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+class Stats:
+    """Latency and bytes per route, shared by every client"""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.routes = {}
+
+    def add(self, route, status, seconds, size):
+        with self.lock:
+            entry = self.routes.setdefault(route, {"latencies": [], "bytes": 0, "statuses": {}})
+            entry["latencies"].append(seconds)
+            entry["bytes"] += size
+            entry["statuses"][str(status)] = entry["statuses"].get(str(status), 0) + 1
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    if not ordered:
+        return 0
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+class Browser(threading.Thread):
+    """One open copy of index.html, on its own keep-alive connection"""
+
+    def __init__(self, host, port, stats, stop, settings_every, reload_every):
+        super().__init__(daemon=True)
+        self.host = host
+        self.port = port
+        self.stats = stats
+        self.stop = stop
+        self.settings_every = settings_every
+        self.reload_every = reload_every
+        self.etags = {}
+        self.cache = {} # bodies that go with the etags
+        self.connection = None
+        self.seq = None
+
+    def request(self, route, path, method="GET", body=None):
+        headers = {}
+        if method == "GET" and path in self.etags:
+            headers["If-None-Match"] = self.etags[path]
+        if body is not None:
+            headers["Content-Type"] = "application/x-www-form-urlencoded"
+        for attempt in range(2):
+            try:
+                if self.connection is None:
+                    self.connection = http.client.HTTPConnection(self.host, self.port, timeout=30)
+                started = time.monotonic()
+                self.connection.request(method, path, body=body, headers=headers)
+                response = self.connection.getresponse()
+                data = response.read()
+                self.stats.add(route, response.status, time.monotonic() - started, len(data))
+                if response.status == 304:
+                    return 200, self.cache.get(path, b"")
+                if response.getheader("ETag"):
+                    self.etags[path] = response.getheader("ETag")
+                    self.cache[path] = data
+                return response.status, data
+            except (OSError, http.client.HTTPException):
+                # the server closed a kept alive connection, try once on a new one
+                if self.connection is not None:
+                    self.connection.close()
+                self.connection = None
+        self.stats.add(route, "error", 0, 0)
+        return None, b""
+
+    def load_page(self):
+        self.request("/", "/")
+        status, data = self.request("/getTemps.bin", "/getTemps.bin")
+        if status == 200 and len(data) >= 8:
+            self.seq = struct.unpack_from("<I", data, 4)[0]
+
+    def update_graph(self):
+        status, data = self.request("/getTemps", "/getTemps?since=%d" % self.seq)
+        if status == 200:
+            self.seq = json.loads(data)["seq"]
+
+    def open_settings(self):
+        self.request("/settings", "/settings")
+        status, data = self.request("/getLastTemps", "/getLastTemps")
+        if status == 200:
+            probe = random.choice(json.loads(data))
+            body = urllib.parse.urlencode({"probeName": probe["name"], "probe": probe["id"]})
+            self.request("/updateConfig", "/updateConfig", "POST", body)
+
+    def run(self):
+        # browsers don't all open at the same moment
+        if self.stop.wait(random.uniform(0, TEMP_INTERVAL)):
+            return
+        self.load_page()
+        now = time.monotonic()
+        next_temps = now
+        next_graph = now + GRAPH_INTERVAL
+        next_settings = now + random.uniform(0, self.settings_every) if self.settings_every else None
+        next_reload = now + self.reload_every if self.reload_every else None
+        while not self.stop.is_set():
+            now = time.monotonic()
+            if next_reload is not None and now >= next_reload:
+                self.load_page()
+                next_reload = now + self.reload_every
+            if now >= next_temps:
+                self.request("/getLastTemps", "/getLastTemps")
+                next_temps = now + TEMP_INTERVAL
+            if now >= next_graph and self.seq is not None:
+                self.update_graph()
+                next_graph = now + GRAPH_INTERVAL
+            if next_settings is not None and now >= next_settings:
+                self.open_settings()
+                next_settings = now + self.settings_every
+            waits = [next_temps, next_graph] + [t for t in (next_settings, next_reload) if t is not None]
+            self.stop.wait(max(0, min(waits) - time.monotonic()))
+        if self.connection is not None:
+            self.connection.close()
+
+
+def scrape(host, port):
+    """The /metrics samples as {"name{labels}": value}"""
+    connection = http.client.HTTPConnection(host, port, timeout=30)
+    connection.request("GET", "/metrics")
+    text = connection.getresponse().read().decode()
+    connection.close()
+    samples = {}
+    for line in text.splitlines():
+        if line and not line.startswith("#"):
+            name, value = line.rsplit(" ", 1)
+            samples[name] = float(value)
+    return samples
+
+
+def histogram_quantile(before, after, name, fraction):
+    """Quantile of what a histogram saw between two scrapes, interpolated
+    inside the bucket it falls in like Prometheus does"""
+    buckets = []
+    for key, value in after.items():
+        match = re.fullmatch(re.escape(name) + r'_bucket\{le="([^"]+)"\}', key)
+        if match:
+            bound = float("inf") if match.group(1) == "+Inf" else float(match.group(1))
+            buckets.append((bound, value - before.get(key, 0)))
+    buckets.sort()
+    total = buckets[-1][1] if buckets else 0
+    if total == 0:
+        return None
+    rank = fraction * total
+    lower, below = 0, 0
+    for bound, count in buckets:
+        if count >= rank:
+            if bound == float("inf"):
+                return lower
+            return lower + (bound - lower) * (rank - below) / max(count - below, 1e-9)
+        lower, below = bound, count
+    return lower
+
+
+def acquisition(before, after):
+    """Scan interval, jitter and reading latency between two scrapes"""
+    scans = after["probeinator_scan_interval_seconds_count"] - before["probeinator_scan_interval_seconds_count"]
+    spent = after["probeinator_scan_interval_seconds_sum"] - before["probeinator_scan_interval_seconds_sum"]
+    dropped = "probeinator_reading_ring_dropped_total"
+    return {
+        "scans": int(scans),
+        "interval_ms": spent / scans * 1000 if scans else None,
+        "jitter_p50_ms": ms(histogram_quantile(before, after, "probeinator_scan_jitter_seconds", 0.5)),
+        "jitter_p99_ms": ms(histogram_quantile(before, after, "probeinator_scan_jitter_seconds", 0.99)),
+        "reading_latency_p99_ms": ms(histogram_quantile(before, after, "probeinator_reading_latency_seconds", 0.99)),
+        "dropped": int(after.get(dropped, 0) - before.get(dropped, 0)),
+    }
+
+
+def ms(seconds):
+    return None if seconds is None else seconds * 1000
+
+
+def start_native(port, script):
+    program = os.path.join(project_dir, ".pio", "build", "native", "program")
+    if not os.path.exists(program):
+        subprocess.run(["pio", "run", "-e", "native", "-s"], cwd=project_dir, check=True)
+    command = [program, "serve", str(port)] + ([script] if script else [])
+    server = subprocess.Popen(command, cwd=project_dir, stdout=subprocess.DEVNULL)
+    for attempt in range(50):
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1).close()
+            return server
+        except OSError:
+            time.sleep(0.1)
+    server.kill()
+    raise SystemExit("loadtest: native server didn't come up on port %d" % port)
+
+
+def print_acquisition(label, result):
+    def show(value):
+        return "%8.2f" % value if value is not None else "       -"
+    print("%-6s %6d scans  interval %s ms  jitter p50 %s p99 %s ms  reading latency p99 %s ms  %d dropped" % (
+        label, result["scans"], show(result["interval_ms"]), show(result["jitter_p50_ms"]),
+        show(result["jitter_p99_ms"]), show(result["reading_latency_p99_ms"]), result["dropped"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test the probeinator web API with simulated browsers")
+    parser.add_argument("-n", "--clients", type=int, default=4, help="browsers to simulate")
+    parser.add_argument("-d", "--duration", type=float, default=120, help="seconds of load")
+    parser.add_argument("--quiet", type=float, default=30, help="seconds with no clients first, for the baseline")
+    parser.add_argument("--url", help="board to test, e.g. http://10.0.0.7 (default: start the native build)")
+    parser.add_argument("--port", type=int, default=NATIVE_PORT, help="port for the native build")
+    parser.add_argument("--script", help="cook script for the native build")
+    parser.add_argument("--settings-every", type=float, default=300, help="seconds between settings saves per client, 0 = never")
+    parser.add_argument("--reload-every", type=float, default=0, help="seconds between page reloads per client, 0 = never")
+    parser.add_argument("-o", "--output", help="write the results here as JSON")
+    args = parser.parse_args()
+
+    server = None
+    if args.url:
+        target = urllib.parse.urlparse(args.url)
+        host, port = target.hostname, target.port or 80
+    else:
+        host, port = "127.0.0.1", args.port
+        server = start_native(port, args.script)
+
+    try:
+        print("loadtest: %.0f s quiet, then %d clients for %.0f s against %s:%d" % (
+            args.quiet, args.clients, args.duration, host, port))
+        start = scrape(host, port)
+        time.sleep(args.quiet)
+        quiet = scrape(host, port)
+
+        stats = Stats()
+        stop = threading.Event()
+        browsers = [Browser(host, port, stats, stop, args.settings_every, args.reload_every) for _ in range(args.clients)]
+        for browser in browsers:
+            browser.start()
+        time.sleep(args.duration)
+        loaded = scrape(host, port)
+        stop.set()
+        for browser in browsers:
+            browser.join()
+    finally:
+        if server is not None:
+            server.kill()
+
+    routes = {}
+    print("%-14s %7s %9s %9s %9s %12s  %s" % ("route", "count", "p50 ms", "p99 ms", "max ms", "bytes", "statuses"))
+    for route, entry in sorted(stats.routes.items()):
+        latencies = entry["latencies"]
+        routes[route] = {
+            "count": len(latencies),
+            "p50_ms": percentile(latencies, 0.5) * 1000,
+            "p99_ms": percentile(latencies, 0.99) * 1000,
+            "max_ms": max(latencies) * 1000,
+            "bytes": entry["bytes"],
+            "statuses": dict(entry["statuses"]),
+        }
+        result = routes[route]
+        print("%-14s %7d %9.1f %9.1f %9.1f %12d  %s" % (route, result["count"], result["p50_ms"], result["p99_ms"],
+                                                       result["max_ms"], result["bytes"],
+                                                       " ".join("%s:%d" % item for item in sorted(result["statuses"].items()))))
+
+    baseline = acquisition(start, quiet)
+    under_load = acquisition(quiet, loaded)
+    print_acquisition("quiet", baseline)
+    print_acquisition("load", under_load)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump({"clients": args.clients, "duration": args.duration, "routes": routes,
+                       "acquisition": {"quiet": baseline, "load": under_load}}, f, indent=1)
+        print("loadtest: results written to %s" % args.output)
+    errors = sum(entry["statuses"].get("error", 0) for entry in stats.routes.values())
+    return 1 if errors else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())